@@ -3,13 +3,89 @@
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
 \echo Use "CREATE EXTENSION pg_follower" to load this file. \quit
 
--- Start to follow
-CREATE FUNCTION start_follow(text)
+-- Start to follow. Tables are split into ngroups groups, and each of them is
+-- followed by its own replication slot and worker.
+CREATE FUNCTION start_follow(text, ngroups int DEFAULT 1)
 RETURNS void
 AS 'MODULE_PATHNAME'
 PARALLEL RESTRICTED
 LANGUAGE C;
 
+-- Apply messages recorded by pg_follower.capture_file, and return how fast
+-- they were applied.
+CREATE FUNCTION pg_follower_replay(path text,
+    OUT messages bigint, OUT bytes bigint, OUT elapsed interval)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_follower_replay(text) FROM PUBLIC;
+
+-- Return the upstream LSN up to which changes have been applied.
+CREATE FUNCTION pg_follower_applied_lsn()
+RETURNS pg_lsn
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- Wait until changes up to the upstream LSN have been applied. Returns false
+-- if the timeout expires first.
+CREATE FUNCTION pg_follower_wait_for_lsn(lsn pg_lsn, timeout interval DEFAULT NULL)
+RETURNS boolean
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- Return upstream transactions which took longer than
+-- pg_follower.slow_transaction_threshold to apply, from the oldest one.
+CREATE FUNCTION pg_follower_slow_transactions(
+    OUT group_index int, OUT end_time timestamptz, OUT xid xid,
+    OUT begin_lsn pg_lsn, OUT end_lsn pg_lsn, OUT duration interval,
+    OUT inserts bigint, OUT updates bigint, OUT deletes bigint,
+    OUT others bigint, OUT rows bigint, OUT bytes bigint,
+    OUT slowest_statement text, OUT slowest_duration interval)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_follower_slow_transactions() FROM PUBLIC;
+
+-- Compare a table with the upstream one, and return ranges of the primary
+-- key in which rows differ. The table is split into chunks, and chunks which
+-- differ are split again until they hold at most min_rows rows.
+CREATE FUNCTION pg_follower_verify(relation regclass, conninfo text,
+    chunks int DEFAULT 16, min_rows bigint DEFAULT 100)
+RETURNS TABLE (lower_bound text, upper_bound text,
+    upstream_rows bigint, follower_rows bigint)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_follower_verify(regclass, text, int, bigint) FROM PUBLIC;
+
+-- Progress of upstream transactions which are committed partially by
+-- pg_follower.bulk_load_tables, one row per table group
+CREATE TABLE pg_follower_bulk_progress (
+    group_index int PRIMARY KEY,
+    begin_lsn pg_lsn NOT NULL,
+    records bigint NOT NULL
+);
+
+-- CREATE INDEX commands deferred by pg_follower.defer_index_build which are
+-- not built yet, in the order they were received
+CREATE TABLE pg_follower_deferred_indexes (
+    group_index int NOT NULL,
+    seq int NOT NULL,
+    query text NOT NULL,
+    PRIMARY KEY (group_index, seq)
+);
+
+-- Triggers changed to ENABLE ALWAYS by pg_follower.always_fire_triggers, and
+-- their previous tgenabled, which is restored when they are not listed
+CREATE TABLE pg_follower_enabled_triggers (
+    relid oid NOT NULL,
+    tgname name NOT NULL,
+    tgenabled "char" NOT NULL,
+    PRIMARY KEY (relid, tgname)
+);
+
 -- Trigger function
 CREATE FUNCTION detect_ddl()
 RETURNS event_trigger
@@ -19,5 +95,11 @@ LANGUAGE C;
 -- Event trigger
 CREATE EVENT TRIGGER test_trigger
 ON ddl_command_end
-WHEN TAG in ('CREATE TABLE', 'DROP TABLE')
+WHEN TAG in ('CREATE TABLE', 'CREATE INDEX', 'ALTER TABLE')
+EXECUTE FUNCTION detect_ddl();
+
+-- DROP TABLE is logged before the table is gone, to find its table group
+CREATE EVENT TRIGGER test_drop_trigger
+ON ddl_command_start
+WHEN TAG in ('DROP TABLE')
 EXECUTE FUNCTION detect_ddl();
@@ -15,12 +15,21 @@
 #include "postgres.h"
 #include "fmgr.h"
 
+#include "catalog/dependency.h"
+#include "catalog/index.h"
 #include "catalog/namespace.h"
+#include "catalog/partition.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_constraint.h"
 #include "commands/event_trigger.h"
+#include "executor/spi.h"
 #include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
 #include "replication/message.h"
+#include "tcop/deparse_utility.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/ruleutils.h"
 
 PG_MODULE_MAGIC;
 
@@ -28,42 +37,67 @@ PG_FUNCTION_INFO_V1(detect_ddl);
 
 static void handle_createstmt(CreateStmt *stmt);
 static void handle_dropstmt(DropStmt *stmt);
+static void handle_indexstmt(IndexStmt *stmt);
+static void handle_altertablestmt(AlterTableStmt *stmt);
+static void log_ddl_message(const char *relname, const char *query);
+static char *group_relname(Oid relid);
 
-static char *
-deparse_dropstmt(DropStmt *stmt)
+/*
+ * Emit the deparsed DDL to the WAL as a logical decoding message.
+ *
+ * The prefix contains the name of the target table, so that the output plugin
+ * can choose messages for the table group without parsing the statement.
+ */
+static void
+log_ddl_message(const char *relname, const char *query)
 {
-	StringInfoData	deparsed;
-	ListCell	   *lc;
-	bool			first_try = true;
+	char *prefix = psprintf("pg_follower:%s", relname);
 
-	Assert(stmt->removeType == OBJECT_TABLE);
+	elog(DEBUG1, "deparse result: %s", query);
 
-	initStringInfo(&deparsed);
-	appendStringInfo(&deparsed, "DROP TABLE %s ",
-					 stmt->missing_ok ? "IF EXISTS" : "");
+	LogLogicalMessage(prefix, query, strlen(query), true, false);
 
-	foreach(lc, stmt->objects)
+	pfree(prefix);
+}
+
+/*
+ * Return the name of the table which determines the table group of the given
+ * one. Partitions belong to the group of their root table, so that the whole
+ * partition tree is followed by one worker.
+ */
+static char *
+group_relname(Oid relid)
+{
+	if (get_rel_relispartition(relid))
 	{
-		RangeVar *rel = makeRangeVarFromNameList((List *) lfirst(lc));
+		List	   *ancestors = get_partition_ancestors(relid);
 
-		/* Only parmanent tables are supported */
-		if (rel->relpersistence != RELPERSISTENCE_PERMANENT)
-		{
-			elog(INFO, "detected");
-			continue;
-		}
+		relid = llast_oid(ancestors);
+		list_free(ancestors);
+	}
 
+	return get_rel_name(relid);
+}
 
-		if (!first_try)
-			appendStringInfoString(&deparsed, ", ");
+/*
+ * Deparse DropStmt structure for the given table. Tables are dropped one by
+ * one because they might belong to different table groups.
+ */
+static char *
+deparse_dropstmt(DropStmt *stmt, RangeVar *rel)
+{
+	StringInfoData	deparsed;
 
-		if (rel->schemaname)
-			appendStringInfo(&deparsed, "%s.%s", rel->schemaname, rel->relname);
-		else
-			appendStringInfoString(&deparsed, rel->relname);
+	Assert(stmt->removeType == OBJECT_TABLE);
 
-		first_try = false;
-	}
+	initStringInfo(&deparsed);
+	appendStringInfo(&deparsed, "DROP TABLE %s ",
+					 stmt->missing_ok ? "IF EXISTS" : "");
+
+	if (rel->schemaname)
+		appendStringInfo(&deparsed, "%s.%s", rel->schemaname, rel->relname);
+	else
+		appendStringInfoString(&deparsed, rel->relname);
 
 	switch (stmt->behavior)
 	{
@@ -85,16 +119,35 @@ deparse_dropstmt(DropStmt *stmt)
 static void
 handle_dropstmt(DropStmt *stmt)
 {
-	char *query;
+	ListCell   *lc;
 
-	query = deparse_dropstmt(stmt);
+	foreach(lc, stmt->objects)
+	{
+		RangeVar   *rel = makeRangeVarFromNameList((List *) lfirst(lc));
+		Oid			relid;
+		char	   *query;
 
-	elog(DEBUG1, "deparse result: %s", query);
+		/* Only parmanent tables are supported */
+		if (rel->relpersistence != RELPERSISTENCE_PERMANENT)
+		{
+			elog(INFO, "detected");
+			continue;
+		}
 
-	/* Emit the result to the log. */
-	LogLogicalMessage("pg_follower", query, strlen(query), true, false);
+		/*
+		 * The table is still there because this runs when the command
+		 * starts, so partitions can be logged under the group of their root.
+		 */
+		relid = RangeVarGetRelid(rel, NoLock, true);
 
-	pfree(query);
+		query = deparse_dropstmt(stmt, rel);
+
+		/* Emit the result to the log. */
+		log_ddl_message(OidIsValid(relid) ? group_relname(relid) : rel->relname,
+						query);
+
+		pfree(query);
+	}
 }
 
 /*
@@ -112,22 +165,11 @@ verify_createstatement(CreateStmt *stmt)
 		return false;
 	}
 
-	/* PARTITION OF clause is not supported */
-	if (stmt->partspec != NULL)
-	{
-		elog(WARNING, "partition tables are not supported");
-		return false;
-	}
-
-	/* PARTITION BY clause is not supported */
-	if (stmt->partspec != NULL)
-	{
-		elog(WARNING, "partitioned tables are not supported");
-		return false;
-	}
-
-	/* INHERITS clause is not supported */
-	if (stmt->inhRelations != NIL)
+	/*
+	 * INHERITS clause is not supported. The parent of PARTITION OF is stored
+	 * as well, but it is fine.
+	 */
+	if (stmt->inhRelations != NIL && stmt->partbound == NULL)
 	{
 		elog(WARNING, "inherited tables are not supported");
 		return false;
@@ -140,6 +182,13 @@ verify_createstatement(CreateStmt *stmt)
 		return false;
 	}
 
+	/*
+	 * Columns of partitions are copied from the parent, and their options are
+	 * ignored.
+	 */
+	if (stmt->partbound != NULL)
+		return true;
+
 	/*
 	 * TypeName must have valid "names" attribute.
 	 *
@@ -149,6 +198,17 @@ verify_createstatement(CreateStmt *stmt)
 	{
 		ColumnDef  *colDef = lfirst(lc);
 
+		/* Table constraints are read from the catalog, see deparse_constraints() */
+		if (IsA(colDef, Constraint))
+			continue;
+
+		/* LIKE clause is not supported */
+		if (!IsA(colDef, ColumnDef))
+		{
+			elog(WARNING, "LIKE clause is not supported");
+			return false;
+		}
+
 		if (colDef->typeName->names == NIL)
 		{
 			elog(WARNING, "not supported");
@@ -160,6 +220,121 @@ verify_createstatement(CreateStmt *stmt)
 }
 
 
+/*
+ * Append PRIMARY KEY and UNIQUE constraints of the given relation to the
+ * deparsed CREATE TABLE statement.
+ *
+ * The parse-tree is not used here because column and table constraints are
+ * moved around while the statement is transformed. The catalog has them in
+ * a normalized form, and pg_get_constraintdef() can print them. Constraints
+ * inherited from the parent partitioned table are created by the downstream
+ * as well, so they are skipped.
+ */
+static void
+deparse_constraints(StringInfo deparsed, Oid relid)
+{
+	Oid		argtypes[1] = {OIDOID};
+	Datum	values[1];
+	int		ret;
+
+	values[0] = ObjectIdGetDatum(relid);
+
+	SPI_connect();
+
+	ret = SPI_execute_with_args("SELECT conname, pg_catalog.pg_get_constraintdef(oid) "
+								"FROM pg_catalog.pg_constraint "
+								"WHERE conrelid = $1 AND contype IN ('p', 'u') "
+								"AND conparentid = 0 "
+								"ORDER BY contype, oid",
+								1, argtypes, values, NULL, false, 0);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to read constraints of relation %u: %d", relid, ret);
+
+	for (uint64 i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+
+		appendStringInfo(deparsed, ", CONSTRAINT %s %s",
+						 quote_identifier(SPI_getvalue(tuple, tupdesc, 1)),
+						 SPI_getvalue(tuple, tupdesc, 2));
+	}
+
+	SPI_finish();
+}
+
+/*
+ * Append the partition bound and the partition key of the given relation, if
+ * any, as printed by pg_get_expr() and pg_get_partkeydef().
+ */
+static void
+deparse_partitioning(StringInfo deparsed, Oid relid)
+{
+	Oid		argtypes[1] = {OIDOID};
+	Datum	values[1];
+	char   *bound;
+	char   *partkey;
+	int		ret;
+
+	values[0] = ObjectIdGetDatum(relid);
+
+	SPI_connect();
+
+	ret = SPI_execute_with_args("SELECT pg_catalog.pg_get_expr(relpartbound, oid), "
+								"pg_catalog.pg_get_partkeydef(oid) "
+								"FROM pg_catalog.pg_class WHERE oid = $1",
+								1, argtypes, values, NULL, false, 1);
+
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+		elog(ERROR, "failed to read partitioning of relation %u: %d", relid, ret);
+
+	bound = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+	partkey = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2);
+
+	if (bound)
+		appendStringInfo(deparsed, " %s", bound);
+
+	if (partkey)
+		appendStringInfo(deparsed, " PARTITION BY %s", partkey);
+
+	SPI_finish();
+}
+
+/*
+ * Deparse CreateStmt structure for PARTITION OF. Columns are not printed
+ * because they are copied from the parent.
+ */
+static char *
+deparse_partitionstmt(CreateStmt *stmt, Oid relid)
+{
+	StringInfoData	deparsed;
+	StringInfoData	constraints;
+	Oid				parentid = get_partition_parent(relid, false);
+
+	initStringInfo(&deparsed);
+	appendStringInfo(&deparsed, "CREATE TABLE %s %s.%s PARTITION OF %s.%s",
+					 stmt->if_not_exists ? "IF NOT EXISTS" : "",
+					 stmt->relation->schemaname, stmt->relation->relname,
+					 get_namespace_name(get_rel_namespace(parentid)),
+					 get_rel_name(parentid));
+
+	/* Constraints of the partition itself, without the leading comma */
+	initStringInfo(&constraints);
+	deparse_constraints(&constraints, relid);
+
+	if (constraints.len > 0)
+		appendStringInfo(&deparsed, " ( %s )", constraints.data + 2);
+
+	deparse_partitioning(&deparsed, relid);
+
+	appendStringInfoChar(&deparsed, ';');
+
+	pfree(constraints.data);
+
+	return deparsed.data;
+}
+
 /*
  * Deparse CreateStmt structure. Returns deparsed result.
  */
@@ -169,6 +344,10 @@ deparse_createstmt(CreateStmt *stmt)
 	StringInfoData	deparsed;
 	ListCell	   *lc;
 	bool			first_try = true;
+	Oid				relid = RangeVarGetRelid(stmt->relation, NoLock, false);
+
+	if (stmt->partbound != NULL)
+		return deparse_partitionstmt(stmt, relid);
 
 	initStringInfo(&deparsed);
 	appendStringInfo(&deparsed, "CREATE TABLE %s %s.%s ( ",
@@ -178,7 +357,13 @@ deparse_createstmt(CreateStmt *stmt)
 	foreach(lc, stmt->tableElts)
 	{
 		ColumnDef  *colDef = lfirst(lc);
-		char	   *typename = NameListToString(colDef->typeName->names);
+		char	   *typename;
+
+		/* Constraints would be added later */
+		if (!IsA(colDef, ColumnDef))
+			continue;
+
+		typename = NameListToString(colDef->typeName->names);
 
 		if (!first_try)
 			appendStringInfoString(&deparsed, ", ");
@@ -189,7 +374,13 @@ deparse_createstmt(CreateStmt *stmt)
 		first_try = false;
 	}
 
-	appendStringInfo(&deparsed, " );");
+	deparse_constraints(&deparsed, relid);
+
+	appendStringInfo(&deparsed, " )");
+
+	deparse_partitioning(&deparsed, relid);
+
+	appendStringInfoChar(&deparsed, ';');
 
 	return deparsed.data;
 }
@@ -205,14 +396,241 @@ handle_createstmt(CreateStmt *stmt)
 
 	query = deparse_createstmt(stmt);
 
-	elog(DEBUG1, "deparse result: %s", query);
-
 	/* Emit the result to the log. */
-	LogLogicalMessage("pg_follower", query, strlen(query), true, false);
+	log_ddl_message(group_relname(RangeVarGetRelid(stmt->relation, NoLock, false)),
+					query);
 
 	pfree(query);
 }
 
+/*
+ * Deparse created indexes. They are read via pg_event_trigger_ddl_commands()
+ * because the name of the index might be chosen while executing.
+ *
+ * An index on a partitioned table is created on its partitions as well by
+ * the downstream, and they are not listed here.
+ */
+static void
+handle_indexstmt(IndexStmt *stmt)
+{
+	int		ret;
+
+	SPI_connect();
+
+	ret = SPI_execute("SELECT objid FROM pg_catalog.pg_event_trigger_ddl_commands() "
+					  "WHERE object_type = 'index'",
+					  false, 0);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to read created indexes: %d", ret);
+
+	for (uint64 i = 0; i < SPI_processed; i++)
+	{
+		bool	isnull;
+		Oid		indexoid;
+		Oid		heapoid;
+		char   *query;
+
+		indexoid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+												  SPI_tuptable->tupdesc,
+												  1, &isnull));
+		heapoid = IndexGetRelation(indexoid, false);
+
+		/* Only indexes on parmanent tables can be replicated */
+		if (get_rel_persistence(heapoid) != RELPERSISTENCE_PERMANENT ||
+			(get_rel_relkind(heapoid) != RELKIND_RELATION &&
+			 get_rel_relkind(heapoid) != RELKIND_PARTITIONED_TABLE))
+		{
+			elog(WARNING, "indexes on unsupported relations are not replicated");
+			continue;
+		}
+
+		/*
+		 * pg_get_indexdef_string() prints a schema-qualified statement
+		 * including expressions and predicates. CONCURRENTLY is not printed
+		 * because the downstream builds the index inside a transaction.
+		 */
+		query = psprintf("%s;", pg_get_indexdef_string(indexoid));
+
+		/* Emit the result to the log. */
+		log_ddl_message(group_relname(heapoid), query);
+
+		pfree(query);
+	}
+
+	SPI_finish();
+}
+
+/*
+ * Find ADD CONSTRAINT ... USING INDEX in the original statement which created
+ * the given constraint. The name of the index is only found there, because
+ * the index is renamed after the constraint.
+ */
+static Constraint *
+find_using_index(AlterTableStmt *stmt, const char *conname)
+{
+	ListCell   *lc;
+
+	foreach(lc, stmt->cmds)
+	{
+		AlterTableCmd *cmd = lfirst(lc);
+		Constraint *constraint = (Constraint *) cmd->def;
+
+		if (cmd->subtype != AT_AddConstraint || !IsA(constraint, Constraint) ||
+			constraint->indexname == NULL)
+			continue;
+
+		if (strcmp(constraint->conname ? constraint->conname :
+				   constraint->indexname, conname) == 0)
+			return constraint;
+	}
+
+	return NULL;
+}
+
+/*
+ * Deparse PRIMARY KEY and UNIQUE constraints added by ALTER TABLE. The
+ * subcommands are read via pg_event_trigger_ddl_commands() because they are
+ * transformed while executing, e.g. ADD PRIMARY KEY becomes an index, and the
+ * name of the constraint might be chosen then. Other subcommands are not
+ * replicated.
+ *
+ * ADD CONSTRAINT ... USING INDEX is replicated as-is, so that the downstream
+ * attaches its copy of the index instead of building another one. Otherwise
+ * the definition is printed by pg_get_constraintdef().
+ */
+static void
+handle_altertablestmt(AlterTableStmt *stmt)
+{
+	List	   *conoids = NIL;
+	List	   *using_index = NIL;
+	ListCell   *lc1;
+	ListCell   *lc2;
+	int			ret;
+
+	SPI_connect();
+
+	ret = SPI_execute("SELECT command FROM pg_catalog.pg_event_trigger_ddl_commands()",
+					  false, 0);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to read altered tables: %d", ret);
+
+	for (uint64 i = 0; i < SPI_processed; i++)
+	{
+		bool		isnull;
+		CollectedCommand *cmd;
+		ListCell   *lc;
+
+		cmd = (CollectedCommand *) DatumGetPointer(SPI_getbinval(SPI_tuptable->vals[i],
+																 SPI_tuptable->tupdesc,
+																 1, &isnull));
+
+		if (cmd->type != SCT_AlterTable)
+			continue;
+
+		foreach(lc, cmd->d.alterTable.subcmds)
+		{
+			CollectedATSubcmd *subcmd = lfirst(lc);
+			AlterTableCmd *atcmd = (AlterTableCmd *) subcmd->parsetree;
+			Oid			conoid = InvalidOid;
+
+			switch (atcmd->subtype)
+			{
+				case AT_AddIndex:
+					/* Indexes are only added for constraints */
+					if (subcmd->address.classId == RelationRelationId)
+						conoid = get_index_constraint(subcmd->address.objectId);
+					break;
+				case AT_AddConstraint:
+				case AT_AddIndexConstraint:
+					if (subcmd->address.classId == ConstraintRelationId)
+						conoid = subcmd->address.objectId;
+					break;
+				default:
+					break;
+			}
+
+			if (OidIsValid(conoid))
+			{
+				conoids = lappend_oid(conoids, conoid);
+				using_index = lappend_int(using_index,
+										  atcmd->subtype == AT_AddIndexConstraint);
+			}
+		}
+	}
+
+	forboth(lc1, conoids, lc2, using_index)
+	{
+		Oid			argtypes[1] = {OIDOID};
+		Datum		values[1];
+		bool		isnull;
+		Oid			relid;
+		char	   *relname;
+		char	   *conname;
+		char	   *contype;
+		Constraint *constraint = NULL;
+		char	   *query;
+
+		values[0] = ObjectIdGetDatum(lfirst_oid(lc1));
+
+		ret = SPI_execute_with_args("SELECT conrelid, conname, contype, "
+									"pg_catalog.pg_get_constraintdef(oid) "
+									"FROM pg_catalog.pg_constraint "
+									"WHERE oid = $1 AND contype IN ('p', 'u') "
+									"AND conparentid = 0",
+									1, argtypes, values, NULL, false, 1);
+
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "failed to read constraint %u: %d", lfirst_oid(lc1), ret);
+
+		/* Not a PRIMARY KEY or UNIQUE constraint */
+		if (SPI_processed == 0)
+			continue;
+
+		relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+											   SPI_tuptable->tupdesc,
+											   1, &isnull));
+		conname = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2);
+		contype = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 3);
+
+		/* Only constraints on parmanent tables can be replicated */
+		if (get_rel_persistence(relid) != RELPERSISTENCE_PERMANENT ||
+			(get_rel_relkind(relid) != RELKIND_RELATION &&
+			 get_rel_relkind(relid) != RELKIND_PARTITIONED_TABLE))
+		{
+			elog(WARNING, "constraints on unsupported relations are not replicated");
+			continue;
+		}
+
+		relname = quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+											 get_rel_name(relid));
+
+		if (lfirst_int(lc2))
+			constraint = find_using_index(stmt, conname);
+
+		if (constraint != NULL)
+			query = psprintf("ALTER TABLE %s ADD CONSTRAINT %s %s USING INDEX %s%s%s;",
+							 relname, quote_identifier(conname),
+							 contype[0] == CONSTRAINT_PRIMARY ? "PRIMARY KEY" : "UNIQUE",
+							 quote_identifier(constraint->indexname),
+							 constraint->deferrable ? " DEFERRABLE" : "",
+							 constraint->initdeferred ? " INITIALLY DEFERRED" : "");
+		else
+			query = psprintf("ALTER TABLE %s ADD CONSTRAINT %s %s;",
+							 relname, quote_identifier(conname),
+							 SPI_getvalue(SPI_tuptable->vals[0],
+										  SPI_tuptable->tupdesc, 4));
+
+		/* Emit the result to the log. */
+		log_ddl_message(group_relname(relid), query);
+
+		pfree(query);
+	}
+
+	SPI_finish();
+}
+
 /*
  * Trigger function
  */
@@ -235,7 +653,17 @@ detect_ddl(PG_FUNCTION_ARGS)
 			handle_createstmt((CreateStmt *) trigdata->parsetree);
 			break;
 		case CMDTAG_DROP_TABLE:
-			handle_dropstmt((DropStmt *) trigdata->parsetree);
+			/* Dropped tables are not known any more when the command ends */
+			if (strcmp(trigdata->event, "ddl_command_start") == 0)
+				handle_dropstmt((DropStmt *) trigdata->parsetree);
+			break;
+		case CMDTAG_CREATE_INDEX:
+			handle_indexstmt((IndexStmt *) trigdata->parsetree);
+			break;
+		case CMDTAG_ALTER_TABLE:
+			/* RENAME and SET SCHEMA have the same tag, but are not supported */
+			if (IsA(trigdata->parsetree, AlterTableStmt))
+				handle_altertablestmt((AlterTableStmt *) trigdata->parsetree);
 			break;
 		default:
 			elog(WARNING, "this DDL is not supported: %s",
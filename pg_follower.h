@@ -0,0 +1,33 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_follower.h
+ *
+ * IDENTIFICATION
+ *		pg_follower/pg_follower.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_FOLLOWER_H
+#define PG_FOLLOWER_H
+
+#include "access/xlogdefs.h"
+
+/* Prefix of logical messages which carry records forwarded by a relay */
+#define PFW_RELAY_PREFIX "pg_follower_relay"
+
+/*
+ * First byte of an insert batch record, which holds rows inserted into a
+ * table in column-major form. Other records are SQL commands, so they never
+ * start with it. See flush_insert_batch() in pg_follower_output.c.
+ */
+#define PFW_INSERT_BATCH '\x01'
+
+/* Exported by pg_follower_output.c */
+extern bool pfw_is_binary_batch_type(Oid typid);
+
+/* Exported by pg_follower_apply.c */
+extern XLogRecPtr pfw_get_applied_lsn(void);
+extern bool pfw_wait_for_applied_lsn(XLogRecPtr lsn, long timeout);
+extern RepOriginId pfw_get_relay_origin(void);
+
+#endif							/* PG_FOLLOWER_H */
@@ -11,61 +11,597 @@
 #include "postgres.h"
 #include "fmgr.h"
 
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/nbtree.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/twophase.h"
+#include "access/xact.h"
 #include "access/xlog.h"
+#include "catalog/index.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_am_d.h"
+#include "commands/extension.h"
+#include "commands/trigger.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
 #include "executor/spi.h"
+#include "executor/tuptable.h"
+#include "funcapi.h"
 #include "lib/stringinfo.h"
 #include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
 #include "miscadmin.h"
+#include "nodes/miscnodes.h"
+#include "optimizer/optimizer.h"
+#include "parser/parse_relation.h"
+#include "port/atomics.h"
+#include "port/pg_bswap.h"
 #include "postmaster/bgworker.h"
 #include "postmaster/interrupt.h"
+#include "replication/message.h"
+#include "replication/origin.h"
 #include "replication/walreceiver.h"
+#include "rewrite/rewriteHandler.h"
+#include "storage/bufmgr.h"
+#include "storage/condition_variable.h"
 #include "storage/dsm_registry.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
+#include "storage/lmgr.h"
 #include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/spin.h"
 #include "tcop/tcopprot.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/json.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+#include "utils/regproc.h"
+#include "utils/rel.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/varlena.h"
 #include "utils/wait_event.h"
 
+#include "pg_follower.h"
+#include "pg_follower_probes.h"
+
 PG_FUNCTION_INFO_V1(start_follow);
+PG_FUNCTION_INFO_V1(pg_follower_replay);
+PG_FUNCTION_INFO_V1(pg_follower_applied_lsn);
+PG_FUNCTION_INFO_V1(pg_follower_wait_for_lsn);
+PG_FUNCTION_INFO_V1(pg_follower_slow_transactions);
 
 PGDLLEXPORT void pg_follower_worker_main(Datum main_arg);
-static bool start_bgworker(const char *connection_string);
+PGDLLEXPORT void pg_follower_replay_main(Datum main_arg);
+static void start_bgworker(const char *connection_string, int ngroups);
 static void pfw_init_shmem(void *ptr);
 static void pfw_attach_shmem(bool require_found);
+static void pfw_worker_detach(int code, Datum arg);
+static void check_upstream(WalReceiverConn *conn);
 static void create_replication_slot(WalReceiverConn *conn);
 static bool start_streaming(WalReceiverConn *conn);
 static void apply_loop(WalReceiverConn *conn);
 static void apply_message(StringInfo message);
+static void apply_packed_message(StringInfo message);
+static void prefetch_ahead(StringInfo message, int seq);
+static uint64 apply_insert_batch(const char *data, int len);
+static char *extract_gid(const char *query);
+static bool prepared_xact_exists(const char *gid);
+static void finish_prepared(const char *query, bool is_commit);
+static bool is_create_index(const char *query);
+static bool is_xact_end(const char *query);
+static int	execute_record(const char *query);
+static void relay_record(const char *data, int len);
+static void relay_open(void);
+static char *extension_table(const char *name);
+static void bulk_open(void);
+static void bulk_begin(void);
+static void bulk_after_record(const char *query, uint64 rows, int bytes);
+static void bulk_finish(void);
+static void execute_local(const char *query, int nargs, Oid *argtypes,
+						  Datum *values, int expected);
+static void deferred_open(void);
+static void build_deferred_indexes(bool in_xact);
+static void reload_begin(const char *query);
+static void reload_finish(void);
+static void enable_always_triggers(void);
+static void reload_config(void);
+static void init_wait_events(void);
+static void setup_apply_session(void);
+static void capture_open(void);
+static void capture_message(XLogRecPtr lsn, const char *data, int len);
+static void capture_flush(void);
+static bool spool_enabled(void);
+static void spool_open(void);
+static void spool_message(XLogRecPtr lsn, const char *data, int len);
+static void spool_flush(void);
+static bool spool_backlog(void);
+static void spool_apply(WalReceiverConn *conn);
+static bool sink_enabled(void);
+static void sink_open(void);
+static void sink_message(XLogRecPtr lsn, const char *data, int len);
+static void sink_flush(bool force);
+static void replay_file(const char *path, uint64 *messages, uint64 *bytes);
+static double throttle_delay(int limit, double *tokens, TimestampTz last,
+							 TimestampTz now);
+static void throttle_charge(uint64 rows, int bytes);
+static void throttle_wait(WalReceiverConn *conn, XLogRecPtr recvpos);
+static void sample_record(const char *query, uint64 rows, int bytes,
+						  instr_time start);
+static void advance_applied_lsn(XLogRecPtr lsn);
+static void request_applied_lsn(XLogRecPtr lsn);
 static void send_feedback(WalReceiverConn *conn, XLogRecPtr recvpos, bool force,
 						  bool requestReply);
+static void reset_message_context(void);
+static void count_allocations(MemoryContext context);
+static void report_allocations(void);
 
-static uint32 pg_follower_we_main = 0;
+/* Custom wait events */
+static uint32 pfw_we_receive = 0;
+static uint32 pfw_we_execute = 0;
+static uint32 pfw_we_commit = 0;
+static uint32 pfw_we_feedback = 0;
+static uint32 pfw_we_throttle = 0;
+static uint32 pfw_we_wait_lsn = 0;
 
 static MemoryContext message_context = NULL;
 static MemoryContext pfw_worker_context = NULL;
 
+/*
+ * message_context is used as an arena, which is reset at transaction
+ * boundaries or once it outgrows its first block of this size, rather than
+ * after each message.
+ */
+#define PFW_MESSAGE_ARENA_SIZE (64 * 1024)
+
+/* GUC variables */
+static bool pfw_defer_index_build = false;
+static int	pfw_batch_bytes = 65536;
+static int	pfw_compact_changes = 0;
+static int	pfw_insert_batch_rows = 0;
+static bool pfw_truncate_reload = false;
+static int	pfw_prefetch_distance = 0;
+static int	pfw_slow_transaction_threshold = -1;
+static int	pfw_conflation_lag = 0;
+static int	pfw_conflation_window = 1000;
+static int	pfw_apply_rows_per_sec = 0;
+static int	pfw_apply_bytes_per_sec = 0;
+static int	pfw_apply_wal_per_sec = 0;
+static char *pfw_capture_file = NULL;
+static char *pfw_spool_directory = NULL;
+static char *pfw_sink_directory = NULL;
+static int	pfw_sink_format = 0;
+static bool pfw_sink_compression = false;
+static int	pfw_sink_segment_size = 16 * 1024 * 1024;
+static bool pfw_relay = false;
+static char *pfw_bulk_load_tables = NULL;
+static int	pfw_bulk_load_rows = 100000;
+static int	pfw_bulk_load_bytes = 64 * 1024 * 1024;
+static bool pfw_publish_via_root = false;
+static bool pfw_replica_role = true;
+static char *pfw_always_fire_triggers = NULL;
+static bool pfw_debug_worker_allocations = false;
+
+/* Whether pg_follower.always_fire_triggers must be applied again */
+static bool triggers_need_update = false;
+
+/*
+ * Bulk load, which commits a long run of INSERTs into tables listed in
+ * pg_follower.bulk_load_tables before the upstream transaction ends. The
+ * number of records applied so far is stored in pg_follower_bulk_progress
+ * by each intermediate commit, so that they are skipped when the transaction
+ * is received again, e.g. from the spool after a crash.
+ */
+static char *bulk_progress_table = NULL;
+static List *bulk_tables = NIL;		/* List of qualified name Lists */
+static bool bulk_tables_need_update = true;
+
+static XLogRecPtr bulk_begin_lsn = InvalidXLogRecPtr;	/* LSN of the BEGIN */
+static int64 bulk_records = 0;		/* records since the BEGIN */
+static bool bulk_insert_only = false;	/* only bulk INSERTs so far */
+static bool bulk_committed = false; /* progress is stored for the transaction */
+static uint64 bulk_rows = 0;		/* rows since the last commit */
+static uint64 bulk_bytes = 0;		/* bytes since the last commit */
+static int64 bulk_skip = 0;			/* records which have been applied */
+
+/* Progress stored by the previous worker */
+static XLogRecPtr bulk_resume_lsn = InvalidXLogRecPtr;
+static int64 bulk_resume_records = 0;
+
+/*
+ * Allocation counter for pg_follower.debug_worker_allocations. The alloc
+ * method of memory contexts which exist when a transaction starts, i.e. those
+ * of the worker and SPI, is replaced by one which counts calls, and the count
+ * per applied row is logged periodically. Contexts created later while
+ * executing a statement, e.g. ExecutorState and per-tuple contexts, get the
+ * stock methods and are not counted, so this is not the total allocations of
+ * the apply path. Replacing methods of core contexts is not supported by
+ * PostgreSQL, so this is meant for test systems only.
+ */
+#define PFW_ALLOC_REPORT_MS 10000
+
+static const MemoryContextMethods *alloc_set_methods = NULL;
+static MemoryContextMethods counting_methods;
+static uint64 alloc_count = 0;
+static uint64 alloc_rows = 0;
+static TimestampTz alloc_report_time = 0;
+
+/* Start LSN of the message being applied, invalid while replaying */
+static XLogRecPtr current_lsn = InvalidXLogRecPtr;
+
+/*
+ * Replication origin which tags changes applied by a relay worker, so that
+ * they are not decoded for consumers of this node; the relayed records are
+ * sent instead.
+ */
+#define PFW_RELAY_ORIGIN_NAME "pg_follower_relay"
+
+static RepOriginId relay_origin = InvalidRepOriginId;
+
+/* Whether the upstream packs records into a message */
+static bool packed_stream = false;
+
+/*
+ * Column of an insert batch, pointing into the received record, see
+ * flush_insert_batch() in pg_follower_output.c.
+ */
+typedef struct BatchColumn
+{
+	const char *name;
+	Oid			typid;
+	int16		typlen;			/* -1 for text values */
+	const char *nulls;			/* bitmap which is set for non-NULL values */
+	const char *values;			/* fixed-width values, or text values */
+	const char *offsets;		/* start offsets of text values */
+} BatchColumn;
+
+#define BATCH_VALUE_IS_NULL(column, row) \
+	(((column)->nulls[(row) / 8] & (1 << ((row) % 8))) == 0)
+
+/*
+ * CREATE INDEX commands which are not executed yet. They are stored in
+ * pg_follower_deferred_indexes by the transaction which deferred them, so
+ * that the next worker of the table group builds them after a restart.
+ */
+static List *deferred_indexes = NIL;
+static char *deferred_index_table = NULL;
+
+/*
+ * Table truncated in the current transaction, into whose new relfilenode
+ * insert batches are loaded without maintaining indexes, see reload_begin().
+ */
+static Oid	reload_relid = InvalidOid;
+static int	reload_options = 0;		/* options for table_tuple_insert() */
+static uint64 reload_rows = 0;		/* rows loaded since the TRUNCATE */
+
+/*
+ * Key of an UPDATE or DELETE ahead in a packed message, whose index leaf page
+ * has been prefetched and whose heap pages are prefetched later.
+ */
+typedef struct PrefetchKey
+{
+	int			seq;			/* position of the record in the message */
+	Oid			relid;
+	Oid			indexid;
+	int			nkeys;
+	Datum		values[INDEX_MAX_KEYS];
+} PrefetchKey;
+
+/* Lookahead state of the packed message being applied */
+static MemoryContext prefetch_context = NULL;
+static int	prefetch_offset = 0;	/* offset of the next record to look at */
+static int	prefetch_seq = 0;		/* position of the record */
+static List *prefetch_keys = NIL;	/* keys waiting for the heap prefetch */
+
+/*
+ * Token buckets for the apply rate. Tokens are consumed after applying, so
+ * they can become negative, and then we sleep between received messages
+ * until they are refilled.
+ */
+static double throttle_rows = 0;
+static double throttle_bytes = 0;
+static double throttle_wal = 0;
+static TimestampTz throttle_last = 0;
+static uint64 throttle_wal_bytes = 0;
+
+/*
+ * Capture file, which records received messages for replaying them later by
+ * pg_follower_replay(). The file starts with PfwCaptureHeader, followed by
+ * PfwCaptureRecord and the payload for each message. Payloads are terminated
+ * by '\0' and padded to MAXALIGN, so that they can be applied in place from
+ * the mapped file. Integers are written in the native byte order.
+ */
+#define PFW_CAPTURE_MAGIC "PFWCAP1"
+#define PFW_CAPTURE_PACKED 0x01
+
+typedef struct PfwCaptureHeader
+{
+	char		magic[8];
+	uint32		flags;
+	uint32		reserved;
+} PfwCaptureHeader;
+
+typedef struct PfwCaptureRecord
+{
+	XLogRecPtr	lsn;			/* start LSN of the message */
+	uint32		len;			/* length of the payload */
+	uint32		reserved;
+} PfwCaptureRecord;
+
+/* Messages are buffered up to this size before written */
+#define PFW_CAPTURE_BUFSIZE (1024 * 1024)
+
+static int	capture_fd = -1;
+static StringInfo capture_buf = NULL;
+
+/*
+ * Spool, which stores received messages before they are applied when
+ * pg_follower.spool_directory is set. Segment files are named after the slot
+ * and a sequence number, and hold records in the same format as the capture
+ * file. A record does not span segments.
+ *
+ * Messages are fsynced in batches, and then the upstream is told that the
+ * transactions in them are flushed, so that it can release WAL before they
+ * are applied. The applied position is kept by a replication origin, which is
+ * advanced atomically with each local commit.
+ */
+#define PFW_SPOOL_SEGSIZE (16 * 1024 * 1024)
+
+/* Apply from the spool for this long before receiving again */
+#define PFW_SPOOL_APPLY_MS 100
+
+static int	spool_write_fd = -1;
+static uint32 spool_write_segno = 0;
+static off_t spool_write_off = 0;
+static StringInfo spool_buf = NULL;
+
+/* Upstream LSN of the last transaction end written and fsynced */
+static XLogRecPtr spool_written_lsn = InvalidXLogRecPtr;
+static XLogRecPtr spool_flushed_lsn = InvalidXLogRecPtr;
+static bool spool_in_xact = false;	/* a transaction is not complete */
+
+/* Position up to which the spool has been fsynced */
+static uint32 spool_flushed_segno = 0;
+static off_t spool_flushed_off = 0;
+
+/* Position of the next record to be applied */
+static int	spool_read_fd = -1;
+static uint32 spool_read_segno = 0;
+static off_t spool_read_off = 0;
+static StringInfo spool_record = NULL;
+
+/* Oldest segment which has not been removed */
+static uint32 spool_oldest_segno = 0;
+
+/*
+ * Where streaming restarts, after the last transaction in the spool or in
+ * the sink
+ */
+static XLogRecPtr spool_start_lsn = InvalidXLogRecPtr;
+
+/*
+ * Sink, which writes received records into segment files in
+ * pg_follower.sink_directory instead of applying them. The open segment is
+ * named "<slot>.partial", and once it holds pg_follower.sink_segment_size
+ * bytes, or PFW_SINK_SEGMENT_MS has passed, it is fsynced and renamed after
+ * the upstream LSN of the last transaction end in it, e.g.
+ * "<slot>.000000010000A000.ndjson.gz". Segments hold complete transactions,
+ * and the upstream is told that they are flushed after the rename.
+ *
+ * A segment holds a line per record in the NDJSON format, or is a capture
+ * file in the binary format, which pg_follower_replay() can apply if it is
+ * not compressed.
+ */
+#define PFW_SINK_SEGMENT_MS 10000
+
+typedef enum PfwSinkFormat
+{
+	PFW_SINK_NDJSON,
+	PFW_SINK_BINARY,
+} PfwSinkFormat;
+
+static const struct config_enum_entry sink_format_options[] = {
+	{"ndjson", PFW_SINK_NDJSON, false},
+	{"binary", PFW_SINK_BINARY, false},
+	{NULL, 0, false}
+};
+
+static int	sink_fd = -1;
+#ifdef HAVE_LIBZ
+static gzFile sink_gz = NULL;
+#endif
+static StringInfo sink_buf = NULL;
+static uint64 sink_segment_bytes = 0;	/* bytes given to the open segment */
+static TimestampTz sink_segment_start = 0;
+static bool sink_in_xact = false;	/* a transaction is not complete */
+
+/* Upstream LSN of the last transaction end written and renamed */
+static XLogRecPtr sink_written_lsn = InvalidXLogRecPtr;
+static XLogRecPtr sink_flushed_lsn = InvalidXLogRecPtr;
+
 /* Determine the max length for the connection string */
 #define MAXCONNSTRING 1024
 
 /* Determine name of used replication slot */
 #define PFW_SLOT_NAME "pg_follower_tmp_slot"
 
+/* The slot must survive restarts of the worker with the spool or the sink */
+#define PFW_SPOOL_SLOT_NAME "pg_follower_slot"
+
+/* Determine the max number of table groups */
+#define PFW_MAX_GROUPS 16
+
 /* Determine name of used plugin */
 #define PFW_PLUGIN_NAME "pg_follower"
 
+/* Number of slow transactions kept, and the length of statements in them */
+#define PFW_SLOW_XACTS 64
+#define PFW_SLOW_QUERY_LEN 128
+
+/*
+ * Upstream transaction which took longer than
+ * pg_follower.slow_transaction_threshold to apply
+ */
+typedef struct PfwSlowXact
+{
+	int			group;			/* table group which applied it */
+	TimestampTz end_time;		/* when the apply finished */
+	TransactionId xid;			/* upstream XID, invalid if not sent */
+	XLogRecPtr	begin_lsn;
+	XLogRecPtr	end_lsn;
+	int64		duration;		/* in microseconds */
+	int64		inserts;		/* number of records by kind */
+	int64		updates;
+	int64		deletes;
+	int64		others;
+	int64		rows;
+	int64		bytes;
+	int64		slowest_duration;	/* in microseconds */
+	char		slowest_query[PFW_SLOW_QUERY_LEN];
+} PfwSlowXact;
+
+/* Upstream transaction being sampled for pg_follower.slow_transaction_threshold */
+static bool sample_active = false;
+static instr_time sample_start;
+static PfwSlowXact sample_xact;
+
 /* Shared state information for pg_follower bgworker. */
 typedef struct
 {
 	Oid		local_database_oid;
 	char	connection_string[MAXCONNSTRING];
+	int		ngroups;
+
+	/*
+	 * Upstream LSN up to which each table group has been applied, and the
+	 * condition variable which is broadcast when any of them advances.
+	 */
+	pg_atomic_uint64 applied_lsn[PFW_MAX_GROUPS];
+	ConditionVariable applied_cv;
+
+	/* Largest LSN which waiters are waiting for */
+	pg_atomic_uint64 requested_lsn;
+
+	/* Workers woken up by waiters, INVALID_PROC_NUMBER if not running */
+	ProcNumber worker_procno[PFW_MAX_GROUPS];
+
+	/* Origin of changes applied by relay workers, read by walsenders */
+	RepOriginId relay_origin;
+
+	/*
+	 * Input and result of pg_follower_replay(). replay_running is set while
+	 * a call is in progress, so that calls do not overwrite them.
+	 */
+	pg_atomic_flag replay_running;
+	char	replay_path[MAXPGPATH];
+	uint64	replay_messages;
+	uint64	replay_bytes;
+	int64	replay_elapsed;		/* in microseconds, -1 if failed */
+
+	/*
+	 * Ring of slow transactions of all the table groups. slow_xacts_count is
+	 * the number of transactions ever added, and the oldest one is
+	 * overwritten when the ring is full.
+	 */
+	slock_t	slow_xacts_mutex;
+	uint64	slow_xacts_count;
+	PfwSlowXact slow_xacts[PFW_SLOW_XACTS];
 } pg_follower_shared_state;
 
 /* Pointer to shared-memory state. */
 static pg_follower_shared_state *pfw_state;
 
+/* Table group which this worker follows, and the number of groups */
+static int	pfw_group = 0;
+static int	pfw_ngroups = 1;
+
+/* Name of the replication slot which this worker uses */
+static char pfw_slot_name[NAMEDATALEN];
+
+/*
+ * Check whether the upstream is a hot standby, and whether it is configured
+ * so that the replication slot can survive there.
+ *
+ * Since PostgreSQL 16 a standby can decode changes. The slot on the standby
+ * is invalidated if catalog rows which it needs are removed on the primary,
+ * which hot_standby_feedback prevents. The walsender keeps decoding after the
+ * standby is promoted, so nothing has to be done for that.
+ */
+static void
+check_upstream(WalReceiverConn *conn)
+{
+#define CHECK_UPSTREAM_COL_COUNT 2
+	WalRcvExecResult *res;
+	Oid			row[CHECK_UPSTREAM_COL_COUNT] = {BOOLOID, BOOLOID};
+	TupleTableSlot *slot;
+	bool		isnull;
+	bool		in_recovery;
+	bool		hot_standby_feedback;
+	bool		started_tx = false;
+
+	/* The syscache access in walrcv_exec() needs a transaction env. */
+	if (!IsTransactionState())
+	{
+		StartTransactionCommand();
+		started_tx = true;
+	}
+
+	res = walrcv_exec(conn,
+					  "SELECT pg_catalog.pg_is_in_recovery(), "
+					  "pg_catalog.current_setting('hot_standby_feedback')::boolean",
+					  CHECK_UPSTREAM_COL_COUNT, row);
+
+	if (res->status != WALRCV_OK_TUPLES)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not check the status of the upstream: %s",
+						res->err)));
+
+	slot = MakeSingleTupleTableSlot(res->tupledesc, &TTSOpsMinimalTuple);
+
+	if (!tuplestore_gettupleslot(res->tuplestore, true, false, slot))
+		elog(ERROR, "could not fetch the status of the upstream");
+
+	in_recovery = DatumGetBool(slot_getattr(slot, 1, &isnull));
+	hot_standby_feedback = DatumGetBool(slot_getattr(slot, 2, &isnull));
+
+	ExecDropSingleTupleTableSlot(slot);
+	walrcv_clear_result(res);
+
+	if (started_tx)
+		CommitTransactionCommand();
+
+	if (!in_recovery)
+		return;
+
+	ereport(LOG,
+			(errmsg("upstream is a standby server"),
+			 errdetail("Creating the replication slot waits until the primary logs information about running transactions."),
+			 errhint("Execute pg_log_standby_snapshot() on the primary to speed it up.")));
+
+	if (!hot_standby_feedback)
+		ereport(WARNING,
+				(errmsg("\"hot_standby_feedback\" is disabled on the upstream standby"),
+				 errdetail("The replication slot would be invalidated when catalog rows it needs are removed on the primary."),
+				 errhint("Enable \"hot_standby_feedback\" and set \"primary_slot_name\" on the standby.")));
+}
+
 /*
  * Create a logical replication slot to the upstream node.
  *
@@ -89,12 +625,53 @@ create_replication_slot(WalReceiverConn *conn)
 	}
 
 	/*
-	 * Construct a query. Any options could not be accepted now. Also, only
-	 * a temporary slot is supported.
+	 * With the spool or the sink, the slot is persistent and is reused when
+	 * the worker restarts. Otherwise, a temporary slot is created.
+	 */
+	if (spool_enabled() || sink_enabled())
+	{
+		WalRcvExecResult *res;
+		Oid			exists_row[1] = {INT4OID};
+		bool		exists;
+
+		initStringInfo(&query);
+		appendStringInfo(&query,
+						 "SELECT 1 FROM pg_catalog.pg_replication_slots WHERE slot_name = %s",
+						 quote_literal_cstr(pfw_slot_name));
+
+		res = walrcv_exec(conn, query.data, 1, exists_row);
+		if (res->status != WALRCV_OK_TUPLES)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("could not check replication slot \"%s\" on the upstream: %s",
+							pfw_slot_name, res->err)));
+
+		exists = tuplestore_tuple_count(res->tuplestore) > 0;
+		walrcv_clear_result(res);
+		pfree(query.data);
+
+		if (exists)
+		{
+			if (started_tx)
+				CommitTransactionCommand();
+			return;
+		}
+	}
+
+	/*
+	 * Construct a query.
+	 *
+	 * Prepared transactions are decoded at PREPARE time if this node can
+	 * accept them, otherwise they are sent at COMMIT PREPARED.
 	 */
 	initStringInfo(&query);
-	appendStringInfo(&query, "CREATE_REPLICATION_SLOT %s TEMPORARY LOGICAL %s",
-					 PFW_SLOT_NAME, PFW_PLUGIN_NAME);
+	appendStringInfo(&query, "CREATE_REPLICATION_SLOT %s %sLOGICAL %s",
+					 pfw_slot_name,
+					 (spool_enabled() || sink_enabled()) ? "" : "TEMPORARY ",
+					 PFW_PLUGIN_NAME);
+
+	if (max_prepared_xacts > 0)
+		appendStringInfoString(&query, " (TWO_PHASE)");
 
 	/* Execute the query */
 	walrcv_exec(conn, query.data, CREATE_SLOT_OUTPUT_COL_COUNT, slot_row);
@@ -125,12 +702,46 @@ start_streaming(WalReceiverConn *conn)
 	}
 
 	/*
-	 * Construct a query. Any options could not be accepted now. Also, the
-	 * startpoint is always set to 0/0.
+	 * Construct a query. The startpoint is 0/0 unless transactions in the
+	 * spool must be skipped.
+	 *
+	 * The spool and the sink require the LSN of each transaction end, so
+	 * records are not packed then.
 	 */
+	packed_stream = (pfw_batch_bytes > 0 && spool_write_fd < 0 && sink_fd < 0);
+
 	initStringInfo(&query);
-	appendStringInfo(&query, "START_REPLICATION SLOT %s LOGICAL 0/0 ;",
-					 PFW_SLOT_NAME);
+	appendStringInfo(&query, "START_REPLICATION SLOT %s LOGICAL %X/%X (\"batch-bytes\" '%d'",
+					 pfw_slot_name, LSN_FORMAT_ARGS(spool_start_lsn),
+					 packed_stream ? pfw_batch_bytes : 0);
+
+	/* Row changes are compacted on the upstream */
+	if (pfw_compact_changes > 0)
+		appendStringInfo(&query, ", \"compact\" '%d'", pfw_compact_changes);
+
+	/* Inserts are sent in column-major batches, which NDJSON cannot hold */
+	if (pfw_insert_batch_rows > 0 &&
+		!(sink_fd >= 0 && pfw_sink_format == PFW_SINK_NDJSON))
+		appendStringInfo(&query, ", \"insert-batch\" '%d'", pfw_insert_batch_rows);
+
+	/* Changes for partitions are applied to the root table */
+	if (pfw_publish_via_root)
+		appendStringInfoString(&query, ", \"publish-via-root\" 'on'");
+
+	/* Transactions are conflated while we are behind */
+	if (pfw_conflation_lag > 0)
+		appendStringInfo(&query, ", \"conflate-lag\" '%d', \"conflate-window\" '%d'",
+						 pfw_conflation_lag, pfw_conflation_window);
+
+	/* BEGIN names the transaction for pg_follower.slow_transaction_threshold */
+	appendStringInfoString(&query, ", \"include-xid\" 'on'");
+
+	/* Only tables in our group are sent */
+	if (pfw_ngroups > 1)
+		appendStringInfo(&query, ", \"group-count\" '%d', \"group-index\" '%d'",
+						 pfw_ngroups, pfw_group);
+
+	appendStringInfoString(&query, ") ;");
 
 	/*
 	 * Execute the query. Since START_REPLICATION returns PGRES_COPY_BOTH
@@ -168,6 +779,20 @@ send_feedback(WalReceiverConn *conn, XLogRecPtr recvpos, bool force,
 	XLogRecPtr	flushpos = recvpos;
 	TimestampTz now;
 
+	/*
+	 * With the spool, only transactions which are fsynced there are flushed.
+	 * Once everything received is, e.g. while only keepalives arrive, the
+	 * received position is flushed too.
+	 */
+	if (spool_write_fd >= 0 &&
+		(spool_in_xact || spool_flushed_lsn != spool_written_lsn))
+		flushpos = spool_flushed_lsn;
+
+	/* Likewise, with the sink, only those in closed segments */
+	if (sink_fd >= 0 &&
+		(sink_in_xact || sink_flushed_lsn != sink_written_lsn))
+		flushpos = sink_flushed_lsn;
+
 	/*
 	 * If the user doesn't want status to be reported to the publisher, be
 	 * sure to exit before doing anything at all.
@@ -219,8 +844,10 @@ send_feedback(WalReceiverConn *conn, XLogRecPtr recvpos, bool force,
 		 LSN_FORMAT_ARGS(writepos),
 		 LSN_FORMAT_ARGS(flushpos));
 
+	pgstat_report_wait_start(pfw_we_feedback);
 	walrcv_send(conn,
 				reply_message->data, reply_message->len);
+	pgstat_report_wait_end();
 
 	if (recvpos > last_recvpos)
 		last_recvpos = recvpos;
@@ -231,118 +858,3235 @@ send_feedback(WalReceiverConn *conn, XLogRecPtr recvpos, bool force,
 }
 
 /*
- * Read received message and apply via server programming interface 
+ * Alloc method which counts calls, see count_allocations()
+ */
+static void *
+counting_alloc(MemoryContext context, Size size, int flags)
+{
+	alloc_count++;
+
+	return alloc_set_methods->alloc(context, size, flags);
+}
+
+/*
+ * Release memory used for applied messages, at a transaction boundary or if
+ * the arena has outgrown its first block. Messages which allocate little
+ * neither pay for the reset nor return blocks to malloc.
  */
 static void
-apply_message(StringInfo message)
+reset_message_context(void)
 {
-	const char *query = pq_getmsgbytes(message,
-									   (message->len - message->cursor));
+	if (!IsTransactionState() ||
+		MemoryContextMemAllocated(message_context, false) > PFW_MESSAGE_ARENA_SIZE)
+		MemoryContextReset(message_context);
+}
 
-	elog(DEBUG1, "received query: %s", query);
+/*
+ * Count allocations in the context and its existing children if
+ * pg_follower.debug_worker_allocations is on. Only AllocSet contexts are
+ * counted, and children created later are not.
+ */
+static void
+count_allocations(MemoryContext context)
+{
+	if (!pfw_debug_worker_allocations)
+		return;
 
-	if (strncmp(query, "BEGIN", 5) == 0)
+	if (IsA(context, AllocSetContext))
 	{
-		SetCurrentStatementStartTimestamp();
-		StartTransactionCommand();
-		SPI_connect();
-		PushActiveSnapshot(GetTransactionSnapshot());
+		if (alloc_set_methods == NULL)
+		{
+			alloc_set_methods = context->methods;
+			counting_methods = *alloc_set_methods;
+			counting_methods.alloc = counting_alloc;
+		}
+
+		if (context->methods == alloc_set_methods)
+			context->methods = &counting_methods;
 	}
-	else if (strncmp(query, "CREATE", 5) == 0 ||
-			 strncmp(query, "DROP", 4) == 0)
-	{
-		int ret;
 
-		ret = SPI_execute(query, false, 1);
+	for (MemoryContext child = context->firstchild; child != NULL;
+		 child = child->nextchild)
+		count_allocations(child);
+}
 
-		if (ret != SPI_OK_UTILITY)
-			elog(ERROR, "failed to execute query content: \"%s\" length:%d", query, ret);
-	}
-	else if (strncmp(query, "COMMIT", 6) == 0)
-	{
-		SPI_finish();
-		PopActiveSnapshot();
-		CommitTransactionCommand();
-	}
-	/* Seems normal DML commands or TRUNCATE. Use the given string as-is. */
-	else
-	{
-		int ret;
+/*
+ * Log the number of allocations per applied row since the last report
+ */
+static void
+report_allocations(void)
+{
+	TimestampTz now;
 
-		ret = SPI_execute(query, false, 1);
+	if (!pfw_debug_worker_allocations || alloc_rows == 0)
+		return;
 
-		if (ret < 0)
-			elog(ERROR, "failed to execute query :%s :%d", query, ret);
-	}
+	now = GetCurrentTimestamp();
+
+	if (!TimestampDifferenceExceeds(alloc_report_time, now, PFW_ALLOC_REPORT_MS))
+		return;
+
+	ereport(LOG,
+			(errmsg("applied %llu rows with %llu allocations in worker and SPI contexts, %.2f per row",
+					(unsigned long long) alloc_rows,
+					(unsigned long long) alloc_count,
+					(double) alloc_count / alloc_rows)));
+
+	alloc_count = 0;
+	alloc_rows = 0;
+	alloc_report_time = now;
 }
 
 /*
- * main loop for the pg_follower worker
+ * Extract the global transaction identifier from two-phase commands, e.g.
+ * "COMMIT PREPARED 'gid';". Quotes inside are doubled by the output plugin.
  *
- * XXX: basically ported from LogicalRepApplyLoop()
+ * With multiple table groups, each group which took part in the upstream
+ * transaction prepares its own part of it, so the group index is appended
+ * to keep the local identifiers distinct. COMMIT PREPARED and ROLLBACK
+ * PREPARED are sent to all the groups, and groups which did not take part
+ * find nothing prepared under their identifier.
  */
-static void
-apply_loop(WalReceiverConn *conn)
+static char *
+extract_gid(const char *query)
 {
-	XLogRecPtr last_received = InvalidXLogRecPtr;
-	TimeLineID	tli;
+	const char	   *ptr = strchr(query, '\'');
+	StringInfoData	gid;
 
-	/* Init the message_context which we clean up after each message */
-	message_context = AllocSetContextCreate(pfw_worker_context,
-											"pfw_worker_context",
-											ALLOCSET_DEFAULT_SIZES);
+	if (ptr == NULL)
+		elog(ERROR, "could not find a transaction identifier: \"%s\"", query);
 
-	for (;;)
+	initStringInfo(&gid);
+
+	for (ptr++; *ptr; ptr++)
 	{
-		pgsocket	fd = PGINVALID_SOCKET;
-		int			rc;
-		int			len;
-		char	   *buf = NULL;
-		bool		endofstream = false;
+		if (*ptr == '\'')
+		{
+			/* Reached the closing quote */
+			if (ptr[1] != '\'')
+				break;
 
-		CHECK_FOR_INTERRUPTS();
+			ptr++;
+		}
 
-		MemoryContextSwitchTo(message_context);
+		appendStringInfoChar(&gid, *ptr);
+	}
 
-		len = walrcv_receive(conn, &buf, &fd);
+	if (pfw_ngroups > 1)
+		appendStringInfo(&gid, "_g%d", pfw_group);
 
-		if (len != 0)
-		{
-			/* Loop to process all available data (without blocking). */
-			for (;;)
-			{
-				CHECK_FOR_INTERRUPTS();
+	if (gid.len >= GIDSIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("transaction identifier \"%s\" is too long", gid.data)));
 
-				if (len == 0)
-				{
-					break;
-				}
-				else if (len < 0)
-				{
-					ereport(LOG,
-							(errmsg("data stream from publisher has ended")));
-					endofstream = true;
-					break;
-				}
-				else
-				{
-					int			c;
-					StringInfoData s;
+	return gid.data;
+}
 
-					if (ConfigReloadPending)
-					{
-						ConfigReloadPending = false;
-						ProcessConfigFile(PGC_SIGHUP);
-					}
+/*
+ * Check whether the given transaction has been prepared on this node.
+ *
+ * Caller must be in a transaction.
+ */
+static bool
+prepared_xact_exists(const char *gid)
+{
+	Oid		argtypes[1] = {TEXTOID};
+	Datum	values[1];
+	int		ret;
+	bool	found;
 
-					/* Ensure we are reading the data into our memory context. */
-					MemoryContextSwitchTo(message_context);
+	values[0] = CStringGetTextDatum(gid);
 
-					initReadOnlyStringInfo(&s, buf, len);
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
 
-					c = pq_getmsgbyte(&s);
+	ret = SPI_execute_with_args("SELECT 1 FROM pg_catalog.pg_prepared_xacts WHERE gid = $1",
+								1, argtypes, values, NULL, true, 1);
 
-					if (c == 'w')
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to look up prepared transaction \"%s\": %d", gid, ret);
+
+	found = (SPI_processed > 0);
+
+	PopActiveSnapshot();
+	SPI_finish();
+
+	return found;
+}
+
+/*
+ * Finish the prepared transaction by COMMIT PREPARED or ROLLBACK PREPARED.
+ *
+ * The upstream might send the decision for a transaction whose PREPARE was
+ * not replicated, e.g. it was prepared before the slot was created. Such
+ * commands are skipped.
+ */
+static void
+finish_prepared(const char *query, bool is_commit)
+{
+	char   *gid = extract_gid(query);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+
+	pgstat_report_wait_start(pfw_we_commit);
+
+	if (prepared_xact_exists(gid))
+		FinishPreparedTransaction(gid, is_commit);
+	else
+		elog(DEBUG1, "skipping %s of transaction \"%s\" which is not prepared here",
+			 is_commit ? "COMMIT PREPARED" : "ROLLBACK PREPARED", gid);
+
+	CommitTransactionCommand();
+	pgstat_report_wait_end();
+
+	pfree(gid);
+}
+
+/*
+ * Check whether the given command is CREATE [UNIQUE] INDEX.
+ */
+static bool
+is_create_index(const char *query)
+{
+	return strncmp(query, "CREATE INDEX", 12) == 0 ||
+		   strncmp(query, "CREATE UNIQUE INDEX", 19) == 0;
+}
+
+/*
+ * Check whether the given message ends a transaction
+ */
+static bool
+is_xact_end(const char *query)
+{
+	return strncmp(query, "COMMIT", 6) == 0 ||
+		   strncmp(query, "PREPARE TRANSACTION", 19) == 0 ||
+		   strncmp(query, "ROLLBACK PREPARED", 17) == 0;
+}
+
+/*
+ * Execute a received record via SPI
+ */
+static int
+execute_record(const char *query)
+{
+	RepOriginId origin = replorigin_session_origin;
+	int			ret;
+
+	/* Changes made by a relay are not decoded for its consumers */
+	if (relay_origin != InvalidRepOriginId)
+		replorigin_session_origin = relay_origin;
+
+	pgstat_report_wait_start(pfw_we_execute);
+	ret = SPI_execute(query, false, 1);
+	pgstat_report_wait_end();
+
+	/* The commit must not be tagged, otherwise the whole transaction is skipped */
+	replorigin_session_origin = origin;
+
+	return ret;
+}
+
+/*
+ * Forward a received record to consumers of this node, if it is a relay.
+ *
+ * The record is logged as a transactional message, which is sent as-is by
+ * the output plugin when the local transaction commits.
+ */
+static void
+relay_record(const char *data, int len)
+{
+	if (relay_origin == InvalidRepOriginId)
+		return;
+
+	LogLogicalMessage(PFW_RELAY_PREFIX, data, len, true, false);
+}
+
+/*
+ * Set up the replication origin if pg_follower.relay is enabled
+ */
+static void
+relay_open(void)
+{
+	if (!pfw_relay)
+		return;
+
+	if (wal_level < WAL_LEVEL_LOGICAL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("relay requires \"wal_level\" >= \"logical\"")));
+
+	StartTransactionCommand();
+	relay_origin = replorigin_by_name(PFW_RELAY_ORIGIN_NAME, true);
+	if (relay_origin == InvalidRepOriginId)
+		relay_origin = replorigin_create(PFW_RELAY_ORIGIN_NAME);
+	CommitTransactionCommand();
+
+	pfw_state->relay_origin = relay_origin;
+
+	ereport(LOG,
+			(errmsg("relaying received messages to consumers of this node")));
+}
+
+/*
+ * Return the qualified name of a table of this extension
+ */
+static char *
+extension_table(const char *name)
+{
+	Oid			extoid = get_extension_oid("pg_follower", false);
+
+	return quote_qualified_identifier(get_namespace_name(get_extension_schema(extoid)),
+									  name);
+}
+
+/*
+ * Locate the progress table and read the progress stored by the previous
+ * worker of this table group.
+ */
+static void
+bulk_open(void)
+{
+	Oid			argtypes[1] = {INT4OID};
+	Datum		values[1] = {Int32GetDatum(pfw_group)};
+	int			ret;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	bulk_progress_table =
+		MemoryContextStrdup(pfw_worker_context,
+							extension_table("pg_follower_bulk_progress"));
+
+	ret = SPI_execute_with_args(psprintf("SELECT begin_lsn, records FROM %s "
+										 "WHERE group_index = $1",
+										 bulk_progress_table),
+								1, argtypes, values, NULL, true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to read bulk load progress: %d", ret);
+
+	if (SPI_processed > 0)
+	{
+		bool		isnull;
+
+		bulk_resume_lsn = DatumGetLSN(SPI_getbinval(SPI_tuptable->vals[0],
+													SPI_tuptable->tupdesc, 1,
+													&isnull));
+		bulk_resume_records = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+														  SPI_tuptable->tupdesc, 2,
+														  &isnull));
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+}
+
+/*
+ * Locate the table of deferred indexes and read those which the previous
+ * worker of this table group has not built.
+ */
+static void
+deferred_open(void)
+{
+	Oid			argtypes[1] = {INT4OID};
+	Datum		values[1] = {Int32GetDatum(pfw_group)};
+	MemoryContext oldctx;
+	int			ret;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	deferred_index_table =
+		MemoryContextStrdup(pfw_worker_context,
+							extension_table("pg_follower_deferred_indexes"));
+
+	ret = SPI_execute_with_args(psprintf("SELECT query FROM %s "
+										 "WHERE group_index = $1 ORDER BY seq",
+										 deferred_index_table),
+								1, argtypes, values, NULL, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to read deferred indexes: %d", ret);
+
+	oldctx = MemoryContextSwitchTo(pfw_worker_context);
+	for (uint64 i = 0; i < SPI_processed; i++)
+		deferred_indexes = lappend(deferred_indexes,
+								   SPI_getvalue(SPI_tuptable->vals[i],
+												SPI_tuptable->tupdesc, 1));
+	MemoryContextSwitchTo(oldctx);
+
+	if (deferred_indexes != NIL)
+		ereport(LOG,
+				(errmsg("%d deferred indexes are not built yet",
+						list_length(deferred_indexes))));
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+}
+
+/*
+ * Start tracking an upstream transaction. If it was committed partially by
+ * the previous worker, the records applied then are skipped.
+ */
+static void
+bulk_begin(void)
+{
+	bulk_begin_lsn = current_lsn;
+	bulk_records = 0;
+	bulk_insert_only = true;
+	bulk_committed = false;
+	bulk_rows = 0;
+	bulk_bytes = 0;
+	bulk_skip = 0;
+
+	if (XLogRecPtrIsInvalid(bulk_resume_lsn) || current_lsn != bulk_resume_lsn)
+		return;
+
+	bulk_skip = bulk_resume_records;
+	bulk_committed = true;
+	bulk_resume_lsn = InvalidXLogRecPtr;
+
+	ereport(LOG,
+			(errmsg("skipping %lld records of the transaction at %X/%X which have been applied",
+					(long long) bulk_skip, LSN_FORMAT_ARGS(current_lsn))));
+}
+
+/*
+ * Check whether the record inserts into a table listed in
+ * pg_follower.bulk_load_tables. Names are compared as written, since the
+ * table might be created later in the stream.
+ */
+static bool
+is_bulk_insert(const char *query)
+{
+	static char *last_target = NULL;
+	static bool last_result = false;
+	const char *start;
+	const char *end;
+	char	   *target;
+	List	   *names;
+	ListCell   *lc;
+
+	if (*query == PFW_INSERT_BATCH)
+	{
+		/* The target follows the first byte */
+		start = query + 1;
+		end = start + strlen(start);
+	}
+	else if (strncmp(query, "INSERT INTO ", 12) == 0 &&
+			 (end = strstr(query + 12, " ( ")) != NULL)
+		start = query + 12;
+	else
+		return false;
+
+	if (bulk_tables_need_update)
+	{
+		MemoryContext oldctx = MemoryContextSwitchTo(pfw_worker_context);
+		char	   *rawstring = pstrdup(pfw_bulk_load_tables);
+		List	   *elemlist;
+
+		bulk_tables_need_update = false;
+		bulk_tables = NIL;
+		if (last_target)
+			pfree(last_target);
+		last_target = NULL;
+
+		if (!SplitGUCList(rawstring, ',', &elemlist))
+			elog(ERROR, "invalid list syntax in parameter \"%s\"",
+				 "pg_follower.bulk_load_tables");
+
+		foreach(lc, elemlist)
+			bulk_tables = lappend(bulk_tables,
+								  stringToQualifiedNameList((char *) lfirst(lc), NULL));
+
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	if (bulk_tables == NIL)
+		return false;
+
+	/* Insert runs target the same table, so remember the last answer */
+	if (last_target && strncmp(last_target, start, end - start) == 0 &&
+		last_target[end - start] == '\0')
+		return last_result;
+
+	target = pnstrdup(start, end - start);
+	names = stringToQualifiedNameList(target, NULL);
+	last_result = false;
+
+	foreach(lc, bulk_tables)
+	{
+		List	   *entry = lfirst(lc);
+
+		if (strcmp(strVal(llast(entry)), strVal(llast(names))) != 0)
+			continue;
+
+		/* An unqualified entry matches the table in any schema */
+		if (list_length(entry) == 1 ||
+			(list_length(names) >= 2 &&
+			 strcmp(strVal(list_nth(entry, list_length(entry) - 2)),
+					strVal(list_nth(names, list_length(names) - 2))) == 0))
+		{
+			last_result = true;
+			break;
+		}
+	}
+
+	if (last_target)
+		pfree(last_target);
+	last_target = MemoryContextStrdup(pfw_worker_context, target);
+
+	return last_result;
+}
+
+/*
+ * Run a statement on a table of this extension, e.g. the progress table
+ */
+static void
+execute_local(const char *query, int nargs, Oid *argtypes, Datum *values,
+			  int expected)
+{
+	RepOriginId origin = replorigin_session_origin;
+	int			ret;
+
+	/* The state is local to this node, even on a relay */
+	if (relay_origin != InvalidRepOriginId)
+		replorigin_session_origin = relay_origin;
+
+	ret = SPI_execute_with_args(query, nargs, argtypes, values, NULL,
+								false, 0);
+
+	replorigin_session_origin = origin;
+
+	if (ret != expected)
+		elog(ERROR, "failed to execute query content: \"%s\" length:%d", query, ret);
+}
+
+/*
+ * Count an applied record, and commit the local transaction if an insert run
+ * into bulk load tables is long enough.
+ */
+static void
+bulk_after_record(const char *query, uint64 rows, int bytes)
+{
+	Oid			argtypes[3] = {INT4OID, LSNOID, INT8OID};
+	Datum		values[3];
+
+	bulk_records++;
+
+	if (!bulk_insert_only)
+		return;
+
+	/*
+	 * A transaction decoded by a TWO_PHASE slot is only known to be prepared
+	 * when PREPARE TRANSACTION arrives, and committing a part of it before
+	 * then would break the atomicity of the prepared transaction.
+	 */
+	if (bulk_progress_table == NULL || max_prepared_xacts > 0 ||
+		!is_bulk_insert(query))
+	{
+		bulk_insert_only = false;
+		return;
+	}
+
+	bulk_rows += rows;
+	bulk_bytes += bytes;
+
+	if (!(pfw_bulk_load_rows > 0 && bulk_rows >= pfw_bulk_load_rows) &&
+		!(pfw_bulk_load_bytes > 0 && bulk_bytes >= pfw_bulk_load_bytes))
+		return;
+
+	values[0] = Int32GetDatum(pfw_group);
+	values[1] = LSNGetDatum(bulk_begin_lsn);
+	values[2] = Int64GetDatum(bulk_records);
+
+	execute_local(psprintf("INSERT INTO %s VALUES ($1, $2, $3) "
+						  "ON CONFLICT (group_index) DO UPDATE "
+						  "SET begin_lsn = excluded.begin_lsn, records = excluded.records",
+						  bulk_progress_table),
+				 3, argtypes, values, SPI_OK_INSERT);
+
+	/* The upstream transaction has not been applied completely */
+	replorigin_session_origin_lsn = InvalidXLogRecPtr;
+
+	SPI_finish();
+	PopActiveSnapshot();
+
+	pgstat_report_wait_start(pfw_we_commit);
+	CommitTransactionCommand();
+	pgstat_report_wait_end();
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	count_allocations(TopTransactionContext);
+
+	elog(DEBUG1, "committed %lld records of the transaction at %X/%X",
+		 (long long) bulk_records, LSN_FORMAT_ARGS(bulk_begin_lsn));
+
+	bulk_committed = true;
+	bulk_rows = 0;
+	bulk_bytes = 0;
+}
+
+/*
+ * Remove the progress when the upstream transaction ends
+ */
+static void
+bulk_finish(void)
+{
+	Oid			argtypes[1] = {INT4OID};
+	Datum		values[1] = {Int32GetDatum(pfw_group)};
+
+	if (!bulk_committed)
+		return;
+
+	execute_local(psprintf("DELETE FROM %s WHERE group_index = $1",
+						  bulk_progress_table),
+				 1, argtypes, values, SPI_OK_DELETE);
+
+	bulk_committed = false;
+}
+
+/*
+ * Build indexes whose creation was deferred by pg_follower.defer_index_build.
+ *
+ * Building an index after the table is loaded is much cheaper than
+ * maintaining it for each applied row, and CREATE INDEX can use parallel
+ * workers up to max_parallel_maintenance_workers. If in_xact is false, a new
+ * transaction is opened for them.
+ */
+static void
+build_deferred_indexes(bool in_xact)
+{
+	ListCell *lc;
+	Oid			argtypes[1] = {INT4OID};
+	Datum		values[1] = {Int32GetDatum(pfw_group)};
+
+	if (deferred_indexes == NIL)
+		return;
+
+	if (!in_xact)
+	{
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+	}
+
+	foreach(lc, deferred_indexes)
+	{
+		char   *query = (char *) lfirst(lc);
+		int		ret;
+
+		elog(DEBUG1, "building deferred index: %s", query);
+
+		/* The command was relayed when received, so it is tagged as well */
+		ret = execute_record(query);
+
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "failed to execute query content: \"%s\" length:%d", query, ret);
+	}
+
+	if (deferred_index_table != NULL)
+		execute_local(psprintf("DELETE FROM %s WHERE group_index = $1",
+							   deferred_index_table),
+					  1, argtypes, values, SPI_OK_DELETE);
+
+	if (!in_xact)
+	{
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+
+	list_free_deep(deferred_indexes);
+	deferred_indexes = NIL;
+}
+
+/*
+ * Start loading a table truncated by the record, if it is eligible.
+ *
+ * A TRUNCATE gives the table a new relfilenode, which no other transaction
+ * can see until we commit, so following insert batches are written into it
+ * as COPY FREEZE does: frozen, bypassing the free space map, and without
+ * maintaining indexes, which are rebuilt by reload_finish() once the insert
+ * run ends. The relfilenode is not WAL-logged if wal_level is minimal.
+ *
+ * Only a TRUNCATE of one plain table is eligible, and tables with insert
+ * triggers or stored generated columns are applied as usual.
+ */
+static void
+reload_begin(const char *query)
+{
+	const char *start = query + 9;	/* skip "TRUNCATE " */
+	int			len = strcspn(start, " ,;");
+	char	   *name;
+	Oid			relid;
+	Relation	rel;
+	TupleDesc	desc;
+
+	if (!pfw_truncate_reload || start[len] == ',')
+		return;
+
+	name = pnstrdup(start, len);
+	relid = RangeVarGetRelid(makeRangeVarFromNameList(stringToQualifiedNameList(name, NULL)),
+							 NoLock, true);
+	pfree(name);
+
+	if (!OidIsValid(relid))
+		return;
+
+	/* The TRUNCATE holds AccessExclusiveLock */
+	rel = table_open(relid, NoLock);
+	desc = RelationGetDescr(rel);
+
+	if (rel->rd_rel->relkind == RELKIND_RELATION &&
+		(rel->rd_createSubid == GetCurrentSubTransactionId() ||
+		 rel->rd_newRelfilelocatorSubid == GetCurrentSubTransactionId()) &&
+		!(rel->trigdesc &&
+		  (rel->trigdesc->trig_insert_before_row ||
+		   rel->trigdesc->trig_insert_after_row ||
+		   rel->trigdesc->trig_insert_instead_row)) &&
+		!(desc->constr && desc->constr->has_generated_stored))
+	{
+		reload_relid = relid;
+		reload_options = TABLE_INSERT_SKIP_FSM;
+		reload_rows = 0;
+
+		elog(DEBUG1, "loading relation \"%s\" without maintaining indexes",
+			 RelationGetRelationName(rel));
+	}
+
+	table_close(rel, NoLock);
+}
+
+/*
+ * End the insert run into the table truncated by reload_begin(), and rebuild
+ * its indexes if rows have been loaded. Unique violations are reported here.
+ */
+static void
+reload_finish(void)
+{
+	ReindexParams params = {0};
+
+	if (!OidIsValid(reload_relid))
+		return;
+
+	if (reload_rows > 0)
+	{
+		elog(DEBUG1, "building indexes of relation %u after loading %llu rows",
+			 reload_relid, (unsigned long long) reload_rows);
+
+		pgstat_report_wait_start(pfw_we_execute);
+		reindex_relation(NULL, reload_relid, REINDEX_REL_CHECK_CONSTRAINTS,
+						 &params);
+		pgstat_report_wait_end();
+
+		CommandCounterIncrement();
+	}
+
+	reload_relid = InvalidOid;
+	reload_rows = 0;
+}
+
+/*
+ * Make triggers listed in pg_follower.always_fire_triggers fire even when
+ * session_replication_role is replica, by ENABLE ALWAYS TRIGGER.
+ *
+ * Each entry is "[schema.]table.trigger". Unknown entries are skipped with a
+ * WARNING because the table might not be replicated yet. So are disabled or
+ * replica-only triggers, since the change applies to every session on this
+ * node. The previous state of each changed trigger is stored in
+ * pg_follower_enabled_triggers, and restored once it is removed from the
+ * list, or if the worker does not apply changes as replica.
+ */
+static void
+enable_always_triggers(void)
+{
+	char	   *table;
+	List	   *elemlist = NIL;
+	List	   *kept_relids = NIL;
+	List	   *kept_names = NIL;
+	ListCell   *lc;
+	Oid			argtypes[3] = {OIDOID, NAMEOID, CHAROID};
+	Datum		values[3];
+	NameData	tgname_data;
+	SPITupleTable *tuptable;
+	int			ret;
+
+	triggers_need_update = false;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	table = extension_table("pg_follower_enabled_triggers");
+
+	/* ALWAYS is only needed while triggers are skipped otherwise */
+	if (SessionReplicationRole == SESSION_REPLICATION_ROLE_REPLICA &&
+		pfw_always_fire_triggers != NULL && pfw_always_fire_triggers[0] != '\0' &&
+		!SplitGUCList(pstrdup(pfw_always_fire_triggers), ',', &elemlist))
+		elog(ERROR, "invalid list syntax in parameter \"%s\"",
+			 "pg_follower.always_fire_triggers");
+
+	foreach(lc, elemlist)
+	{
+		List	   *names = stringToQualifiedNameList((char *) lfirst(lc), NULL);
+		char	   *tgname = NULL;
+		Oid			relid = InvalidOid;
+		char	   *tgenabled;
+
+		if (list_length(names) >= 2)
+		{
+			tgname = strVal(llast(names));
+			relid = RangeVarGetRelid(makeRangeVarFromNameList(list_truncate(names, list_length(names) - 1)),
+									 NoLock, true);
+		}
+
+		if (!OidIsValid(relid))
+		{
+			elog(WARNING, "skipping trigger \"%s\" because the table does not exist",
+				 (char *) lfirst(lc));
+			continue;
+		}
+
+		/* name is fixed-length, so the string must not be passed as it is */
+		namestrcpy(&tgname_data, tgname);
+		values[0] = ObjectIdGetDatum(relid);
+		values[1] = NameGetDatum(&tgname_data);
+
+		ret = SPI_execute_with_args("SELECT tgenabled FROM pg_catalog.pg_trigger "
+									"WHERE tgrelid = $1 AND tgname = $2",
+									2, argtypes, values, NULL, false, 1);
+
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "failed to look up trigger \"%s\": %d", tgname, ret);
+
+		if (SPI_processed == 0)
+		{
+			elog(WARNING, "skipping trigger \"%s\" because it does not exist",
+				 (char *) lfirst(lc));
+			continue;
+		}
+
+		tgenabled = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+		/*
+		 * ENABLE ALWAYS makes the trigger fire in every session, so triggers
+		 * which are disabled or fire only on replicas are left as they are.
+		 */
+		if (tgenabled[0] == TRIGGER_DISABLED ||
+			tgenabled[0] == TRIGGER_FIRES_ON_REPLICA)
+		{
+			elog(WARNING, "skipping trigger \"%s\" because it is %s",
+				 (char *) lfirst(lc),
+				 tgenabled[0] == TRIGGER_DISABLED ? "disabled" : "enabled for replicas only");
+			continue;
+		}
+
+		kept_relids = lappend_oid(kept_relids, relid);
+		kept_names = lappend(kept_names, tgname);
+
+		/* Skip if it has already been done */
+		if (tgenabled[0] == TRIGGER_FIRES_ALWAYS)
+			continue;
+
+		/* Another table group might have recorded it first */
+		values[2] = CharGetDatum(tgenabled[0]);
+		execute_local(psprintf("INSERT INTO %s VALUES ($1, $2, $3) "
+							   "ON CONFLICT DO NOTHING", table),
+					  3, argtypes, values, SPI_OK_INSERT);
+
+		ret = SPI_execute(psprintf("ALTER TABLE %s ENABLE ALWAYS TRIGGER %s",
+								   quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+															  get_rel_name(relid)),
+								   quote_identifier(tgname)),
+						  false, 0);
+
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "failed to enable trigger \"%s\": %d", tgname, ret);
+
+		elog(LOG, "trigger \"%s\" fires on the pg_follower worker", (char *) lfirst(lc));
+	}
+
+	/* Restore triggers which are not listed any more */
+	ret = SPI_execute(psprintf("SELECT e.relid, e.tgname, e.tgenabled, t.tgenabled "
+							   "FROM %s e LEFT JOIN pg_catalog.pg_trigger t "
+							   "ON t.tgrelid = e.relid AND t.tgname = e.tgname",
+							   table),
+					  false, 0);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to read enabled triggers: %d", ret);
+
+	tuptable = SPI_tuptable;
+
+	for (uint64 i = 0; i < tuptable->numvals; i++)
+	{
+		HeapTuple	tuple = tuptable->vals[i];
+		bool		isnull;
+		Oid			relid = DatumGetObjectId(SPI_getbinval(tuple, tuptable->tupdesc, 1, &isnull));
+		char	   *tgname = SPI_getvalue(tuple, tuptable->tupdesc, 2);
+		char		previous = DatumGetChar(SPI_getbinval(tuple, tuptable->tupdesc, 3, &isnull));
+		char	   *current = SPI_getvalue(tuple, tuptable->tupdesc, 4);
+		bool		kept = false;
+		ListCell   *lc2;
+
+		forboth(lc, kept_relids, lc2, kept_names)
+		{
+			if (lfirst_oid(lc) == relid && strcmp(lfirst(lc2), tgname) == 0)
+			{
+				kept = true;
+				break;
+			}
+		}
+
+		if (kept)
+			continue;
+
+		/*
+		 * Only triggers which fired on origin are promoted. Leave it if the
+		 * trigger is gone or has been changed by others.
+		 */
+		if (previous == TRIGGER_FIRES_ON_ORIGIN && current != NULL &&
+			current[0] == TRIGGER_FIRES_ALWAYS)
+		{
+			ret = SPI_execute(psprintf("ALTER TABLE %s ENABLE TRIGGER %s",
+									   quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+																  get_rel_name(relid)),
+									   quote_identifier(tgname)),
+							  false, 0);
+
+			if (ret != SPI_OK_UTILITY)
+				elog(ERROR, "failed to restore trigger \"%s\": %d", tgname, ret);
+
+			elog(LOG, "trigger \"%s\" of table \"%s\" is restored by the pg_follower worker",
+				 tgname, get_rel_name(relid));
+		}
+
+		namestrcpy(&tgname_data, tgname);
+		values[0] = ObjectIdGetDatum(relid);
+		values[1] = NameGetDatum(&tgname_data);
+		execute_local(psprintf("DELETE FROM %s WHERE relid = $1 AND tgname = $2",
+							   table),
+					  2, argtypes, values, SPI_OK_DELETE);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+}
+
+/*
+ * Re-read the configuration file after SIGHUP.
+ */
+static void
+reload_config(void)
+{
+	ConfigReloadPending = false;
+	ProcessConfigFile(PGC_SIGHUP);
+	triggers_need_update = true;
+	bulk_tables_need_update = true;
+}
+
+/*
+ * Refill a token bucket up to one second of the limit, and return seconds
+ * needed to pay off its debt.
+ */
+static double
+throttle_delay(int limit, double *tokens, TimestampTz last, TimestampTz now)
+{
+	if (limit == 0)
+	{
+		*tokens = 0;
+		return 0;
+	}
+
+	*tokens += (double) limit * (now - last) / USECS_PER_SEC;
+
+	if (*tokens > limit)
+		*tokens = limit;
+
+	if (*tokens >= 0)
+		return 0;
+
+	return -(*tokens) / limit;
+}
+
+/*
+ * Charge the applied rows, bytes and generated WAL. The debt is paid by
+ * throttle_wait().
+ */
+static void
+throttle_charge(uint64 rows, int bytes)
+{
+	if (pfw_apply_rows_per_sec == 0 && pfw_apply_bytes_per_sec == 0 &&
+		pfw_apply_wal_per_sec == 0)
+	{
+		throttle_wal_bytes = pgWalUsage.wal_bytes;
+		return;
+	}
+
+	throttle_rows -= rows;
+	throttle_bytes -= bytes;
+	throttle_wal -= pgWalUsage.wal_bytes - throttle_wal_bytes;
+	throttle_wal_bytes = pgWalUsage.wal_bytes;
+}
+
+/*
+ * Sleep while any of pg_follower.apply_*_per_sec is exceeded. This is called
+ * between received messages, rather than for each record of them.
+ *
+ * The sleep is reported as a dedicated wait event. Limits can be changed
+ * while sleeping. The socket is not read meanwhile, so status updates are
+ * sent to conn, if any, to keep the walsender from timing out.
+ */
+static void
+throttle_wait(WalReceiverConn *conn, XLogRecPtr recvpos)
+{
+	if (pfw_apply_rows_per_sec == 0 && pfw_apply_bytes_per_sec == 0 &&
+		pfw_apply_wal_per_sec == 0)
+		return;
+
+	for (;;)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+		double		delay = 0;
+		long		delay_ms;
+
+		delay = Max(delay, throttle_delay(pfw_apply_rows_per_sec,
+										  &throttle_rows, throttle_last, now));
+		delay = Max(delay, throttle_delay(pfw_apply_bytes_per_sec,
+										  &throttle_bytes, throttle_last, now));
+		delay = Max(delay, throttle_delay(pfw_apply_wal_per_sec,
+										  &throttle_wal, throttle_last, now));
+		throttle_last = now;
+
+		delay_ms = (long) ceil(delay * 1000);
+
+		if (delay_ms <= 0)
+			break;
+
+		/* Wake up at least every second to check the limits again */
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 Min(delay_ms, 1000L),
+						 pfw_we_throttle);
+
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+			reload_config();
+
+		if (conn != NULL)
+			send_feedback(conn, recvpos, false, false);
+	}
+}
+
+/*
+ * Account an applied record to the upstream transaction being sampled, and
+ * add the transaction to the ring of slow transactions when it ends if it
+ * took longer than pg_follower.slow_transaction_threshold. The transaction is
+ * timed from the start of BEGIN to the end of COMMIT or PREPARE TRANSACTION.
+ */
+static void
+sample_record(const char *query, uint64 rows, int bytes, instr_time start)
+{
+	instr_time	end;
+	int64		duration;
+
+	INSTR_TIME_SET_CURRENT(end);
+
+	if (strncmp(query, "BEGIN", 5) == 0)
+	{
+		const char *xid = strstr(query, "-- xid ");
+
+		memset(&sample_xact, 0, sizeof(sample_xact));
+		sample_xact.group = pfw_group;
+		sample_xact.xid = xid ? (TransactionId) strtoul(xid + 7, NULL, 10) :
+			InvalidTransactionId;
+		sample_xact.begin_lsn = current_lsn;
+		sample_start = start;
+		sample_active = true;
+		return;
+	}
+
+	/* Records of a transaction which began before the setting was enabled */
+	if (!sample_active)
+		return;
+
+	INSTR_TIME_SUBTRACT(end, start);
+	duration = INSTR_TIME_GET_MICROSEC(end);
+
+	sample_xact.rows += rows;
+	sample_xact.bytes += bytes;
+
+	if (*query == PFW_INSERT_BATCH || strncmp(query, "INSERT", 6) == 0)
+		sample_xact.inserts++;
+	else if (strncmp(query, "UPDATE", 6) == 0)
+		sample_xact.updates++;
+	else if (strncmp(query, "DELETE", 6) == 0)
+		sample_xact.deletes++;
+	else if (!is_xact_end(query))
+		sample_xact.others++;
+
+	if (duration > sample_xact.slowest_duration)
+	{
+		sample_xact.slowest_duration = duration;
+
+		if (*query == PFW_INSERT_BATCH)
+			snprintf(sample_xact.slowest_query, PFW_SLOW_QUERY_LEN,
+					 "insert batch into %s", query + 1);
+		else
+		{
+			int			len = pg_mbcliplen(query, strlen(query),
+										   PFW_SLOW_QUERY_LEN - 1);
+
+			memcpy(sample_xact.slowest_query, query, len);
+			sample_xact.slowest_query[len] = '\0';
+		}
+	}
+
+	if (!is_xact_end(query))
+		return;
+
+	sample_active = false;
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, sample_start);
+	sample_xact.duration = INSTR_TIME_GET_MICROSEC(end);
+
+	if (sample_xact.duration < (int64) pfw_slow_transaction_threshold * 1000)
+		return;
+
+	sample_xact.end_lsn = current_lsn;
+	sample_xact.end_time = GetCurrentTimestamp();
+
+	SpinLockAcquire(&pfw_state->slow_xacts_mutex);
+	pfw_state->slow_xacts[pfw_state->slow_xacts_count % PFW_SLOW_XACTS] = sample_xact;
+	pfw_state->slow_xacts_count++;
+	SpinLockRelease(&pfw_state->slow_xacts_mutex);
+}
+
+/*
+ * Allocate or get the custom wait events.
+ */
+static void
+init_wait_events(void)
+{
+	if (pfw_we_receive == 0)
+		pfw_we_receive = WaitEventExtensionNew("PgFollowerReceive");
+	if (pfw_we_execute == 0)
+		pfw_we_execute = WaitEventExtensionNew("PgFollowerExecute");
+	if (pfw_we_commit == 0)
+		pfw_we_commit = WaitEventExtensionNew("PgFollowerCommit");
+	if (pfw_we_feedback == 0)
+		pfw_we_feedback = WaitEventExtensionNew("PgFollowerFeedback");
+	if (pfw_we_throttle == 0)
+		pfw_we_throttle = WaitEventExtensionNew("PgFollowerThrottle");
+	if (pfw_we_wait_lsn == 0)
+		pfw_we_wait_lsn = WaitEventExtensionNew("PgFollowerWaitForLSN");
+}
+
+/*
+ * Prepare the session for applying changes. Must be called after connecting
+ * to the local database.
+ */
+static void
+setup_apply_session(void)
+{
+	/*
+	 * Triggers, rules and foreign keys were already handled on the upstream,
+	 * so skip them unless the database asks otherwise, e.g. by ALTER DATABASE
+	 * SET pg_follower.replica_role = off.
+	 */
+	if (pfw_replica_role)
+		SetConfigOption("session_replication_role", "replica",
+						PGC_SUSET, PGC_S_OVERRIDE);
+
+	/* Restore triggers changed by the previous worker if it is not needed */
+	enable_always_triggers();
+}
+
+/*
+ * Open the capture file specified by pg_follower.capture_file, if any.
+ *
+ * Messages are appended to an existing file, which must have been captured
+ * with the same framing.
+ */
+static void
+capture_open(void)
+{
+	PfwCaptureHeader header;
+	struct stat st;
+	uint32		flags = packed_stream ? PFW_CAPTURE_PACKED : 0;
+
+	if (pfw_capture_file == NULL || pfw_capture_file[0] == '\0')
+		return;
+
+	capture_fd = BasicOpenFile(pfw_capture_file,
+							   O_RDWR | O_CREAT | O_APPEND | PG_BINARY);
+	if (capture_fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open capture file \"%s\": %m",
+						pfw_capture_file)));
+
+	if (fstat(capture_fd, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat capture file \"%s\": %m",
+						pfw_capture_file)));
+
+	if (st.st_size == 0)
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, PFW_CAPTURE_MAGIC, sizeof(header.magic));
+		header.flags = flags;
+
+		if (write(capture_fd, &header, sizeof(header)) != sizeof(header))
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write capture file \"%s\": %m",
+							pfw_capture_file)));
+	}
+	else if (pg_pread(capture_fd, &header, sizeof(header), 0) != sizeof(header) ||
+			 memcmp(header.magic, PFW_CAPTURE_MAGIC, sizeof(header.magic)) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("\"%s\" is not a capture file", pfw_capture_file)));
+	else if (header.flags != flags)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("capture file \"%s\" was written with different \"pg_follower.batch_bytes\"",
+						pfw_capture_file)));
+
+	capture_buf = makeStringInfo();
+
+	ereport(LOG,
+			(errmsg("capturing received messages into \"%s\"",
+					pfw_capture_file)));
+}
+
+/*
+ * Append a received message to the capture buffer.
+ */
+static void
+capture_message(XLogRecPtr lsn, const char *data, int len)
+{
+	PfwCaptureRecord record;
+	static const char padding[MAXIMUM_ALIGNOF + 1] = {0};
+
+	record.lsn = lsn;
+	record.len = len;
+	record.reserved = 0;
+
+	appendBinaryStringInfo(capture_buf, (char *) &record, sizeof(record));
+	appendBinaryStringInfo(capture_buf, data, len);
+	appendBinaryStringInfo(capture_buf, padding, MAXALIGN(len + 1) - len);
+
+	if (capture_buf->len >= PFW_CAPTURE_BUFSIZE)
+		capture_flush();
+}
+
+/*
+ * Write buffered messages to the capture file.
+ */
+static void
+capture_flush(void)
+{
+	int			written = 0;
+
+	while (written < capture_buf->len)
+	{
+		ssize_t		rc;
+
+		rc = write(capture_fd, capture_buf->data + written,
+				   capture_buf->len - written);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write capture file \"%s\": %m",
+							pfw_capture_file)));
+		}
+
+		written += rc;
+	}
+
+	resetStringInfo(capture_buf);
+}
+
+/*
+ * Return whether received messages go through the spool
+ */
+static bool
+spool_enabled(void)
+{
+	return pfw_spool_directory != NULL && pfw_spool_directory[0] != '\0';
+}
+
+/*
+ * Return the path of the spool segment
+ */
+static char *
+spool_path(uint32 segno)
+{
+	return psprintf("%s/%s.%08X", pfw_spool_directory, pfw_slot_name, segno);
+}
+
+/*
+ * Open the spool segment
+ */
+static int
+spool_open_segment(uint32 segno, int flags)
+{
+	char	   *path = spool_path(segno);
+	int			fd;
+
+	fd = BasicOpenFile(path, flags | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open spool file \"%s\": %m", path)));
+
+	pfree(path);
+
+	return fd;
+}
+
+/*
+ * Read the record header at the offset of the spool segment, and the first
+ * bytes of its payload if requested. Returns false at the end of the segment
+ * or at a record which was not written completely.
+ */
+static bool
+spool_read_header(int fd, off_t off, off_t size, PfwCaptureRecord *record,
+				  char *prefix, int prefixlen)
+{
+	if (off + sizeof(PfwCaptureRecord) > size ||
+		pg_pread(fd, record, sizeof(PfwCaptureRecord), off) != sizeof(PfwCaptureRecord) ||
+		off + sizeof(PfwCaptureRecord) + MAXALIGN(record->len + 1) > size)
+		return false;
+
+	if (prefix)
+	{
+		int			len = Min(record->len, prefixlen - 1);
+
+		if (pg_pread(fd, prefix, len, off + sizeof(PfwCaptureRecord)) != len)
+			return false;
+		prefix[len] = '\0';
+	}
+
+	return true;
+}
+
+/*
+ * Open the spool specified by pg_follower.spool_directory, if any.
+ *
+ * The applied position is restored from the replication origin, and
+ * records after the last complete transaction, which the upstream sends
+ * again, are discarded.
+ */
+static void
+spool_open(void)
+{
+	RepOriginId originid;
+	XLogRecPtr	origin_lsn;
+	DIR		   *dir;
+	struct dirent *de;
+	size_t		prefixlen = strlen(pfw_slot_name);
+	bool		found = false;
+	uint32		min_segno = 0;
+	uint32		max_segno = 0;
+	uint32		end_segno;
+	off_t		end_off = 0;
+	XLogRecPtr	end_lsn = InvalidXLogRecPtr;
+
+	if (!spool_enabled())
+		return;
+
+	if (MakePGDirectory(pfw_spool_directory) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create spool directory \"%s\": %m",
+						pfw_spool_directory)));
+
+	/* Restore the applied position */
+	StartTransactionCommand();
+	originid = replorigin_by_name(pfw_slot_name, true);
+	if (originid == InvalidRepOriginId)
+		originid = replorigin_create(pfw_slot_name);
+	CommitTransactionCommand();
+
+	replorigin_session_setup(originid, 0);
+	replorigin_session_origin = originid;
+	origin_lsn = replorigin_session_get_progress(false);
+
+	/* Find existing segments */
+	dir = AllocateDir(pfw_spool_directory);
+	while ((de = ReadDir(dir, pfw_spool_directory)) != NULL)
+	{
+		const char *suffix = de->d_name + prefixlen + 1;
+		uint32		segno;
+
+		if (strncmp(de->d_name, pfw_slot_name, prefixlen) != 0 ||
+			de->d_name[prefixlen] != '.' ||
+			strlen(suffix) != 8 || strspn(suffix, "0123456789ABCDEF") != 8)
+			continue;
+
+		segno = strtoul(suffix, NULL, 16);
+
+		if (!found || segno < min_segno)
+			min_segno = segno;
+		if (!found || segno > max_segno)
+			max_segno = segno;
+		found = true;
+	}
+	FreeDir(dir);
+
+	spool_read_segno = end_segno = min_segno;
+	spool_read_off = 0;
+
+	/*
+	 * Find the end of the last complete transaction, and the first record
+	 * which has not been applied.
+	 */
+	for (uint32 segno = min_segno; found && segno <= max_segno; segno++)
+	{
+		int			fd = spool_open_segment(segno, O_RDONLY);
+		struct stat st;
+		off_t		off = 0;
+		PfwCaptureRecord record;
+		char		prefix[20];
+
+		if (fstat(fd, &st) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not stat spool file \"%s\": %m",
+							spool_path(segno))));
+
+		while (spool_read_header(fd, off, st.st_size, &record,
+								 prefix, sizeof(prefix)))
+		{
+			off += sizeof(PfwCaptureRecord) + MAXALIGN(record.len + 1);
+
+			if (!is_xact_end(prefix))
+				continue;
+
+			end_segno = segno;
+			end_off = off;
+			end_lsn = record.lsn;
+
+			if (record.lsn <= origin_lsn)
+			{
+				spool_read_segno = segno;
+				spool_read_off = off;
+			}
+		}
+
+		close(fd);
+	}
+
+	/* Discard the rest */
+	for (uint32 segno = end_segno + 1; found && segno <= max_segno; segno++)
+	{
+		char	   *path = spool_path(segno);
+
+		if (unlink(path) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not remove spool file \"%s\": %m", path)));
+		pfree(path);
+	}
+
+	spool_write_fd = spool_open_segment(end_segno, O_RDWR | O_CREAT);
+	if (ftruncate(spool_write_fd, end_off) < 0 || pg_fsync(spool_write_fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not truncate spool file: %m")));
+	fsync_fname(pfw_spool_directory, true);
+
+	spool_oldest_segno = min_segno;
+	spool_write_segno = spool_flushed_segno = end_segno;
+	spool_write_off = spool_flushed_off = end_off;
+	spool_written_lsn = spool_flushed_lsn = end_lsn;
+	spool_start_lsn = Max(end_lsn, origin_lsn);
+
+	spool_buf = makeStringInfo();
+	spool_record = makeStringInfo();
+
+	ereport(LOG,
+			(errmsg("spooling received messages into \"%s\"",
+					pfw_spool_directory),
+			 errdetail("Streaming restarts at %X/%X, and changes up to %X/%X have been applied.",
+					   LSN_FORMAT_ARGS(spool_start_lsn),
+					   LSN_FORMAT_ARGS(origin_lsn))));
+}
+
+/*
+ * Write buffered messages to the spool segment.
+ */
+static void
+spool_write(void)
+{
+	int			written = 0;
+
+	while (written < spool_buf->len)
+	{
+		ssize_t		rc;
+
+		rc = pg_pwrite(spool_write_fd, spool_buf->data + written,
+					   spool_buf->len - written, spool_write_off);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write spool file \"%s\": %m",
+							spool_path(spool_write_segno))));
+		}
+
+		written += rc;
+		spool_write_off += rc;
+	}
+
+	resetStringInfo(spool_buf);
+}
+
+/*
+ * Append a received message to the spool.
+ */
+static void
+spool_message(XLogRecPtr lsn, const char *data, int len)
+{
+	PfwCaptureRecord record;
+	static const char padding[MAXIMUM_ALIGNOF + 1] = {0};
+	off_t		size = sizeof(record) + MAXALIGN(len + 1);
+	off_t		end = spool_write_off + spool_buf->len;
+
+	/* Switch to the next segment if the record does not fit */
+	if (end > 0 && end + size > PFW_SPOOL_SEGSIZE)
+	{
+		spool_write();
+
+		if (pg_fsync(spool_write_fd) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not fsync spool file \"%s\": %m",
+							spool_path(spool_write_segno))));
+		close(spool_write_fd);
+
+		spool_write_segno++;
+		spool_write_off = 0;
+		spool_write_fd = spool_open_segment(spool_write_segno,
+											O_RDWR | O_CREAT | O_TRUNC);
+		fsync_fname(pfw_spool_directory, true);
+	}
+
+	record.lsn = lsn;
+	record.len = len;
+	record.reserved = 0;
+
+	appendBinaryStringInfo(spool_buf, (char *) &record, sizeof(record));
+	appendBinaryStringInfo(spool_buf, data, len);
+	appendBinaryStringInfo(spool_buf, padding, MAXALIGN(len + 1) - len);
+
+	/* The received data is terminated by '\0' */
+	spool_in_xact = !is_xact_end(data);
+	if (!spool_in_xact)
+		spool_written_lsn = lsn;
+
+	if (spool_buf->len >= PFW_CAPTURE_BUFSIZE)
+		spool_write();
+}
+
+/*
+ * Write out and fsync the spool. Transactions in it can be reported as
+ * flushed after that.
+ */
+static void
+spool_flush(void)
+{
+	spool_write();
+
+	if (spool_flushed_segno == spool_write_segno &&
+		spool_flushed_off == spool_write_off)
+		return;
+
+	if (pg_fsync(spool_write_fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync spool file \"%s\": %m",
+						spool_path(spool_write_segno))));
+
+	spool_flushed_segno = spool_write_segno;
+	spool_flushed_off = spool_write_off;
+	spool_flushed_lsn = spool_written_lsn;
+}
+
+/*
+ * Return whether the spool has fsynced records which are not applied yet
+ */
+static bool
+spool_backlog(void)
+{
+	return spool_read_segno < spool_flushed_segno ||
+		   spool_read_off < spool_flushed_off;
+}
+
+/*
+ * Read the next record to be applied into spool_record. Only fsynced
+ * records are applied, so that the applied position never goes beyond the
+ * spool.
+ */
+static bool
+spool_read(XLogRecPtr *lsn)
+{
+	PfwCaptureRecord record;
+	int			size;
+
+	while (spool_backlog())
+	{
+		off_t		end = PG_INT64_MAX;
+
+		if (spool_read_fd < 0)
+			spool_read_fd = spool_open_segment(spool_read_segno, O_RDONLY);
+
+		if (spool_read_segno == spool_flushed_segno)
+			end = spool_flushed_off;
+
+		if (!spool_read_header(spool_read_fd, spool_read_off, end, &record,
+							   NULL, 0))
+		{
+			/* The segment ends, move to the next one */
+			if (spool_read_segno == spool_flushed_segno)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("could not read spool file \"%s\"",
+								spool_path(spool_read_segno))));
+
+			close(spool_read_fd);
+			spool_read_fd = -1;
+			spool_read_segno++;
+			spool_read_off = 0;
+			continue;
+		}
+
+		size = MAXALIGN(record.len + 1);
+		resetStringInfo(spool_record);
+		enlargeStringInfo(spool_record, size);
+
+		if (pg_pread(spool_read_fd, spool_record->data, size,
+					 spool_read_off + sizeof(record)) != size)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read spool file \"%s\": %m",
+							spool_path(spool_read_segno))));
+
+		spool_record->len = record.len;
+		spool_read_off += sizeof(record) + size;
+		*lsn = record.lsn;
+
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Apply records from the spool for a while, and remove segments which have
+ * been applied. conn is kept alive while the apply rate is throttled.
+ */
+static void
+spool_apply(WalReceiverConn *conn)
+{
+	TimestampTz start = GetCurrentTimestamp();
+	XLogRecPtr	lsn;
+	MemoryContext oldctx = CurrentMemoryContext;
+
+	while (spool_read(&lsn))
+	{
+		StringInfoData s;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Transaction commands switch the context */
+		MemoryContextSwitchTo(message_context);
+
+		initReadOnlyStringInfo(&s, spool_record->data, spool_record->len);
+
+		/* Recorded by the replication origin at commit */
+		current_lsn = lsn;
+		replorigin_session_origin_lsn = lsn;
+
+		apply_message(&s);
+
+		reset_message_context();
+
+		throttle_wait(conn, InvalidXLogRecPtr);
+
+		if (TimestampDifferenceExceeds(start, GetCurrentTimestamp(),
+									   PFW_SPOOL_APPLY_MS))
+			break;
+	}
+
+	MemoryContextSwitchTo(oldctx);
+
+	/* Segments before a transaction boundary are not needed anymore */
+	if (IsTransactionState())
+		return;
+
+	for (; spool_oldest_segno < spool_read_segno; spool_oldest_segno++)
+	{
+		char	   *path = spool_path(spool_oldest_segno);
+
+		if (unlink(path) < 0 && errno != ENOENT)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not remove spool file \"%s\": %m", path)));
+		pfree(path);
+	}
+}
+
+/*
+ * Return whether received records are written into the sink
+ */
+static bool
+sink_enabled(void)
+{
+	return pfw_sink_directory != NULL && pfw_sink_directory[0] != '\0';
+}
+
+/*
+ * Return the path of the open sink segment, or of the segment which ends at
+ * the LSN
+ */
+static char *
+sink_path(XLogRecPtr lsn)
+{
+	if (XLogRecPtrIsInvalid(lsn))
+		return psprintf("%s/%s.partial", pfw_sink_directory, pfw_slot_name);
+
+	return psprintf("%s/%s.%08X%08X.%s%s", pfw_sink_directory, pfw_slot_name,
+					LSN_FORMAT_ARGS(lsn),
+					pfw_sink_format == PFW_SINK_NDJSON ? "ndjson" : "bin",
+					pfw_sink_compression ? ".gz" : "");
+}
+
+/*
+ * Open a new sink segment
+ */
+static void
+sink_open_segment(void)
+{
+	char	   *path = sink_path(InvalidXLogRecPtr);
+
+	sink_fd = BasicOpenFile(path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+	if (sink_fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open sink file \"%s\": %m", path)));
+
+#ifdef HAVE_LIBZ
+	if (pfw_sink_compression)
+	{
+		sink_gz = gzdopen(sink_fd, "wb");
+		if (sink_gz == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("could not compress sink file \"%s\"", path)));
+	}
+#endif
+
+	/* Binary segments are capture files */
+	if (pfw_sink_format == PFW_SINK_BINARY)
+	{
+		PfwCaptureHeader header;
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, PFW_CAPTURE_MAGIC, sizeof(header.magic));
+		appendBinaryStringInfo(sink_buf, (char *) &header, sizeof(header));
+	}
+
+	sink_segment_bytes = 0;
+	sink_segment_start = GetCurrentTimestamp();
+
+	pfree(path);
+}
+
+/*
+ * Open the sink specified by pg_follower.sink_directory, if any.
+ *
+ * Streaming restarts after the last segment, and the open segment of the
+ * previous run, which has not been reported as flushed, is discarded.
+ */
+static void
+sink_open(void)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	size_t		prefixlen = strlen(pfw_slot_name);
+
+	if (!sink_enabled())
+		return;
+
+	if (spool_enabled())
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("\"pg_follower.sink_directory\" cannot be used with \"pg_follower.spool_directory\"")));
+
+	if (MakePGDirectory(pfw_sink_directory) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create sink directory \"%s\": %m",
+						pfw_sink_directory)));
+
+	dir = AllocateDir(pfw_sink_directory);
+	while ((de = ReadDir(dir, pfw_sink_directory)) != NULL)
+	{
+		uint32		hi;
+		uint32		lo;
+		XLogRecPtr	lsn;
+
+		if (strncmp(de->d_name, pfw_slot_name, prefixlen) != 0 ||
+			de->d_name[prefixlen] != '.' ||
+			sscanf(de->d_name + prefixlen + 1, "%08X%08X.", &hi, &lo) != 2)
+			continue;
+
+		lsn = ((uint64) hi << 32) | lo;
+		if (lsn > sink_flushed_lsn)
+			sink_flushed_lsn = lsn;
+	}
+	FreeDir(dir);
+
+	sink_written_lsn = sink_flushed_lsn;
+	spool_start_lsn = sink_flushed_lsn;
+
+	sink_buf = makeStringInfo();
+	sink_open_segment();
+
+	ereport(LOG,
+			(errmsg("writing received records into \"%s\"",
+					pfw_sink_directory),
+			 errdetail("Streaming starts at %X/%X.",
+					   LSN_FORMAT_ARGS(spool_start_lsn))));
+}
+
+/*
+ * Write buffered records to the open sink segment.
+ */
+static void
+sink_write(void)
+{
+	int			written = 0;
+
+	if (sink_buf->len == 0)
+		return;
+
+#ifdef HAVE_LIBZ
+	if (sink_gz != NULL)
+	{
+		if (gzwrite(sink_gz, sink_buf->data, sink_buf->len) != sink_buf->len)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write sink file \"%s\": %m",
+							sink_path(InvalidXLogRecPtr))));
+		written = sink_buf->len;
+	}
+#endif
+
+	while (written < sink_buf->len)
+	{
+		int			rc;
+
+		rc = write(sink_fd, sink_buf->data + written,
+				   sink_buf->len - written);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write sink file \"%s\": %m",
+							sink_path(InvalidXLogRecPtr))));
+		}
+
+		written += rc;
+	}
+
+	resetStringInfo(sink_buf);
+}
+
+/*
+ * Close the open sink segment and rename it after the last transaction end
+ * in it. durable_rename() fsyncs the file and the directory, so transactions
+ * in it can be reported as flushed after that.
+ */
+static void
+sink_rotate(void)
+{
+	char	   *path;
+	char	   *newpath;
+
+	if (sink_segment_bytes == 0)
+		return;
+
+	Assert(!sink_in_xact);
+
+	sink_write();
+
+#ifdef HAVE_LIBZ
+	if (sink_gz != NULL)
+	{
+		/* This closes sink_fd too */
+		if (gzclose(sink_gz) != Z_OK)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not close sink file \"%s\": %m",
+							sink_path(InvalidXLogRecPtr))));
+		sink_gz = NULL;
+		sink_fd = -1;
+	}
+#endif
+
+	if (sink_fd >= 0)
+		close(sink_fd);
+
+	path = sink_path(InvalidXLogRecPtr);
+	newpath = sink_path(sink_written_lsn);
+	durable_rename(path, newpath, ERROR);
+
+	elog(DEBUG1, "closed sink file \"%s\"", newpath);
+
+	sink_flushed_lsn = sink_written_lsn;
+
+	pfree(path);
+	pfree(newpath);
+
+	sink_open_segment();
+}
+
+/*
+ * Append a received record to the sink, and switch to the next segment at a
+ * transaction end if the open one is large enough.
+ */
+static void
+sink_message(XLogRecPtr lsn, const char *data, int len)
+{
+	int			start = sink_buf->len;
+
+	if (pfw_sink_format == PFW_SINK_NDJSON)
+	{
+		/* The received data is terminated by '\0' */
+		appendStringInfo(sink_buf, "{\"lsn\":\"%X/%X\",\"record\":",
+						 LSN_FORMAT_ARGS(lsn));
+		escape_json(sink_buf, data);
+		appendStringInfoString(sink_buf, "}\n");
+	}
+	else
+	{
+		PfwCaptureRecord record;
+		static const char padding[MAXIMUM_ALIGNOF + 1] = {0};
+
+		record.lsn = lsn;
+		record.len = len;
+		record.reserved = 0;
+
+		appendBinaryStringInfo(sink_buf, (char *) &record, sizeof(record));
+		appendBinaryStringInfo(sink_buf, data, len);
+		appendBinaryStringInfo(sink_buf, padding, MAXALIGN(len + 1) - len);
+	}
+
+	sink_segment_bytes += sink_buf->len - start;
+	sink_in_xact = !is_xact_end(data);
+
+	if (!sink_in_xact)
+	{
+		sink_written_lsn = lsn;
+
+		if (sink_segment_bytes >= pfw_sink_segment_size)
+		{
+			sink_rotate();
+			return;
+		}
+	}
+
+	if (sink_buf->len >= PFW_CAPTURE_BUFSIZE)
+		sink_write();
+}
+
+/*
+ * Write out buffered records, and close the open segment at a transaction
+ * boundary if it has been open for PFW_SINK_SEGMENT_MS, or if force is set.
+ */
+static void
+sink_flush(bool force)
+{
+	sink_write();
+
+	if (sink_in_xact)
+		return;
+
+	if (force ||
+		TimestampDifferenceExceeds(sink_segment_start, GetCurrentTimestamp(),
+								   PFW_SINK_SEGMENT_MS))
+		sink_rotate();
+}
+
+/*
+ * Apply messages recorded in the capture file, as fast as possible.
+ *
+ * The file is mapped and each payload is applied in place. A truncated
+ * record at the end, e.g. by a crash while capturing, is ignored.
+ */
+static void
+replay_file(const char *path, uint64 *messages, uint64 *bytes)
+{
+	PfwCaptureHeader header;
+	struct stat st;
+	int			fd;
+	char	   *base;
+	char	   *ptr;
+	char	   *end;
+	bool		packed;
+
+	fd = BasicOpenFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open capture file \"%s\": %m", path)));
+
+	if (fstat(fd, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat capture file \"%s\": %m", path)));
+
+	if (st.st_size < sizeof(header))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("\"%s\" is not a capture file", path)));
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not map capture file \"%s\": %m", path)));
+
+	close(fd);
+
+	/* The file is read sequentially */
+	(void) posix_madvise(base, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	memcpy(&header, base, sizeof(header));
+
+	if (memcmp(header.magic, PFW_CAPTURE_MAGIC, sizeof(header.magic)) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("\"%s\" is not a capture file", path)));
+
+	packed = (header.flags & PFW_CAPTURE_PACKED) != 0;
+
+	ptr = base + sizeof(header);
+	end = base + st.st_size;
+
+	while (ptr + sizeof(PfwCaptureRecord) <= end)
+	{
+		PfwCaptureRecord record;
+		StringInfoData s;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+			reload_config();
+
+		memcpy(&record, ptr, sizeof(record));
+		ptr += sizeof(record);
+
+		if (ptr + MAXALIGN(record.len + 1) > end)
+		{
+			ereport(WARNING,
+					(errmsg("ignored truncated message at %X/%X in capture file \"%s\"",
+							LSN_FORMAT_ARGS(record.lsn), path)));
+			break;
+		}
+
+		MemoryContextSwitchTo(message_context);
+
+		initReadOnlyStringInfo(&s, ptr, record.len);
+
+		if (packed)
+			apply_packed_message(&s);
+		else
+			apply_message(&s);
+
+		reset_message_context();
+
+		throttle_wait(NULL, InvalidXLogRecPtr);
+
+		(*messages)++;
+		*bytes += record.len;
+
+		ptr += MAXALIGN(record.len + 1);
+	}
+
+	MemoryContextSwitchTo(pfw_worker_context);
+
+	/* Build indexes as the worker does when all the data is applied */
+	if (!IsTransactionState())
+		build_deferred_indexes(false);
+
+	munmap(base, st.st_size);
+}
+
+/*
+ * Read received message and apply via server programming interface 
+ *
+ * Custom wait events are reported while executing statements and committing,
+ * so that sampling pg_stat_activity can tell them from network waits. Note
+ * that waits inside them, e.g. for I/O, overwrite the event.
+ */
+static void
+apply_message(StringInfo message)
+{
+	const char *query = pq_getmsgbytes(message,
+									   (message->len - message->cursor));
+	uint64		rows = 0;
+	instr_time	start;
+
+	/* Records applied before an intermediate commit are not applied again */
+	if (bulk_skip > 0 && strncmp(query, "BEGIN", 5) != 0 && !is_xact_end(query))
+	{
+		bulk_skip--;
+		bulk_records++;
+		return;
+	}
+
+	TRACE_PG_FOLLOWER_APPLY_MESSAGE_START(query);
+
+	if (pfw_slow_transaction_threshold >= 0)
+		INSTR_TIME_SET_CURRENT(start);
+	else
+		INSTR_TIME_SET_ZERO(start);
+
+	/* Indexes of a reloaded table must be ready for other records */
+	if (*query != PFW_INSERT_BATCH)
+		reload_finish();
+
+	if (*query == PFW_INSERT_BATCH)
+		elog(DEBUG1, "received insert batch into %s", query + 1);
+	else
+		elog(DEBUG1, "received query: %s", query);
+
+	if (*query == PFW_INSERT_BATCH)
+	{
+		rows = apply_insert_batch(query, message->len);
+
+		relay_record(query, message->len);
+		bulk_after_record(query, rows, message->len);
+	}
+	else if (strncmp(query, "BEGIN", 5) == 0)
+	{
+		/*
+		 * A prepared transaction keeps its locks until it is finished, and
+		 * CREATE INDEX in another transaction would wait for them.  Build
+		 * deferred indexes before it starts.
+		 */
+		if (strstr(query, "-- prepare") != NULL)
+			build_deferred_indexes(false);
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+
+		/* The contexts of SPI are created for each transaction */
+		count_allocations(TopTransactionContext);
+
+		bulk_begin();
+	}
+	else if (strncmp(query, "CREATE", 5) == 0 ||
+			 strncmp(query, "DROP", 4) == 0 ||
+			 strncmp(query, "ALTER TABLE", 11) == 0)
+	{
+		int ret;
+
+		/*
+		 * Remember CREATE INDEX to build it after all the available changes
+		 * are applied.
+		 */
+		if (pfw_defer_index_build && is_create_index(query))
+		{
+			MemoryContext oldctx = MemoryContextSwitchTo(pfw_worker_context);
+			Oid			argtypes[3] = {INT4OID, INT4OID, TEXTOID};
+			Datum		values[3];
+
+			deferred_indexes = lappend(deferred_indexes, pstrdup(query));
+			MemoryContextSwitchTo(oldctx);
+
+			values[0] = Int32GetDatum(pfw_group);
+			values[1] = Int32GetDatum(list_length(deferred_indexes));
+			values[2] = CStringGetTextDatum(query);
+
+			if (deferred_index_table != NULL)
+				execute_local(psprintf("INSERT INTO %s VALUES ($1, $2, $3)",
+									   deferred_index_table),
+							  3, argtypes, values, SPI_OK_INSERT);
+		}
+		else
+		{
+			/* Other DDLs might depend on deferred indexes, so build them first */
+			build_deferred_indexes(true);
+
+			ret = execute_record(query);
+
+			if (ret != SPI_OK_UTILITY)
+				elog(ERROR, "failed to execute query content: \"%s\" length:%d", query, ret);
+		}
+
+		relay_record(query, strlen(query));
+		bulk_after_record(query, 0, message->len);
+	}
+	else if (strncmp(query, "PREPARE TRANSACTION", 19) == 0)
+	{
+		char *gid = extract_gid(query);
+
+		/* Indexes deferred by the transaction are prepared with it */
+		build_deferred_indexes(true);
+
+		bulk_finish();
+
+		SPI_finish();
+		PopActiveSnapshot();
+
+		/*
+		 * PrepareTransactionBlock() must be called inside a transaction block.
+		 * Start it here, as the built-in apply worker does.
+		 */
+		pgstat_report_wait_start(pfw_we_commit);
+		BeginTransactionBlock();
+		CommitTransactionCommand();
+		PrepareTransactionBlock(gid);
+		CommitTransactionCommand();
+		pgstat_report_wait_end();
+
+		pfree(gid);
+	}
+	else if (strncmp(query, "COMMIT PREPARED", 15) == 0)
+	{
+		finish_prepared(query, true);
+		advance_applied_lsn(current_lsn);
+	}
+	else if (strncmp(query, "ROLLBACK PREPARED", 17) == 0)
+	{
+		finish_prepared(query, false);
+		advance_applied_lsn(current_lsn);
+	}
+	else if (strncmp(query, "COMMIT", 6) == 0)
+	{
+		bulk_finish();
+
+		SPI_finish();
+		PopActiveSnapshot();
+
+		pgstat_report_wait_start(pfw_we_commit);
+		CommitTransactionCommand();
+		pgstat_report_wait_end();
+
+		advance_applied_lsn(current_lsn);
+	}
+	/* Seems normal DML commands or TRUNCATE. Use the given string as-is. */
+	else
+	{
+		int ret;
+
+		ret = execute_record(query);
+
+		if (ret < 0)
+			elog(ERROR, "failed to execute query :%s :%d", query, ret);
+
+		rows = SPI_processed;
+
+		if (strncmp(query, "TRUNCATE ", 9) == 0)
+			reload_begin(query);
+
+		relay_record(query, strlen(query));
+		bulk_after_record(query, rows, message->len);
+	}
+
+	TRACE_PG_FOLLOWER_APPLY_MESSAGE_DONE(query);
+
+	if (pfw_slow_transaction_threshold >= 0)
+		sample_record(query, rows, message->len, start);
+
+	alloc_rows += rows;
+
+	throttle_charge(rows, message->len);
+}
+
+/*
+ * Apply records packed into a message. Each record is prefixed by its length
+ * and terminated by '\0', see begin_record() in pg_follower_output.c.
+ */
+static void
+apply_packed_message(StringInfo message)
+{
+	int			seq = 0;
+
+	prefetch_offset = message->cursor;
+	prefetch_seq = 0;
+
+	while (message->cursor < message->len)
+	{
+		int				len;
+		StringInfoData	record;
+
+		if (pfw_prefetch_distance > 0)
+			prefetch_ahead(message, seq);
+
+		len = pq_getmsgint(message, 4);
+		initReadOnlyStringInfo(&record,
+							   unconstify(char *, pq_getmsgbytes(message, len)),
+							   len);
+		apply_message(&record);
+		seq++;
+	}
+
+	if (prefetch_context)
+		MemoryContextReset(prefetch_context);
+	prefetch_keys = NIL;
+}
+
+/*
+ * Find " WHERE " which follows the target and the SET list of a record,
+ * skipping literals and quoted identifiers. Returns NULL if not found.
+ */
+static const char *
+find_where_clause(const char *p)
+{
+	char		quote = '\0';
+
+	for (; *p; p++)
+	{
+		if (quote != '\0')
+		{
+			/* A doubled quote is an escaped one */
+			if (*p == quote)
+			{
+				if (p[1] == quote)
+					p++;
+				else
+					quote = '\0';
+			}
+		}
+		else if (*p == '\'' || *p == '"')
+			quote = *p;
+		else if (strncmp(p, " WHERE ", 7) == 0)
+			return p + 7;
+	}
+
+	return NULL;
+}
+
+/*
+ * Read a quoted token starting at *p, and advance *p after it
+ */
+static char *
+read_quoted(const char **p)
+{
+	char		quote = **p;
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+
+	for ((*p)++; **p; (*p)++)
+	{
+		if (**p == quote)
+		{
+			if ((*p)[1] != quote)
+			{
+				(*p)++;
+				return buf.data;
+			}
+			(*p)++;
+		}
+		appendStringInfoChar(&buf, **p);
+	}
+
+	return NULL;
+}
+
+/*
+ * Parse the WHERE clause of a keyed record, which identity_clause() in
+ * pg_follower_output.c builds as "column = literal [AND ...];", and convert
+ * the values of the index columns. Returns false if the clause does not
+ * match the index, e.g. for REPLICA IDENTITY FULL.
+ */
+static bool
+parse_key_clause(const char *p, Relation rel, Relation index, Datum *values)
+{
+	int			nkeys = IndexRelationGetNumberOfKeyAttributes(index);
+	bool		found[INDEX_MAX_KEYS] = {0};
+	int			nfound = 0;
+
+	for (;;)
+	{
+		char	   *name;
+		char	   *literal;
+		AttrNumber	attnum;
+		int			key;
+		Form_pg_attribute att;
+		Oid			typinput;
+		Oid			typioparam;
+		ErrorSaveContext escontext = {T_ErrorSaveContext};
+
+		/* Column name, which is quoted if needed */
+		if (*p == '"')
+			name = read_quoted(&p);
+		else
+		{
+			int			len = strcspn(p, " ");
+
+			name = pnstrdup(p, len);
+			p += len;
+		}
+
+		if (name == NULL || strncmp(p, " = ", 3) != 0)
+			return false;
+		p += 3;
+
+		/* Literal, see print_literal() in pg_follower_output.c */
+		if (*p == '\'')
+			literal = read_quoted(&p);
+		else if (strncmp(p, "B'", 2) == 0)
+		{
+			p++;
+			literal = read_quoted(&p);
+		}
+		else
+		{
+			int			len = strcspn(p, " ;");
+
+			literal = pnstrdup(p, len);
+			p += len;
+		}
+
+		if (literal == NULL)
+			return false;
+
+		attnum = attnameAttNum(rel, name, false);
+
+		for (key = 0; key < nkeys; key++)
+		{
+			if (index->rd_index->indkey.values[key] == attnum)
+				break;
+		}
+
+		if (attnum == InvalidAttrNumber || key == nkeys || found[key])
+			return false;
+
+		att = TupleDescAttr(RelationGetDescr(rel), attnum - 1);
+		getTypeInputInfo(att->atttypid, &typinput, &typioparam);
+
+		if (!OidInputFunctionCallSafe(typinput, literal, typioparam,
+									  att->atttypmod, (Node *) &escontext,
+									  &values[key]))
+			return false;
+
+		found[key] = true;
+		nfound++;
+
+		if (*p == ';')
+			break;
+		if (strncmp(p, " AND ", 5) != 0)
+			return false;
+		p += 5;
+	}
+
+	return nfound == nkeys;
+}
+
+/*
+ * Descend the btree for the key, and prefetch the leaf page which holds it.
+ * Inner pages are read, which are usually cached. Concurrent page splits are
+ * not followed, since the prefetch is only a hint.
+ */
+static void
+prefetch_leaf(Relation rel, Relation index, Datum *values)
+{
+	bool		isnull[INDEX_MAX_KEYS] = {0};
+	IndexTuple	itup;
+	BTScanInsert key;
+	Buffer		buf;
+
+	itup = index_form_tuple(RelationGetDescr(index), values, isnull);
+	key = _bt_mkscankey(index, itup);
+
+	buf = _bt_getroot(index, rel, BT_READ);
+
+	/* The index is empty */
+	if (!BufferIsValid(buf))
+		return;
+
+	for (;;)
+	{
+		Page		page = BufferGetPage(buf);
+		BTPageOpaque opaque = BTPageGetOpaque(page);
+		OffsetNumber low = P_FIRSTDATAKEY(opaque);
+		OffsetNumber high = PageGetMaxOffsetNumber(page) + 1;
+		BlockNumber child;
+
+		/* The root is a leaf, which is in the buffer already */
+		if (P_ISLEAF(opaque) || high <= low)
+			break;
+
+		/* Find the last downlink less than the key, as _bt_binsrch() does */
+		while (high > low)
+		{
+			OffsetNumber mid = low + ((high - low) / 2);
+
+			if (_bt_compare(index, key, page, mid) >= 1)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+
+		child = BTreeTupleGetDownLink((IndexTuple)
+									  PageGetItem(page, PageGetItemId(page, OffsetNumberPrev(low))));
+
+		if (opaque->btpo_level == 1)
+		{
+			PrefetchBuffer(index, MAIN_FORKNUM, child);
+			break;
+		}
+
+		buf = _bt_relandgetbuf(index, buf, child, BT_READ);
+	}
+
+	_bt_relbuf(index, buf);
+}
+
+/*
+ * Look up the key in the index, whose leaf page has been prefetched, and
+ * prefetch the heap pages of the rows.
+ */
+static void
+prefetch_heap(PrefetchKey *entry)
+{
+	Relation	rel;
+	Relation	index;
+	ScanKeyData skey[INDEX_MAX_KEYS];
+	IndexScanDesc scan;
+	ItemPointer tid;
+
+	/* The lock might have been released by an intermediate commit */
+	if (!ConditionalLockRelationOid(entry->relid, AccessShareLock))
+		return;
+
+	rel = try_relation_open(entry->relid, NoLock);
+	if (rel == NULL)
+		return;
+
+	if (RelationGetReplicaIndex(rel) != entry->indexid)
+	{
+		relation_close(rel, NoLock);
+		return;
+	}
+
+	index = index_open(entry->indexid, AccessShareLock);
+
+	/* Equality keys, as build_replindex_scan_key() in execReplication.c */
+	for (int i = 0; i < entry->nkeys; i++)
+	{
+		Oid			optype = index->rd_opcintype[i];
+		Oid			operator;
+
+		operator = get_opfamily_member(index->rd_opfamily[i], optype, optype,
+									   BTEqualStrategyNumber);
+		if (!OidIsValid(operator))
+			elog(ERROR, "missing operator %d(%u,%u) in opfamily %u",
+				 BTEqualStrategyNumber, optype, optype, index->rd_opfamily[i]);
+
+		ScanKeyEntryInitialize(&skey[i], 0, i + 1, BTEqualStrategyNumber,
+							   optype, index->rd_indcollation[i],
+							   get_opcode(operator), entry->values[i]);
+	}
+
+	scan = index_beginscan(rel, index, GetActiveSnapshot(), entry->nkeys, 0);
+	index_rescan(scan, skey, entry->nkeys, NULL, 0);
+
+	while ((tid = index_getnext_tid(scan, ForwardScanDirection)) != NULL)
+		PrefetchBuffer(rel, MAIN_FORKNUM, ItemPointerGetBlockNumber(tid));
+
+	index_endscan(scan);
+	index_close(index, NoLock);
+	relation_close(rel, NoLock);
+}
+
+/*
+ * Look at the record, and prefetch the index leaf page of its key if it is an
+ * UPDATE or DELETE of a table with a btree replica identity index. The key is
+ * queued for prefetching heap pages.
+ */
+static void
+prefetch_record(const char *record, int seq)
+{
+	const char *target;
+	const char *end;
+	const char *clause;
+	char	   *name;
+	Oid			relid;
+	Oid			indexid;
+	Relation	rel;
+	Relation	index;
+	PrefetchKey *entry;
+
+	if (strncmp(record, "UPDATE ", 7) == 0)
+	{
+		target = record + 7;
+		end = strstr(target, " SET ");
+	}
+	else if (strncmp(record, "DELETE FROM ", 12) == 0)
+	{
+		target = record + 12;
+		end = strstr(target, " WHERE ");
+	}
+	else
+		return;
+
+	if (end == NULL || (clause = find_where_clause(end)) == NULL)
+		return;
+
+	name = pnstrdup(target, end - target);
+	relid = RangeVarGetRelid(makeRangeVarFromNameList(stringToQualifiedNameList(name, NULL)),
+							 NoLock, true);
+
+	/* Do not wait for a lock which the record itself would take later */
+	if (!OidIsValid(relid) ||
+		!ConditionalLockRelationOid(relid, AccessShareLock))
+		return;
+
+	rel = try_relation_open(relid, NoLock);
+	if (rel == NULL)
+		return;
+
+	indexid = RelationGetReplicaIndex(rel);
+	if (rel->rd_rel->relkind != RELKIND_RELATION || !OidIsValid(indexid))
+	{
+		relation_close(rel, NoLock);
+		return;
+	}
+
+	index = index_open(indexid, AccessShareLock);
+
+	entry = palloc(sizeof(PrefetchKey));
+	entry->seq = seq;
+	entry->relid = relid;
+	entry->indexid = indexid;
+	entry->nkeys = IndexRelationGetNumberOfKeyAttributes(index);
+
+	if (index->rd_rel->relam == BTREE_AM_OID &&
+		parse_key_clause(clause, rel, index, entry->values))
+	{
+		prefetch_leaf(rel, index, entry->values);
+		prefetch_keys = lappend(prefetch_keys, entry);
+	}
+	else
+		pfree(entry);
+
+	index_close(index, NoLock);
+	relation_close(rel, NoLock);
+}
+
+/*
+ * Prefetch pages for keyed changes ahead of the record being applied, up to
+ * pg_follower.prefetch_distance records ahead in the message.
+ *
+ * Index leaf pages are prefetched when a record enters the window, and heap
+ * pages when it comes within half of it, since the leaf page must be read to
+ * find them. Records after the end of the transaction are looked at once the
+ * next one begins, because catalogs cannot be accessed in between.
+ */
+static void
+prefetch_ahead(StringInfo message, int seq)
+{
+	MemoryContext oldctx;
+
+	if (prefetch_context == NULL)
+		prefetch_context = AllocSetContextCreate(pfw_worker_context,
+												 "pfw_prefetch_context",
+												 ALLOCSET_DEFAULT_SIZES);
+
+	if (prefetch_seq < seq)
+	{
+		prefetch_seq = seq;
+		prefetch_offset = message->cursor;
+	}
+
+	if (!IsTransactionState())
+		return;
+
+	oldctx = MemoryContextSwitchTo(prefetch_context);
+
+	while (prefetch_seq <= seq + pfw_prefetch_distance &&
+		   prefetch_offset < message->len)
+	{
+		uint32		len;
+		const char *record = message->data + prefetch_offset + 4;
+
+		memcpy(&len, message->data + prefetch_offset, 4);
+
+		if (is_xact_end(record))
+			break;
+
+		if (prefetch_seq > seq)
+			prefetch_record(record, prefetch_seq);
+
+		prefetch_offset += 4 + pg_ntoh32(len);
+		prefetch_seq++;
+	}
+
+	while (prefetch_keys != NIL)
+	{
+		PrefetchKey *entry = linitial(prefetch_keys);
+
+		if (entry->seq > seq + pfw_prefetch_distance / 2)
+			break;
+
+		if (entry->seq > seq)
+			prefetch_heap(entry);
+
+		prefetch_keys = list_delete_first(prefetch_keys);
+		pfree(entry);
+	}
+
+	MemoryContextSwitchTo(oldctx);
+}
+
+/*
+ * Parse an insert batch. The returned columns point into the data.
+ */
+static BatchColumn *
+read_insert_batch(const char *data, int len, const char **target,
+				  int *nrows, int *ncols)
+{
+	StringInfoData s;
+	BatchColumn *columns;
+
+	initReadOnlyStringInfo(&s, unconstify(char *, data), len);
+
+	(void) pq_getmsgbyte(&s);	/* PFW_INSERT_BATCH */
+	*target = pq_getmsgrawstring(&s);
+	*nrows = pq_getmsgint(&s, 4);
+	*ncols = pq_getmsgint(&s, 2);
+
+	columns = palloc(sizeof(BatchColumn) * *ncols);
+
+	for (int i = 0; i < *ncols; i++)
+	{
+		BatchColumn *column = &columns[i];
+
+		column->name = pq_getmsgrawstring(&s);
+		column->typid = pq_getmsgint(&s, 4);
+		column->typlen = (int16) pq_getmsgint(&s, 2);
+		column->nulls = pq_getmsgbytes(&s, (*nrows + 7) / 8);
+
+		/* The OIDs of other types might mean something else here */
+		if (column->typlen > 0 && !pfw_is_binary_batch_type(column->typid))
+			ereport(ERROR,
+					(errcode(ERRCODE_PROTOCOL_VIOLATION),
+					 errmsg("binary values of type %u are not supported in insert batches",
+							column->typid)));
+
+		if (column->typlen > 0)
+		{
+			column->offsets = NULL;
+			column->values = pq_getmsgbytes(&s, *nrows * column->typlen);
+		}
+		else
+		{
+			column->offsets = pq_getmsgbytes(&s, *nrows * sizeof(uint32));
+			column->values = pq_getmsgbytes(&s, pq_getmsgint(&s, 4));
+		}
+	}
+
+	return columns;
+}
+
+/*
+ * Return a fixed-width value of an insert batch as a Datum
+ */
+static Datum
+batch_fixed_value(BatchColumn *column, int row)
+{
+	const char *ptr = column->values + row * column->typlen;
+
+	switch (column->typlen)
+	{
+		case 1:
+			return CharGetDatum(*ptr);
+		case 2:
+			{
+				uint16		value;
+
+				memcpy(&value, ptr, sizeof(value));
+				return Int16GetDatum((int16) pg_ntoh16(value));
+			}
+		case 4:
+			{
+				uint32		value;
+
+				memcpy(&value, ptr, sizeof(value));
+				return Int32GetDatum((int32) pg_ntoh32(value));
+			}
+		case 8:
+			{
+				uint64		value;
+
+				memcpy(&value, ptr, sizeof(value));
+				return Int64GetDatum((int64) pg_ntoh64(value));
+			}
+	}
+
+	elog(ERROR, "unexpected length of fixed-width values: %d", column->typlen);
+	return (Datum) 0;			/* keep compiler quiet */
+}
+
+/*
+ * Return a text value of an insert batch
+ */
+static char *
+batch_text_value(BatchColumn *column, int row)
+{
+	uint32		offset;
+
+	memcpy(&offset, column->offsets + row * sizeof(uint32), sizeof(uint32));
+
+	return unconstify(char *, column->values + pg_ntoh32(offset));
+}
+
+/*
+ * Convert values of an insert batch column into Datums of the attribute.
+ *
+ * Binary values of the same type are used as they are. Others go through the
+ * text form, as INSERT records do. The column is converted at once so that
+ * the lookups are done once and the conversion runs in a tight loop.
+ */
+static void
+convert_batch_column(BatchColumn *column, int nrows, Form_pg_attribute att,
+					 Datum *values, bool *isnull)
+{
+	Oid			typinput;
+	Oid			typioparam;
+	FmgrInfo	finput;
+	FmgrInfo	foutput;
+
+	for (int row = 0; row < nrows; row++)
+		isnull[row] = BATCH_VALUE_IS_NULL(column, row);
+
+	if (column->typlen > 0 && column->typid == att->atttypid)
+	{
+		for (int row = 0; row < nrows; row++)
+			values[row] = isnull[row] ? (Datum) 0 : batch_fixed_value(column, row);
+		return;
+	}
+
+	getTypeInputInfo(att->atttypid, &typinput, &typioparam);
+	fmgr_info(typinput, &finput);
+
+	if (column->typlen > 0)
+	{
+		Oid			typoutput;
+		bool		typisvarlena;
+
+		getTypeOutputInfo(column->typid, &typoutput, &typisvarlena);
+		fmgr_info(typoutput, &foutput);
+	}
+
+	for (int row = 0; row < nrows; row++)
+	{
+		char	   *text;
+
+		if (isnull[row])
+		{
+			values[row] = (Datum) 0;
+			continue;
+		}
+
+		if (column->typlen > 0)
+			text = OutputFunctionCall(&foutput, batch_fixed_value(column, row));
+		else
+			text = batch_text_value(column, row);
+
+		values[row] = InputFunctionCall(&finput, text, typioparam,
+										att->atttypmod);
+	}
+}
+
+/*
+ * Construct a multi-row INSERT from an insert batch
+ */
+static char *
+insert_batch_query(const char *target, BatchColumn *columns, int ncols,
+				   int nrows)
+{
+	StringInfoData query;
+	FmgrInfo   *foutput = palloc(sizeof(FmgrInfo) * ncols);
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "INSERT INTO %s ( ", target);
+
+	for (int i = 0; i < ncols; i++)
+	{
+		if (i > 0)
+			appendStringInfoString(&query, ", ");
+
+		appendStringInfoString(&query, quote_identifier(columns[i].name));
+
+		if (columns[i].typlen > 0)
+		{
+			Oid			typoutput;
+			bool		typisvarlena;
+
+			getTypeOutputInfo(columns[i].typid, &typoutput, &typisvarlena);
+			fmgr_info(typoutput, &foutput[i]);
+		}
+	}
+
+	appendStringInfoString(&query, " ) VALUES ");
+
+	for (int row = 0; row < nrows; row++)
+	{
+		appendStringInfoString(&query, row > 0 ? ", ( " : "( ");
+
+		for (int i = 0; i < ncols; i++)
+		{
+			BatchColumn *column = &columns[i];
+			char	   *text;
+
+			if (i > 0)
+				appendStringInfoString(&query, ", ");
+
+			if (BATCH_VALUE_IS_NULL(column, row))
+			{
+				appendStringInfoString(&query, "NULL");
+				continue;
+			}
+
+			if (column->typlen > 0)
+				text = OutputFunctionCall(&foutput[i],
+										  batch_fixed_value(column, row));
+			else
+				text = batch_text_value(column, row);
+
+			appendStringInfoString(&query, quote_literal_cstr(text));
+		}
+
+		appendStringInfoString(&query, " )");
+	}
+
+	appendStringInfoChar(&query, ';');
+
+	return query.data;
+}
+
+/*
+ * Apply an insert batch. Returns the number of inserted rows.
+ *
+ * Values are converted column by column, and then each row is stored into a
+ * slot and inserted through the executor, as the built-in apply worker does.
+ * Columns which are not sent get their defaults. Tables other than plain ones,
+ * e.g. partitioned tables which route rows, are given a multi-row INSERT
+ * instead. Rows for a table truncated by reload_begin() are written into the
+ * heap directly, and its indexes are built later.
+ */
+static uint64
+apply_insert_batch(const char *data, int len)
+{
+	const char *target;
+	int			nrows;
+	int			ncols;
+	BatchColumn *columns;
+	Relation	rel;
+	TupleDesc	desc;
+	AttrNumber *attnums;
+	Datum	  **values;
+	bool	  **isnull;
+	bool	   *sent;
+	ExprState **defexprs;
+	AttrNumber *defattnums;
+	int			ndefaults = 0;
+	EState	   *estate;
+	RangeTblEntry *rte;
+	List	   *perminfos = NIL;
+	ResultRelInfo *resultRelInfo;
+	TupleTableSlot *slot;
+	ExprContext *econtext;
+	bool		reload;
+	int			options = 0;
+	BulkInsertState bistate = NULL;
+	RepOriginId origin = replorigin_session_origin;
+
+	columns = read_insert_batch(data, len, &target, &nrows, &ncols);
+
+	rel = table_openrv(makeRangeVarFromNameList(stringToQualifiedNameList(target, NULL)),
+					   RowExclusiveLock);
+
+	/* A batch into another table ends the run into a reloaded table */
+	if (RelationGetRelid(rel) != reload_relid)
+		reload_finish();
+
+	reload = OidIsValid(reload_relid);
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION)
+	{
+		char	   *query = insert_batch_query(target, columns, ncols, nrows);
+		int			ret;
+
+		table_close(rel, NoLock);
+
+		ret = execute_record(query);
+
+		if (ret != SPI_OK_INSERT)
+			elog(ERROR, "failed to execute query :%s :%d", query, ret);
+
+		return SPI_processed;
+	}
+
+	desc = RelationGetDescr(rel);
+
+	attnums = palloc(sizeof(AttrNumber) * ncols);
+	values = palloc(sizeof(Datum *) * ncols);
+	isnull = palloc(sizeof(bool *) * ncols);
+	sent = palloc0(sizeof(bool) * desc->natts);
+
+	for (int i = 0; i < ncols; i++)
+	{
+		AttrNumber	attnum = attnameAttNum(rel, columns[i].name, false);
+
+		if (attnum == InvalidAttrNumber)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("column \"%s\" of relation \"%s\" does not exist",
+							columns[i].name, RelationGetRelationName(rel))));
+
+		attnums[i] = attnum;
+		sent[attnum - 1] = true;
+
+		values[i] = palloc(sizeof(Datum) * nrows);
+		isnull[i] = palloc(sizeof(bool) * nrows);
+
+		convert_batch_column(&columns[i], nrows, TupleDescAttr(desc, attnum - 1),
+							 values[i], isnull[i]);
+	}
+
+	/* Set up the executor, as create_edata_for_relation() in worker.c does */
+	estate = CreateExecutorState();
+
+	rte = makeNode(RangeTblEntry);
+	rte->rtekind = RTE_RELATION;
+	rte->relid = RelationGetRelid(rel);
+	rte->relkind = rel->rd_rel->relkind;
+	rte->rellockmode = RowExclusiveLock;
+	addRTEPermissionInfo(&perminfos, rte);
+	ExecInitRangeTable(estate, list_make1(rte), perminfos);
+
+	resultRelInfo = makeNode(ResultRelInfo);
+	InitResultRelInfo(resultRelInfo, rel, 1, NULL, 0);
+
+	if (reload)
+	{
+		options = reload_options;
+
+		/* Frozen rows must not be visible to an older snapshot of ours */
+		if (ThereAreNoPriorRegisteredSnapshots())
+			options |= TABLE_INSERT_FROZEN;
+
+		bistate = GetBulkInsertState();
+	}
+	else
+		ExecOpenIndices(resultRelInfo, false);
+
+	estate->es_output_cid = GetCurrentCommandId(true);
+
+	slot = ExecInitExtraTupleSlot(estate, desc, &TTSOpsVirtual);
+	econtext = GetPerTupleExprContext(estate);
+
+	/* Columns which are not sent get their defaults, as INSERT does */
+	defexprs = palloc(sizeof(ExprState *) * desc->natts);
+	defattnums = palloc(sizeof(AttrNumber) * desc->natts);
+
+	for (int atts = 0; atts < desc->natts; atts++)
+	{
+		Form_pg_attribute att = TupleDescAttr(desc, atts);
+		Node	   *defexpr;
+
+		if (att->attisdropped || att->attgenerated || sent[atts])
+			continue;
+
+		defexpr = build_column_default(rel, atts + 1);
+		if (defexpr == NULL)
+			continue;
+
+		defexprs[ndefaults] = ExecInitExpr(expression_planner((Expr *) defexpr),
+										   NULL);
+		defattnums[ndefaults++] = atts;
+	}
+
+	AfterTriggerBeginQuery();
+
+	/* Changes made by a relay are not decoded for its consumers */
+	if (relay_origin != InvalidRepOriginId)
+		replorigin_session_origin = relay_origin;
+
+	pgstat_report_wait_start(pfw_we_execute);
+
+	for (int row = 0; row < nrows; row++)
+	{
+		ExecClearTuple(slot);
+		memset(slot->tts_isnull, true, sizeof(bool) * desc->natts);
+
+		for (int i = 0; i < ncols; i++)
+		{
+			slot->tts_values[attnums[i] - 1] = values[i][row];
+			slot->tts_isnull[attnums[i] - 1] = isnull[i][row];
+		}
+
+		for (int i = 0; i < ndefaults; i++)
+			slot->tts_values[defattnums[i]] =
+				ExecEvalExpr(defexprs[i], econtext,
+							 &slot->tts_isnull[defattnums[i]]);
+
+		ExecStoreVirtualTuple(slot);
+
+		if (reload)
+		{
+			if (desc->constr)
+				ExecConstraints(resultRelInfo, slot, estate);
+
+			table_tuple_insert(rel, slot, estate->es_output_cid, options,
+							   bistate);
+		}
+		else
+			ExecSimpleRelationInsert(resultRelInfo, estate, slot);
+
+		ResetPerTupleExprContext(estate);
+	}
+
+	AfterTriggerEndQuery(estate);
+
+	pgstat_report_wait_end();
+
+	replorigin_session_origin = origin;
+
+	if (reload)
+	{
+		FreeBulkInsertState(bistate);
+		reload_rows += nrows;
+	}
+
+	ExecCloseIndices(resultRelInfo);
+	ExecResetTupleTable(estate->es_tupleTable, false);
+	FreeExecutorState(estate);
+
+	table_close(rel, NoLock);
+
+	/* Make the rows visible to following records */
+	CommandCounterIncrement();
+
+	return nrows;
+}
+
+/*
+ * main loop for the pg_follower worker
+ *
+ * XXX: basically ported from LogicalRepApplyLoop()
+ */
+static void
+apply_loop(WalReceiverConn *conn)
+{
+	XLogRecPtr last_received = InvalidXLogRecPtr;
+	TimestampTz last_spool_apply = GetCurrentTimestamp();
+	XLogRecPtr	last_requested = InvalidXLogRecPtr;
+	TimestampTz last_request_time = 0;
+	TimeLineID	tli;
+
+	/* Init the message_context which we clean up after messages */
+	message_context = AllocSetContextCreate(pfw_worker_context,
+											"pfw_message_context",
+											ALLOCSET_DEFAULT_MINSIZE,
+											PFW_MESSAGE_ARENA_SIZE,
+											ALLOCSET_DEFAULT_MAXSIZE);
+	count_allocations(pfw_worker_context);
+
+	for (;;)
+	{
+		pgsocket	fd = PGINVALID_SOCKET;
+		int			rc;
+		int			len;
+		char	   *buf = NULL;
+		bool		endofstream = false;
+		XLogRecPtr	requested;
+		TimestampTz now;
+
+		CHECK_FOR_INTERRUPTS();
+
+		MemoryContextSwitchTo(message_context);
+
+		len = walrcv_receive(conn, &buf, &fd);
+
+		if (len != 0)
+		{
+			/* Loop to process all available data (without blocking). */
+			for (;;)
+			{
+				CHECK_FOR_INTERRUPTS();
+
+				if (len == 0)
+				{
+					break;
+				}
+				else if (len < 0)
+				{
+					ereport(LOG,
+							(errmsg("data stream from publisher has ended")));
+					endofstream = true;
+					break;
+				}
+				else
+				{
+					int			c;
+					StringInfoData s;
+
+					if (ConfigReloadPending)
+						reload_config();
+
+					/* Ensure we are reading the data into our memory context. */
+					MemoryContextSwitchTo(message_context);
+
+					initReadOnlyStringInfo(&s, buf, len);
+
+					c = pq_getmsgbyte(&s);
+
+					if (c == 'w')
 					{
 						XLogRecPtr	start_lsn;
 						XLogRecPtr	end_lsn;
@@ -358,65 +4102,445 @@ apply_loop(WalReceiverConn *conn)
 						if (last_received < end_lsn)
 							last_received = end_lsn;
 
-						apply_message(&s);
+						if (capture_fd >= 0)
+							capture_message(start_lsn, s.data + s.cursor,
+											s.len - s.cursor);
+
+						current_lsn = start_lsn;
+
+						if (sink_fd >= 0)
+							sink_message(start_lsn, s.data + s.cursor,
+										 s.len - s.cursor);
+						else if (spool_write_fd >= 0)
+							spool_message(start_lsn, s.data + s.cursor,
+										  s.len - s.cursor);
+						else if (packed_stream)
+							apply_packed_message(&s);
+						else
+							apply_message(&s);
+
+						/* Applied directly, so pay for it before the next */
+						if (sink_fd < 0 && spool_write_fd < 0)
+							throttle_wait(conn, last_received);
 					}
 					else if (c == 'k')
 					{
 						XLogRecPtr	end_lsn;
 						bool		reply_requested;
 
-						end_lsn = pq_getmsgint64(&s);
-						/* Timestamp is not used now */
-						(void) pq_getmsgint64(&s);
-						reply_requested = pq_getmsgbyte(&s);
+						end_lsn = pq_getmsgint64(&s);
+						/* Timestamp is not used now */
+						(void) pq_getmsgint64(&s);
+						reply_requested = pq_getmsgbyte(&s);
+
+						if (last_received < end_lsn)
+							last_received = end_lsn;
+
+						/* Write out captured messages before reporting them */
+						if (capture_fd >= 0)
+							capture_flush();
+
+						if (spool_write_fd >= 0)
+							spool_flush();
+
+						if (sink_fd >= 0)
+							sink_flush(false);
+
+						send_feedback(conn, last_received, reply_requested, false);
+					}
+					/* other message types are purposefully ignored */
+
+					reset_message_context();
+				}
+
+				/* Do not let receiving into the spool starve applying */
+				if (spool_write_fd >= 0 &&
+					TimestampDifferenceExceeds(last_spool_apply,
+											   GetCurrentTimestamp(),
+											   PFW_SPOOL_APPLY_MS))
+					break;
+
+				len = walrcv_receive(conn, &buf, &fd);
+			}
+		}
+
+		/* Make received messages durable, and apply some of them */
+		if (spool_write_fd >= 0)
+		{
+			spool_flush();
+			spool_apply(conn);
+			last_spool_apply = GetCurrentTimestamp();
+		}
+
+		/*
+		 * All the available data has been applied. Build deferred indexes
+		 * unless a transaction is still in progress.
+		 */
+		if (!IsTransactionState() && !(spool_write_fd >= 0 && spool_backlog()))
+		{
+			build_deferred_indexes(false);
+
+			if (triggers_need_update)
+				enable_always_triggers();
+
+			/*
+			 * Everything received so far has been applied, unless it is
+			 * written into the sink instead
+			 */
+			if (sink_fd < 0)
+				advance_applied_lsn(last_received);
+		}
+
+		if (capture_fd >= 0)
+			capture_flush();
+
+		if (sink_fd >= 0)
+			sink_flush(false);
+
+		/*
+		 * The walsender does not send anything for transactions which have no
+		 * changes for us, so ask it to report its position if waiters need
+		 * more than we have received. Its reply wakes us up again, so the
+		 * same request is repeated at most once per
+		 * wal_receiver_status_interval.
+		 */
+		requested = pg_atomic_read_u64(&pfw_state->requested_lsn);
+		now = GetCurrentTimestamp();
+
+		if (requested > last_received &&
+			(requested != last_requested ||
+			 TimestampDifferenceExceeds(last_request_time, now,
+										Max(wal_receiver_status_interval, 1) * 1000)))
+		{
+			send_feedback(conn, last_received, true, true);
+			last_requested = requested;
+			last_request_time = now;
+		}
+		else
+			send_feedback(conn, last_received, false, false);
+
+		report_allocations();
+
+		/* Cleanup the memory. */
+		reset_message_context();
+		MemoryContextSwitchTo(pfw_worker_context);
+
+		/* Check if we need to exit the streaming loop. */
+		if (endofstream)
+			break;
+
+		/* Sleep 1s or until new message would come */
+		rc = WaitLatchOrSocket(MyLatch,
+							   WL_SOCKET_READABLE | WL_LATCH_SET |
+							   WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+							   fd,
+							   (spool_write_fd >= 0 && spool_backlog()) ? 0L : 1000L,
+							   pfw_we_receive);
+
+		if (rc & WL_LATCH_SET)
+		{
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (ConfigReloadPending)
+			reload_config();
+
+		/* We won't do timeout */
+	}
+
+	if (capture_fd >= 0)
+		capture_flush();
+
+	if (spool_write_fd >= 0)
+		spool_flush();
+
+	if (sink_fd >= 0)
+		sink_flush(true);
+
+	walrcv_endstreaming(conn, &tli);
+}
+
+/*
+ * GUC check hook for pg_follower.sink_compression
+ */
+static bool
+check_sink_compression(bool *newval, void **extra, GucSource source)
+{
+#ifndef HAVE_LIBZ
+	if (*newval)
+	{
+		GUC_check_errdetail("This build does not support compression with %s.",
+							"gzip");
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+/*
+ * Module load callback
+ */
+void
+_PG_init(void)
+{
+	DefineCustomBoolVariable("pg_follower.defer_index_build",
+							 "Defers CREATE INDEX until the worker catches up with the upstream.",
+							 NULL,
+							 &pfw_defer_index_build,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_follower.batch_bytes",
+							"Maximum size of a message which packs multiple records.",
+							"0 means each record is sent as a message. The new value takes effect when the worker starts streaming.",
+							&pfw_batch_bytes,
+							65536,
+							0, MaxAllocSize / 2,
+							PGC_SIGHUP,
+							GUC_UNIT_BYTE,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_follower.compact_changes",
+							"Maximum number of row changes which are compacted within a transaction.",
+							"0 disables compaction. The new value takes effect when the worker starts streaming.",
+							&pfw_compact_changes,
+							0,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_follower.insert_batch_rows",
+							"Maximum number of inserted rows which are sent in a column-major batch.",
+							"0 means each row is sent as an INSERT. The new value takes effect when the worker starts streaming.",
+							&pfw_insert_batch_rows,
+							0,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_follower.truncate_reload",
+							 "Loads insert batches into a table truncated in the same transaction without maintaining indexes.",
+							 "Indexes are rebuilt once the inserts into the table end.",
+							 &pfw_truncate_reload,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_follower.prefetch_distance",
+							"Number of records ahead whose index and heap pages are prefetched for UPDATE and DELETE.",
+							"0 disables prefetching.",
+							&pfw_prefetch_distance,
+							0,
+							0, 1000,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_follower.slow_transaction_threshold",
+							"Minimum apply time of upstream transactions which are kept by pg_follower_slow_transactions().",
+							"-1 disables sampling, and 0 keeps all the transactions.",
+							&pfw_slow_transaction_threshold,
+							-1,
+							-1, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_follower.conflation_lag",
+							"Lag of the decoding above which transactions are conflated.",
+							"0 disables conflation. The new value takes effect when the worker starts streaming.",
+							&pfw_conflation_lag,
+							0,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_BYTE,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_follower.conflation_window",
+							"Maximum number of transactions which are conflated into one.",
+							"The new value takes effect when the worker starts streaming.",
+							&pfw_conflation_window,
+							1000,
+							1, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_follower.apply_rows_per_sec",
+							"Maximum number of rows applied per second.",
+							"0 means no limit.",
+							&pfw_apply_rows_per_sec,
+							0,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_follower.apply_bytes_per_sec",
+							"Maximum size of records applied per second.",
+							"0 means no limit.",
+							&pfw_apply_bytes_per_sec,
+							0,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_BYTE,
+							NULL, NULL, NULL);
 
-						if (last_received < end_lsn)
-							last_received = end_lsn;
+	DefineCustomIntVariable("pg_follower.apply_wal_per_sec",
+							"Maximum size of WAL generated by applying per second.",
+							"0 means no limit.",
+							&pfw_apply_wal_per_sec,
+							0,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_BYTE,
+							NULL, NULL, NULL);
 
-						send_feedback(conn, last_received, reply_requested, false);
-					}
-					/* other message types are purposefully ignored */
+	DefineCustomStringVariable("pg_follower.capture_file",
+							   "File which records received messages for pg_follower_replay().",
+							   "Messages are appended to the file. The new value takes effect when the worker starts streaming.",
+							   &pfw_capture_file,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   NULL, NULL, NULL);
 
-					MemoryContextReset(message_context);
-				}
+	DefineCustomStringVariable("pg_follower.spool_directory",
+							   "Directory which stores received messages before they are applied.",
+							   "The upstream is told that messages are flushed once they are fsynced there. "
+							   "The new value takes effect when the worker starts.",
+							   &pfw_spool_directory,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   NULL, NULL, NULL);
 
-				len = walrcv_receive(conn, &buf, &fd);
-			}
-		}
+	DefineCustomStringVariable("pg_follower.sink_directory",
+							   "Directory into which received records are written instead of being applied.",
+							   "The upstream is told that records are flushed once their segment is closed. "
+							   "The new value takes effect when the worker starts.",
+							   &pfw_sink_directory,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   NULL, NULL, NULL);
 
-		send_feedback(conn, last_received, false, false);
+	DefineCustomEnumVariable("pg_follower.sink_format",
+							 "Format of segment files in pg_follower.sink_directory.",
+							 "The new value takes effect when the worker starts.",
+							 &pfw_sink_format,
+							 PFW_SINK_NDJSON,
+							 sink_format_options,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
 
-		/* Cleanup the memory. */
-		MemoryContextReset(message_context);
-		MemoryContextSwitchTo(pfw_worker_context);
+	DefineCustomBoolVariable("pg_follower.sink_compression",
+							 "Compresses segment files in pg_follower.sink_directory with gzip.",
+							 "The new value takes effect when the worker starts.",
+							 &pfw_sink_compression,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 check_sink_compression, NULL, NULL);
 
-		/* Check if we need to exit the streaming loop. */
-		if (endofstream)
-			break;
+	DefineCustomIntVariable("pg_follower.sink_segment_size",
+							"Size of segment files in pg_follower.sink_directory.",
+							"Segments are closed at the end of a transaction after they exceed this size.",
+							&pfw_sink_segment_size,
+							16 * 1024 * 1024,
+							1024, MaxAllocSize / 2,
+							PGC_SIGHUP,
+							GUC_UNIT_BYTE,
+							NULL, NULL, NULL);
 
-		/* Sleep 1s or until new message would come */
-		rc = WaitLatchOrSocket(MyLatch,
-							   WL_SOCKET_READABLE | WL_LATCH_SET |
-							   WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
-							   fd, 1000L,
-							   pg_follower_we_main);
+	DefineCustomBoolVariable("pg_follower.relay",
+							 "Forwards received records to pg_follower workers which follow this node.",
+							 "Changes applied by the worker are not decoded for them. "
+							 "The new value takes effect when the worker starts.",
+							 &pfw_relay,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
 
-		if (rc & WL_LATCH_SET)
-		{
-			ResetLatch(MyLatch);
-			CHECK_FOR_INTERRUPTS();
-		}
+	DefineCustomStringVariable("pg_follower.bulk_load_tables",
+							   "List of tables into which long insert runs are committed before the upstream transaction ends.",
+							   "Each entry is [schema.]table. Intermediate states of the transaction become visible.",
+							   &pfw_bulk_load_tables,
+							   "",
+							   PGC_SIGHUP,
+							   GUC_LIST_INPUT,
+							   NULL, NULL, NULL);
 
-		if (ConfigReloadPending)
-		{
-			ConfigReloadPending = false;
-			ProcessConfigFile(PGC_SIGHUP);
-		}
+	DefineCustomIntVariable("pg_follower.bulk_load_rows",
+							"Number of inserted rows after which a bulk load commits.",
+							"0 means no limit by rows.",
+							&pfw_bulk_load_rows,
+							100000,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
 
-		/* We won't do timeout */
-	}
+	DefineCustomIntVariable("pg_follower.bulk_load_bytes",
+							"Size of inserted records after which a bulk load commits.",
+							"0 means no limit by size.",
+							&pfw_bulk_load_bytes,
+							64 * 1024 * 1024,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_BYTE,
+							NULL, NULL, NULL);
 
-	walrcv_endstreaming(conn, &tli);
+	DefineCustomBoolVariable("pg_follower.publish_via_root",
+							 "Applies changes for partitions to their root partitioned table.",
+							 "Otherwise they are applied to the partition directly. "
+							 "The new value takes effect when the worker starts streaming.",
+							 &pfw_publish_via_root,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_follower.replica_role",
+							 "Applies changes with session_replication_role = replica.",
+							 "User triggers, rules and foreign key checks do not fire for replicated changes. "
+							 "The new value takes effect when the worker starts.",
+							 &pfw_replica_role,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pg_follower.always_fire_triggers",
+							   "List of triggers which fire even when changes are applied as replica.",
+							   "Each entry is [schema.]table.trigger. They are changed to ENABLE ALWAYS TRIGGER, "
+							   "which makes them fire in every session on this node.",
+							   &pfw_always_fire_triggers,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_follower.debug_worker_allocations",
+							 "Logs the number of memory allocations in worker and SPI contexts per applied row.",
+							 "Contexts created for each statement, e.g. by the executor, are not counted. "
+							 "The counting starts at the next transaction. Meant for test systems only.",
+							 &pfw_debug_worker_allocations,
+							 false,
+							 PGC_SUSET,
+							 GUC_NOT_IN_SAMPLE,
+							 NULL, NULL, NULL);
+
+	MarkGUCPrefixReserved("pg_follower");
 }
 
 /*
@@ -429,6 +4553,7 @@ pg_follower_worker_main(Datum main_arg)
 	char			   *connection_string;
 	WalReceiverConn	   *pfw_walrcv_conn = NULL;
 	char			   *err;
+	char				application_name[NAMEDATALEN];
 
 	/* Setup signal handlers */
 	pqsignal(SIGHUP, SignalHandlerForConfigReload);
@@ -447,38 +4572,146 @@ pg_follower_worker_main(Datum main_arg)
 	/* And accept information */
 	database_oid = pfw_state->local_database_oid;
 	connection_string = pstrdup(pfw_state->connection_string);
+	pfw_ngroups = pfw_state->ngroups;
+	pfw_group = DatumGetInt32(main_arg);
+
+	/* Let waiters for the applied LSN wake us up */
+	pfw_state->worker_procno[pfw_group] = MyProcNumber;
+	before_shmem_exit(pfw_worker_detach, (Datum) 0);
+
+	/* Each table group uses its own slot */
+	if (pfw_ngroups > 1)
+	{
+		snprintf(pfw_slot_name, NAMEDATALEN, "%s_%d",
+				 (spool_enabled() || sink_enabled()) ?
+				 PFW_SPOOL_SLOT_NAME : PFW_SLOT_NAME,
+				 pfw_group);
+		snprintf(application_name, NAMEDATALEN, "pg_follower worker %d", pfw_group);
+	}
+	else
+	{
+		strlcpy(pfw_slot_name,
+				(spool_enabled() || sink_enabled()) ?
+				PFW_SPOOL_SLOT_NAME : PFW_SLOT_NAME,
+				NAMEDATALEN);
+		strlcpy(application_name, "pg_follower worker", NAMEDATALEN);
+	}
 
 	/* Allocate or get the custom wait event */
-	if (pg_follower_we_main == 0)
-		pg_follower_we_main = WaitEventExtensionNew("PgFollowerWorkerMain");
+	init_wait_events();
 
 	/* Connect to a local database */
 	BackgroundWorkerInitializeConnectionByOid(database_oid, InvalidOid, 0);
 
+	setup_apply_session();
+
 	/* Load the libpq-specific functions */
 	load_file("libpqwalreceiver", false);
 
 	/* Connect to the upstream */
 	pfw_walrcv_conn = walrcv_connect(connection_string, true, true, false,
-									 "pg_follower worker", &err);
+									 application_name, &err);
 
 	if (pfw_walrcv_conn == NULL)
 		elog(ERROR, "bad connection");
 
 	pfree(connection_string);
 
+	/* The upstream might be a standby */
+	check_upstream(pfw_walrcv_conn);
+
 	/* Create a replication slot */
 	create_replication_slot(pfw_walrcv_conn);
 
+	/* Resume from the spool if it is used */
+	spool_open();
+
+	/* Or write received records into the sink */
+	sink_open();
+
+	/* Forward the stream if this node is a relay */
+	relay_open();
+
+	/* Find a transaction which was committed partially */
+	bulk_open();
+
+	/* And indexes which have not been built */
+	deferred_open();
+
 	/* Start streaming */
 	start_streaming(pfw_walrcv_conn);
 
+	/* Record received messages if requested */
+	capture_open();
+
 	/* RUn main loop */
 	apply_loop(pfw_walrcv_conn);
 
 	walrcv_disconnect(pfw_walrcv_conn);
 }
 
+/*
+ * Entrypoint for the worker which replays a capture file
+ */
+void
+pg_follower_replay_main(Datum main_arg)
+{
+	Oid			database_oid;
+	char	   *path;
+	uint64		messages = 0;
+	uint64		bytes = 0;
+	TimestampTz start;
+	int64		elapsed;
+
+	/* Setup signal handlers */
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	/* Determine a memory context which is mainly used */
+	pfw_worker_context = AllocSetContextCreate(TopMemoryContext,
+											   "pfw_worker_context",
+											   ALLOCSET_DEFAULT_SIZES);
+	MemoryContextSwitchTo(pfw_worker_context);
+
+	message_context = AllocSetContextCreate(pfw_worker_context,
+											"pfw_message_context",
+											ALLOCSET_DEFAULT_MINSIZE,
+											PFW_MESSAGE_ARENA_SIZE,
+											ALLOCSET_DEFAULT_MAXSIZE);
+	count_allocations(pfw_worker_context);
+
+	/* Attach the shared memory, and accept information */
+	pfw_attach_shmem(true);
+
+	database_oid = pfw_state->local_database_oid;
+	path = pstrdup(pfw_state->replay_path);
+
+	init_wait_events();
+
+	/* Connect to a local database */
+	BackgroundWorkerInitializeConnectionByOid(database_oid, InvalidOid, 0);
+
+	setup_apply_session();
+
+	start = GetCurrentTimestamp();
+
+	replay_file(path, &messages, &bytes);
+
+	elapsed = GetCurrentTimestamp() - start;
+
+	ereport(LOG,
+			(errmsg("replayed %llu messages (%llu bytes) from \"%s\" in %.3f s",
+					(unsigned long long) messages,
+					(unsigned long long) bytes, path,
+					(double) elapsed / USECS_PER_SEC)));
+
+	/* Report the result to pg_follower_replay() */
+	pfw_state->replay_messages = messages;
+	pfw_state->replay_bytes = bytes;
+	pfw_state->replay_elapsed = elapsed;
+}
+
 /*
  * An implentation for init_callback callback
  */
@@ -489,6 +4722,23 @@ pfw_init_shmem(void *ptr)
 
 	handler->local_database_oid = InvalidOid;
 	memset(handler->connection_string, 0, MAXCONNSTRING);
+	handler->ngroups = 1;
+
+	for (int group = 0; group < PFW_MAX_GROUPS; group++)
+	{
+		pg_atomic_init_u64(&handler->applied_lsn[group], InvalidXLogRecPtr);
+		handler->worker_procno[group] = INVALID_PROC_NUMBER;
+	}
+	ConditionVariableInit(&handler->applied_cv);
+	pg_atomic_init_u64(&handler->requested_lsn, InvalidXLogRecPtr);
+	handler->relay_origin = InvalidRepOriginId;
+
+	pg_atomic_init_flag(&handler->replay_running);
+	memset(handler->replay_path, 0, MAXPGPATH);
+	handler->replay_elapsed = -1;
+
+	SpinLockInit(&handler->slow_xacts_mutex);
+	handler->slow_xacts_count = 0;
 }
 
 /*
@@ -509,19 +4759,167 @@ pfw_attach_shmem(bool require_found)
 }
 
 /*
- * Kick a new background worker
+ * Forget this worker at exit, so that waiters do not wake up another process
  */
-static bool
-start_bgworker(const char *connection_string)
+static void
+pfw_worker_detach(int code, Datum arg)
+{
+	pfw_state->worker_procno[pfw_group] = INVALID_PROC_NUMBER;
+}
+
+/*
+ * Publish that changes up to the given upstream LSN have been applied, and
+ * wake up waiters. Only the worker of the table group updates its value.
+ */
+static void
+advance_applied_lsn(XLogRecPtr lsn)
+{
+	pg_atomic_uint64 *applied;
+
+	/* Nothing to publish while replaying a capture file */
+	if (XLogRecPtrIsInvalid(lsn))
+		return;
+
+	applied = &pfw_state->applied_lsn[pfw_group];
+
+	if (lsn <= pg_atomic_read_u64(applied))
+		return;
+
+	pg_atomic_write_u64(applied, lsn);
+	ConditionVariableBroadcast(&pfw_state->applied_cv);
+}
+
+/*
+ * Ask workers to catch up to the given LSN. Workers which are sleeping are
+ * woken up so that they request the position of the walsender.
+ */
+static void
+request_applied_lsn(XLogRecPtr lsn)
+{
+	uint64		requested = pg_atomic_read_u64(&pfw_state->requested_lsn);
+
+	while (requested < lsn &&
+		   !pg_atomic_compare_exchange_u64(&pfw_state->requested_lsn,
+										   &requested, lsn))
+		;
+
+	for (int group = 0; group < pfw_state->ngroups; group++)
+	{
+		ProcNumber	procno = pfw_state->worker_procno[group];
+
+		if (procno != INVALID_PROC_NUMBER &&
+			pg_atomic_read_u64(&pfw_state->applied_lsn[group]) < lsn)
+			SetLatch(&GetPGProcByNumber(procno)->procLatch);
+	}
+}
+
+/*
+ * Return the replication origin of changes applied by relay workers on this
+ * node, or InvalidRepOriginId if it is not a relay.
+ */
+RepOriginId
+pfw_get_relay_origin(void)
+{
+	if (pfw_state == NULL)
+		pfw_attach_shmem(false);
+
+	return pfw_state->relay_origin;
+}
+
+/*
+ * Return the upstream LSN up to which all the table groups have been
+ * applied, or InvalidXLogRecPtr if nothing has been applied yet.
+ */
+XLogRecPtr
+pfw_get_applied_lsn(void)
+{
+	XLogRecPtr	result = InvalidXLogRecPtr;
+
+	if (pfw_state == NULL)
+		pfw_attach_shmem(false);
+
+	for (int group = 0; group < pfw_state->ngroups; group++)
+	{
+		XLogRecPtr	lsn = pg_atomic_read_u64(&pfw_state->applied_lsn[group]);
+
+		if (group == 0 || lsn < result)
+			result = lsn;
+	}
+
+	return result;
+}
+
+/*
+ * Wait until all the table groups have been applied up to the given upstream
+ * LSN. Returns false if the timeout, in milliseconds, expires first. A
+ * negative timeout means waiting forever.
+ */
+bool
+pfw_wait_for_applied_lsn(XLogRecPtr lsn, long timeout)
+{
+	TimestampTz start = GetCurrentTimestamp();
+	bool		reached = false;
+	uint64		requested;
+
+	if (pfw_state == NULL)
+		pfw_attach_shmem(false);
+
+	init_wait_events();
+
+	ConditionVariablePrepareToSleep(&pfw_state->applied_cv);
+
+	for (;;)
+	{
+		long		sleep_ms = 1000;
+
+		if (pfw_get_applied_lsn() >= lsn)
+		{
+			reached = true;
+			break;
+		}
+
+		if (timeout >= 0)
+		{
+			long		remaining;
+
+			remaining = timeout -
+				TimestampDifferenceMilliseconds(start, GetCurrentTimestamp());
+			if (remaining <= 0)
+				break;
+
+			sleep_ms = Min(sleep_ms, remaining);
+		}
+
+		/*
+		 * Repeat the request in case another waiter has withdrawn it, see
+		 * below.
+		 */
+		request_applied_lsn(lsn);
+
+		ConditionVariableTimedSleep(&pfw_state->applied_cv, sleep_ms,
+									pfw_we_wait_lsn);
+	}
+
+	ConditionVariableCancelSleep();
+
+	/* Withdraw the request unless someone else needs more */
+	requested = lsn;
+	pg_atomic_compare_exchange_u64(&pfw_state->requested_lsn, &requested,
+								   InvalidXLogRecPtr);
+
+	return reached;
+}
+
+/*
+ * Kick new background workers, one per table group
+ */
+static void
+start_bgworker(const char *connection_string, int ngroups)
 {
 	BackgroundWorker worker;
-	BackgroundWorkerHandle *handle;
-	BgwHandleStatus status;
-	pid_t		pid;
 
 	/* Set worker-specific data */
 	MemSet(&worker, 0, sizeof(BackgroundWorker));
-	strcpy(worker.bgw_name, "pg_follower worker");
 	strcpy(worker.bgw_type, "pg_follower worker");
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
 					   BGWORKER_BACKEND_DATABASE_CONNECTION;
@@ -530,8 +4928,6 @@ start_bgworker(const char *connection_string)
 	strcpy(worker.bgw_library_name, "pg_follower");
 	strcpy(worker.bgw_function_name, "pg_follower_worker_main");
 
-	worker.bgw_main_arg = (Datum) 0;
-
 	/* must set notify PID to wait for startup */
 	worker.bgw_notify_pid = MyProcPid;
 
@@ -541,28 +4937,263 @@ start_bgworker(const char *connection_string)
 	/* Fill shared-memory data structure for passing info to the worker */ 
 	pfw_state->local_database_oid = MyDatabaseId;
 	strncpy(pfw_state->connection_string, connection_string, MAXCONNSTRING);
+	pfw_state->ngroups = ngroups;
+
+	/* The new slots start from scratch */
+	for (int group = 0; group < ngroups; group++)
+		pg_atomic_write_u64(&pfw_state->applied_lsn[group], InvalidXLogRecPtr);
 
-	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
-		elog(ERROR, "could not register background process");
+	for (int group = 0; group < ngroups; group++)
+	{
+		BackgroundWorkerHandle *handle;
+		BgwHandleStatus status;
+		pid_t		pid;
 
-	status = WaitForBackgroundWorkerStartup(handle, &pid);
-	if (status != BGWH_STARTED)
-		elog(ERROR, "could not start background process");
+		if (ngroups > 1)
+			snprintf(worker.bgw_name, BGW_MAXLEN, "pg_follower worker %d", group);
+		else
+			strcpy(worker.bgw_name, "pg_follower worker");
 
-	return true;
+		/* The worker follows the given group */
+		worker.bgw_main_arg = Int32GetDatum(group);
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+			elog(ERROR, "could not register background process");
+
+		status = WaitForBackgroundWorkerStartup(handle, &pid);
+		if (status != BGWH_STARTED)
+			elog(ERROR, "could not start background process");
+	}
 }
 
 Datum
 start_follow(PG_FUNCTION_ARGS)
 {
-	char *connection_string;
+	char   *connection_string;
+	int		ngroups;
 
 	if (RecoveryInProgress())
 		elog(ERROR, "recovery is in progress");
 
 	connection_string = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	ngroups = PG_GETARG_INT32(1);
+
+	if (ngroups < 1 || ngroups > PFW_MAX_GROUPS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of table groups must be between 1 and %d",
+						PFW_MAX_GROUPS)));
 
-	start_bgworker(connection_string);
+	start_bgworker(connection_string, ngroups);
 
 	PG_RETURN_VOID();
-}
\ No newline at end of file
+}
+
+/*
+ * Stop the replay worker and let other calls of pg_follower_replay() run, if
+ * the call is interrupted. arg points to the handle of the worker, or NULL if
+ * it is not registered yet.
+ */
+static void
+replay_cleanup(int code, Datum arg)
+{
+	BackgroundWorkerHandle *handle = *(BackgroundWorkerHandle **) DatumGetPointer(arg);
+
+	if (handle != NULL)
+		TerminateBackgroundWorker(handle);
+
+	pg_atomic_clear_flag(&pfw_state->replay_running);
+}
+
+/*
+ * Apply messages recorded by pg_follower.capture_file, without connecting to
+ * the upstream. The work is done by a background worker because transactions
+ * are controlled for each message; we wait for it and return the statistics.
+ */
+Datum
+pg_follower_replay(PG_FUNCTION_ARGS)
+{
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle = NULL;
+	BgwHandleStatus status;
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3] = {false};
+	Interval   *elapsed;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (strlen(path) >= MAXPGPATH)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("path \"%s\" is too long", path)));
+
+	MemSet(&worker, 0, sizeof(BackgroundWorker));
+	strcpy(worker.bgw_type, "pg_follower replay");
+	strcpy(worker.bgw_name, "pg_follower replay");
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+					   BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	strcpy(worker.bgw_library_name, "pg_follower");
+	strcpy(worker.bgw_function_name, "pg_follower_replay_main");
+	worker.bgw_notify_pid = MyProcPid;
+
+	pfw_attach_shmem(false);
+
+	/* The path and the result in the shared state are for one call */
+	if (!pg_atomic_test_set_flag(&pfw_state->replay_running))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_IN_USE),
+				 errmsg("another pg_follower_replay() is in progress")));
+
+	PG_ENSURE_ERROR_CLEANUP(replay_cleanup, PointerGetDatum(&handle));
+	{
+		pfw_state->local_database_oid = MyDatabaseId;
+		strlcpy(pfw_state->replay_path, path, MAXPGPATH);
+		pfw_state->replay_elapsed = -1;
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+			elog(ERROR, "could not register background process");
+
+		status = WaitForBackgroundWorkerShutdown(handle);
+		if (status != BGWH_STOPPED)
+			elog(ERROR, "could not wait for background process");
+	}
+	PG_END_ENSURE_ERROR_CLEANUP(replay_cleanup, PointerGetDatum(&handle));
+
+	elapsed = palloc0(sizeof(Interval));
+	elapsed->time = pfw_state->replay_elapsed;
+
+	values[0] = Int64GetDatum((int64) pfw_state->replay_messages);
+	values[1] = Int64GetDatum((int64) pfw_state->replay_bytes);
+	values[2] = IntervalPGetDatum(elapsed);
+
+	pg_atomic_clear_flag(&pfw_state->replay_running);
+
+	if (elapsed->time < 0)
+		ereport(ERROR,
+				(errmsg("could not replay capture file \"%s\"", path),
+				 errhint("See the server log for details.")));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Return the upstream LSN up to which changes have been applied
+ */
+Datum
+pg_follower_applied_lsn(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = pfw_get_applied_lsn();
+
+	if (XLogRecPtrIsInvalid(lsn))
+		PG_RETURN_NULL();
+
+	PG_RETURN_LSN(lsn);
+}
+
+/*
+ * Wait until changes committed on the upstream up to the given LSN have been
+ * applied, so that a session can read its own writes from the follower.
+ * Returns false if the timeout expires first. NULL timeout means waiting
+ * forever.
+ */
+Datum
+pg_follower_wait_for_lsn(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn;
+	long		timeout = -1;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	lsn = PG_GETARG_LSN(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		Interval   *interval = PG_GETARG_INTERVAL_P(1);
+		int64		usecs;
+
+		if (INTERVAL_IS_NOBEGIN(interval))
+			usecs = -1;
+		else if (INTERVAL_IS_NOEND(interval))
+			usecs = PG_INT64_MAX;
+		else
+			usecs = interval->time +
+				((int64) interval->month * DAYS_PER_MONTH + interval->day) * USECS_PER_DAY;
+
+		if (usecs < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("timeout must not be negative")));
+
+		if (usecs / 1000 < LONG_MAX)
+			timeout = (long) (usecs / 1000);
+	}
+
+	PG_RETURN_BOOL(pfw_wait_for_applied_lsn(lsn, timeout));
+}
+
+/*
+ * Return slow transactions kept in the ring, from the oldest one
+ */
+Datum
+pg_follower_slow_transactions(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo;
+	PfwSlowXact *xacts;
+	uint64		count;
+	int			n;
+
+	InitMaterializedSRF(fcinfo, 0);
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	pfw_attach_shmem(false);
+
+	/* Copy the ring, so as not to hold the spinlock while forming tuples */
+	xacts = palloc(sizeof(PfwSlowXact) * PFW_SLOW_XACTS);
+
+	SpinLockAcquire(&pfw_state->slow_xacts_mutex);
+	count = pfw_state->slow_xacts_count;
+	memcpy(xacts, pfw_state->slow_xacts, sizeof(PfwSlowXact) * PFW_SLOW_XACTS);
+	SpinLockRelease(&pfw_state->slow_xacts_mutex);
+
+	n = Min(count, PFW_SLOW_XACTS);
+
+	for (uint64 i = count - n; i < count; i++)
+	{
+		PfwSlowXact *xact = &xacts[i % PFW_SLOW_XACTS];
+		Datum		values[14];
+		bool		nulls[14] = {false};
+		Interval   *duration = palloc0(sizeof(Interval));
+		Interval   *slowest_duration = palloc0(sizeof(Interval));
+
+		duration->time = xact->duration;
+		slowest_duration->time = xact->slowest_duration;
+
+		values[0] = Int32GetDatum(xact->group);
+		values[1] = TimestampTzGetDatum(xact->end_time);
+		values[2] = TransactionIdGetDatum(xact->xid);
+		nulls[2] = !TransactionIdIsValid(xact->xid);
+		values[3] = LSNGetDatum(xact->begin_lsn);
+		nulls[3] = XLogRecPtrIsInvalid(xact->begin_lsn);
+		values[4] = LSNGetDatum(xact->end_lsn);
+		nulls[4] = XLogRecPtrIsInvalid(xact->end_lsn);
+		values[5] = IntervalPGetDatum(duration);
+		values[6] = Int64GetDatum(xact->inserts);
+		values[7] = Int64GetDatum(xact->updates);
+		values[8] = Int64GetDatum(xact->deletes);
+		values[9] = Int64GetDatum(xact->others);
+		values[10] = Int64GetDatum(xact->rows);
+		values[11] = Int64GetDatum(xact->bytes);
+		values[12] = CStringGetTextDatum(xact->slowest_query);
+		values[13] = IntervalPGetDatum(slowest_duration);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
@@ -12,18 +12,112 @@
 #include "postgres.h"
 
 #include "access/htup_details.h"
+#include "access/sysattr.h"
+#include "access/transam.h"
+#include "access/xlog.h"
+#include "access/xlogrecovery.h"
+#include "catalog/partition.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "common/hashfn.h"
+#include "libpq/pqformat.h"
+#include "nodes/bitmapset.h"
+#include "port/pg_bswap.h"
 #include "replication/logical.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+
+#include "pg_follower.h"
+#include "pg_follower_probes.h"
+
+/*
+ * Row change which has been decoded but not output yet.
+ *
+ * Changes are output through this form so that they can be compacted within a
+ * transaction, see follower_change().
+ */
+typedef struct PendingKey
+{
+	Oid			relid;
+
+	/* Replica identity of the row, as a WHERE clause */
+	char	   *clause;
+}			PendingKey;
+
+typedef struct PendingChange
+{
+	PendingKey	key;			/* hash key, must be first */
+
+	/* 'I', 'U' or 'D', or '\0' if the change was cancelled by another one */
+	char		action;
+
+	/* Target table, written as $schema.$table */
+	char	   *relname;
+
+	/*
+	 * Column names and values as SQL literals. NULL values are written as
+	 * "NULL", which cannot be output by print_literal(). A NULL pointer means
+	 * the column is not set, e.g. unchanged TOAST values.
+	 */
+	int			natts;
+	char	  **names;
+	char	  **values;
+}			PendingChange;
+
+typedef struct PendingEntry
+{
+	PendingKey	key;
+	PendingChange *change;
+}			PendingEntry;
+
+/*
+ * Column of rows inserted into a table which are not output yet, see
+ * insert_batch_row().
+ */
+typedef struct InsertBatchColumn
+{
+	AttrNumber	attnum;
+	char	   *name;
+	Oid			typid;
+
+	/*
+	 * Length of values which are sent as fixed-width binary, or -1 if they
+	 * are sent as text
+	 */
+	int16		typlen;
+
+	/* Output function for text values */
+	FmgrInfo	typoutput;
+
+	/* Bitmap which is set for non-NULL values */
+	StringInfoData nulls;
+
+	/*
+	 * Fixed-width values in network byte order, or text values terminated by
+	 * '\0' and their start offsets
+	 */
+	StringInfoData values;
+	StringInfoData offsets;
+}			InsertBatchColumn;
 
 /* Support routines */
-static void output_insert(StringInfo out, Relation relation, char *schema_name,
-						  ReorderBufferChange *change);
-static void output_update(StringInfo out, Relation relation, char *schema_name,
-						  ReorderBufferChange *change);
-static void output_delete(StringInfo out, Relation relation, char *schema_name,
-						  ReorderBufferChange *change);
+static char *output_value(Form_pg_attribute att, Datum datum);
+static char *identity_clause(Relation relation, HeapTuple tuple);
+static PendingChange *decode_change(Relation relation, const char *target,
+									ReorderBufferChange *change,
+									bool need_key, bool *key_changed);
+static void output_insert(StringInfo out, PendingChange *pending);
+static void output_update(StringInfo out, PendingChange *pending);
+static void output_delete(StringInfo out, PendingChange *pending);
+static void output_change(LogicalDecodingContext *ctx, PendingChange *pending);
+static void insert_batch_row(LogicalDecodingContext *ctx, Relation relation,
+							 const char *target, HeapTuple tuple);
+static void flush_insert_batch(LogicalDecodingContext *ctx);
 
 /* Callback routines */
 static void follower_startup(LogicalDecodingContext *ctx,
@@ -49,12 +143,145 @@ static void follower_truncate(struct LogicalDecodingContext *ctx,
 							  int nrelations,
 							  Relation relations[],
 							  ReorderBufferChange *change);
+static bool follower_filter_by_origin(LogicalDecodingContext *ctx,
+									  RepOriginId origin_id);
+static void follower_begin_prepare(LogicalDecodingContext *ctx,
+								   ReorderBufferTXN *txn);
+static void follower_prepare(LogicalDecodingContext *ctx,
+							 ReorderBufferTXN *txn,
+							 XLogRecPtr prepare_lsn);
+static void follower_commit_prepared(LogicalDecodingContext *ctx,
+									 ReorderBufferTXN *txn,
+									 XLogRecPtr commit_lsn);
+static void follower_rollback_prepared(LogicalDecodingContext *ctx,
+									   ReorderBufferTXN *txn,
+									   XLogRecPtr prepare_end_lsn,
+									   TimestampTz prepare_time);
 
 typedef struct
 {
 	MemoryContext context;
+
+	/*
+	 * Records are packed into one message up to this size. 0 means each
+	 * record is sent as a message.
+	 */
+	int			batch_bytes;
+
+	/* Packed records which are not sent yet */
+	StringInfoData batch;
+
+	/* Offset of the record being written in the batch */
+	int			record_start;
+
+	/* Whether BEGIN of the current transaction has been sent */
+	bool		sent_begin;
+
+	/*
+	 * Tables are split into group_count groups and only changes for the
+	 * group_index-th group are output.
+	 */
+	int			group_count;
+	int			group_index;
+
+	/*
+	 * Row changes are compacted within a transaction up to this number. 0
+	 * means they are output immediately.
+	 */
+	int			compact_limit;
+
+	/* Memory context for pending changes, reset when they are output */
+	MemoryContext pending_context;
+
+	/* Pending changes in decoded order, and lookup table by row identity */
+	List	   *pending;
+	HTAB	   *pending_hash;
+
+	/*
+	 * While decoding is more than conflate_lag bytes behind the end of WAL,
+	 * up to conflate_window transactions are output as one. If conflate_lag
+	 * is 0, transactions are never conflated.
+	 */
+	int			conflate_lag;
+	int			conflate_window;
+
+	/* Number of transactions in the current window */
+	int			window_txns;
+
+	/*
+	 * Whether changes for partitions are output as changes for the root
+	 * partitioned table. Otherwise they are applied to the partition
+	 * directly by the downstream.
+	 */
+	bool		publish_via_root;
+
+	/*
+	 * Inserts into a table are sent in column-major batches up to this
+	 * number of rows. 0 means each of them is sent as an INSERT.
+	 */
+	int			insert_batch;
+
+	/* Memory context for the batch, reset when it is output */
+	MemoryContext insert_context;
+
+	/* Target table and columns of the batch, and the number of rows in it */
+	Oid			insert_relid;
+	char	   *insert_target;
+	int			insert_ncols;
+	InsertBatchColumn *insert_columns;
+	int			insert_rows;
+
+	/* Whether BEGIN carries the transaction ID, as "BEGIN; -- xid 123" */
+	bool		include_xid;
+
+	/*
+	 * Whether the current transaction will be prepared. BEGIN of such
+	 * transactions is marked as "BEGIN; -- prepare".
+	 */
+	bool		in_prepare;
 }			PgFollowerData;
 
+/*
+ * Names needed to output changes for a relation, cached by its OID. Looking
+ * up ancestors of partitions for each change would be expensive.
+ */
+typedef struct PfwRelationEntry
+{
+	Oid			relid;			/* hash key */
+	bool		valid;
+
+	/* Name of the relation itself */
+	NameData	nspname;
+	NameData	relname;
+
+	/* Name of the root partitioned table, or the relation itself */
+	NameData	root_nspname;
+	NameData	root_relname;
+}			PfwRelationEntry;
+
+static HTAB *relation_cache = NULL;
+
+static PfwRelationEntry *get_relation_entry(Relation relation);
+
+/* Prefix of logical decoding messages emitted by the event trigger */
+#define PFW_MESSAGE_PREFIX "pg_follower:"
+
+static StringInfo begin_record(LogicalDecodingContext *ctx);
+static void end_record(LogicalDecodingContext *ctx, bool flush);
+static void flush_batch(LogicalDecodingContext *ctx);
+static void send_begin_if_needed(LogicalDecodingContext *ctx);
+static int	parse_int_option(DefElem *elem);
+static bool in_group(PgFollowerData *data, const char *relname);
+static void relation_cache_callback(Datum arg, Oid relid);
+static uint32 pending_key_hash(const void *key, Size keysize);
+static int	pending_key_match(const void *key1, const void *key2, Size keysize);
+static bool can_compact(Relation relation);
+static char **copy_values(int natts, char **values);
+static void compact_change(LogicalDecodingContext *ctx, PendingChange *change);
+static void flush_pending(LogicalDecodingContext *ctx);
+static bool continue_window(LogicalDecodingContext *ctx, ReorderBufferTXN *txn);
+static bool close_window(LogicalDecodingContext *ctx);
+
 /*
  * Print literal `outputstr' already represented as string of type `typid'
  * into stringbuf `s'.
@@ -69,6 +296,8 @@ print_literal(StringInfo s, Oid typid, char *outputstr)
 {
 	const char *valptr;
 
+	TRACE_PG_FOLLOWER_PRINT_LITERAL_START(typid);
+
 	switch (typid)
 	{
 		case INT2OID:
@@ -107,56 +336,257 @@ print_literal(StringInfo s, Oid typid, char *outputstr)
 			appendStringInfoChar(s, '\'');
 			break;
 	}
+
+	TRACE_PG_FOLLOWER_PRINT_LITERAL_DONE(typid);
 }
 
 /*
- * Construct a INSERT query. Format is:
+ * Convert a column value into a SQL literal. Returns NULL if the value is an
+ * unchanged TOAST datum, which is not contained in the WAL record.
+ */
+static char *
+output_value(Form_pg_attribute att, Datum datum)
+{
+	StringInfoData value;
+	Oid			typoutput;
+	bool		typisvarlena;
+
+	getTypeOutputInfo(att->atttypid, &typoutput, &typisvarlena);
+
+	if (typisvarlena && VARATT_IS_EXTERNAL_ONDISK(datum))
+		return NULL;
+
+	initStringInfo(&value);
+
+	if (!typisvarlena)
+		print_literal(&value, att->atttypid,
+					  OidOutputFunctionCall(typoutput, datum));
+	else
+	{
+		Datum		val;
+
+		val = PointerGetDatum(PG_DETOAST_DATUM(datum));
+		print_literal(&value, att->atttypid,
+					  OidOutputFunctionCall(typoutput, val));
+	}
+
+	return value.data;
+}
+
+/*
+ * Construct a WHERE clause which identifies the row, from replica identity
+ * columns of the tuple. All columns are used if REPLICA IDENTITY FULL is set.
  *
- * 	INSERT INTO $schema.$table ($type1 [, $type2 ...])
- * 								VALUES ($value1 [, $value2 ...]);
+ * Returns NULL if the table does not have a replica identity.
  */
-static void
-output_insert(StringInfo out, Relation relation, char *schema_name,
-			  ReorderBufferChange *change)
+static char *
+identity_clause(Relation relation, HeapTuple tuple)
 {
-	HeapTuple	new_tuple;
-	TupleDesc	descriptor;
+	TupleDesc	descriptor = RelationGetDescr(relation);
+	bool		full = (relation->rd_rel->relreplident == REPLICA_IDENTITY_FULL);
+	Bitmapset  *keyattrs = NULL;
+	StringInfoData clause;
 	bool		first_try = true;
-	StringInfoData values;
 
-	Assert(change->action == REORDER_BUFFER_CHANGE_INSERT);
+	if (!full)
+	{
+		keyattrs = RelationGetIdentityKeyBitmap(relation);
 
-	/* Extract information from arguments */
-	new_tuple = change->data.tp.newtuple;
-	descriptor = RelationGetDescr(relation);
+		if (keyattrs == NULL)
+			return NULL;
+	}
 
-	/* Construction the query */
-	appendStringInfo(out, "INSERT INTO %s.%s ( ", schema_name,
-					 RelationGetRelationName(relation));
+	initStringInfo(&clause);
+	appendStringInfoString(&clause, " WHERE ");
 
-	initStringInfo(&values);
+	for (int atts = 0; atts < descriptor->natts; atts++)
+	{
+		Form_pg_attribute att = TupleDescAttr(descriptor, atts);
+		bool		isnull;
+		Datum		datum;
+		char	   *value;
+
+		if (att->attisdropped || att->attgenerated)
+			continue;
+
+		if (!full &&
+			!bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber,
+						   keyattrs))
+			continue;
+
+		datum = heap_getattr(tuple, atts + 1, descriptor, &isnull);
+
+		if (!first_try)
+			appendStringInfoString(&clause, " AND ");
+
+		first_try = false;
+
+		if (isnull)
+		{
+			appendStringInfo(&clause, "%s IS NULL",
+							 quote_identifier(NameStr(att->attname)));
+			continue;
+		}
+
+		value = output_value(att, datum);
+
+		/* Old tuples of REPLICA IDENTITY FULL are flattened, but be careful */
+		if (value == NULL)
+			elog(ERROR, "replica identity column \"%s\" is not contained",
+				 NameStr(att->attname));
+
+		appendStringInfo(&clause, "%s = %s",
+						 quote_identifier(NameStr(att->attname)), value);
+	}
+
+	bms_free(keyattrs);
+
+	return clause.data;
+}
+
+/*
+ * Decode a row change into a PendingChange, allocated in the current memory
+ * context.
+ *
+ * UPDATE and DELETE need the replica identity to find the row on the
+ * downstream. Returns NULL if it is not available. The identity of inserted
+ * rows is computed only if need_key is set. *key_changed is set if the
+ * UPDATE changes the identity of the row. target is the name of the table
+ * which is written into the statement.
+ */
+static PendingChange *
+decode_change(Relation relation, const char *target,
+			  ReorderBufferChange *change, bool need_key, bool *key_changed)
+{
+	PendingChange *pending;
+	TupleDesc	descriptor = RelationGetDescr(relation);
+	HeapTuple	old_tuple = change->data.tp.oldtuple;
+	HeapTuple	new_tuple = change->data.tp.newtuple;
+
+	*key_changed = false;
+
+	pending = palloc0(sizeof(PendingChange));
+	pending->key.relid = RelationGetRelid(relation);
+	pending->relname = pstrdup(target);
+
+	switch (change->action)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			pending->action = 'I';
+
+			if (need_key)
+				pending->key.clause = identity_clause(relation, new_tuple);
+			break;
+
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			pending->action = 'U';
+
+			/*
+			 * The old tuple is logged only if the identity is changed, or
+			 * always for REPLICA IDENTITY FULL.  Those tables are never
+			 * compacted, and their new tuples may contain unchanged TOAST
+			 * values, so the identity of the new tuple is only built for
+			 * the others, and only from the key columns.
+			 */
+			if (old_tuple)
+			{
+				pending->key.clause = identity_clause(relation, old_tuple);
+
+				if (need_key && pending->key.clause != NULL &&
+					relation->rd_rel->relreplident != REPLICA_IDENTITY_FULL)
+				{
+					char	   *new_clause = identity_clause(relation, new_tuple);
+
+					*key_changed = (strcmp(pending->key.clause, new_clause) != 0);
+				}
+			}
+			else
+				pending->key.clause = identity_clause(relation, new_tuple);
+			break;
+
+		case REORDER_BUFFER_CHANGE_DELETE:
+			pending->action = 'D';
+
+			if (old_tuple)
+				pending->key.clause = identity_clause(relation, old_tuple);
+			break;
+
+		default:
+			elog(ERROR, "unknown change");
+			break;
+	}
+
+	if (pending->action != 'I' && pending->key.clause == NULL)
+	{
+		ereport(WARNING,
+				(errmsg("skipped %s on table \"%s\" because it does not have a replica identity",
+						pending->action == 'U' ? "UPDATE" : "DELETE",
+						pending->relname)));
+		return NULL;
+	}
+
+	if (pending->action == 'D')
+		return pending;
 
 	/*
-	 * Seek each attributes to gather the datatype and value of them. System,
-	 * invalid, and null attributes would be skipped.
+	 * Seek each attributes to gather the name and value of them. System and
+	 * invalid attributes would be skipped.
 	 */
+	pending->natts = descriptor->natts;
+	pending->names = palloc0(sizeof(char *) * descriptor->natts);
+	pending->values = palloc0(sizeof(char *) * descriptor->natts);
+
 	for (int atts = 0; atts < descriptor->natts; atts++)
 	{
 		Form_pg_attribute att = TupleDescAttr(descriptor, atts);
 		bool		isnull;
 		Datum		datum;
-		Oid			typoutput;
-		bool		typisvarlena;
 
 		/* Skip if the attribute is invalid */
 		if (att->attisdropped || att->attgenerated)
 			continue;
 
+		pending->names[atts] = pstrdup(quote_identifier(NameStr(att->attname)));
+
 		/* Get the Datum representation of this value */
 		datum = heap_getattr(new_tuple, atts + 1, descriptor, &isnull);
 
-		/* Skip if the attribute is NULL */
 		if (isnull)
+			pending->values[atts] = "NULL";
+		else
+			pending->values[atts] = output_value(att, datum);
+	}
+
+	return pending;
+}
+
+/*
+ * Construct a INSERT query. Format is:
+ *
+ * 	INSERT INTO $schema.$table ($type1 [, $type2 ...])
+ * 								VALUES ($value1 [, $value2 ...]);
+ *
+ * NULL columns are written explicitly, because an INSERT merged with later
+ * UPDATEs may set a column to NULL which has a default.
+ */
+static void
+output_insert(StringInfo out, PendingChange *pending)
+{
+	bool		first_try = true;
+	StringInfoData values;
+
+	Assert(pending->action == 'I');
+
+	/* Construction the query */
+	appendStringInfo(out, "INSERT INTO %s ( ", pending->relname);
+
+	initStringInfo(&values);
+
+	for (int atts = 0; atts < pending->natts; atts++)
+	{
+		char	   *value = pending->values[atts];
+
+		if (value == NULL)
 			continue;
 
 		/* Add a comma if this attribute is the second try */
@@ -171,23 +601,8 @@ output_insert(StringInfo out, Relation relation, char *schema_name,
 		 * be skipped, all to-be-written attributes must be explicitly
 		 * described.
 		 */
-		appendStringInfo(out, "%s", quote_identifier(NameStr(att->attname)));
-
-		getTypeOutputInfo(att->atttypid, &typoutput, &typisvarlena);
-
-		if (typisvarlena && VARATT_IS_EXTERNAL_ONDISK(datum))
-			appendStringInfoString(&values, "unchanged-toast-datum");
-		else if (!typisvarlena)
-			print_literal(&values, att->atttypid,
-						  OidOutputFunctionCall(typoutput, datum));
-		else
-		{
-			Datum		val;
-
-			val = PointerGetDatum(PG_DETOAST_DATUM(datum));
-			print_literal(&values, att->atttypid,
-						  OidOutputFunctionCall(typoutput, val));
-		}
+		appendStringInfoString(out, pending->names[atts]);
+		appendStringInfoString(&values, value);
 
 		first_try = false;
 	}
@@ -195,148 +610,993 @@ output_insert(StringInfo out, Relation relation, char *schema_name,
 	appendStringInfo(out, " ) VALUES ( %s );", values.data);
 
 	pfree(values.data);
-	pfree(schema_name);
 }
 
 /*
- * Construct an UPDATE query. Not implemented yet.
+ * Construct an UPDATE query. Format is:
+ *
+ * 	UPDATE $schema.$table SET $column1 = $value1 [, ...] WHERE $identity;
+ *
+ * Unchanged TOAST columns are not set.
  */
 static void
-output_update(StringInfo out, Relation relation, char *schema_name,
-			  ReorderBufferChange *change)
+output_update(StringInfo out, PendingChange *pending)
 {
-	/* HeapTuple old_tuple; */
-	/* HeapTuple new_tuple; */
-
-	Assert(change->action == REORDER_BUFFER_CHANGE_UPDATE);
+	bool		first_try = true;
 
-	/* Extract information from arguments */
-	/* old_tuple = change->data.tp.oldtuple; */
-	/* new_tuple = change->data.tp.newtuple; */
+	Assert(pending->action == 'U');
 
 	/* Construction the query */
-		appendStringInfo(out, "UPDATE %s.%s SET ", schema_name,
-						 RelationGetRelationName(relation));
-}
-
-/*
- * Construct a DELETE query. Not implemented yet.
- */
-static void
-output_delete(StringInfo out, Relation relation, char *schema_name,
-			  ReorderBufferChange *change)
-{
-	/* HeapTuple old_tuple; */
-
-	Assert(change->action == REORDER_BUFFER_CHANGE_DELETE);
+	appendStringInfo(out, "UPDATE %s SET ", pending->relname);
 
-	/* Extract information from arguments */
-	/* old_tuple = change->data.tp.oldtuple; */
-
-	/* Construction the query */
-		appendStringInfo(out, "DELETE FROM %s.%s ", schema_name,
-						 RelationGetRelationName(relation));
-}
+	for (int atts = 0; atts < pending->natts; atts++)
+	{
+		if (pending->values[atts] == NULL)
+			continue;
 
-/* Callback routines */
+		if (!first_try)
+			appendStringInfoString(out, ", ");
 
-/*
- * Startup callback which is called whenever a replication slot is created.
- *
- * output_plugin_options is not validated here because this module won't use.
- */
-static void
-follower_startup(LogicalDecodingContext *ctx, OutputPluginOptions *options,
-				 bool is_init)
-{
-	PgFollowerData *data = palloc(sizeof(PgFollowerData));
+		appendStringInfo(out, "%s = %s", pending->names[atts],
+						 pending->values[atts]);
 
-	/* Create our memory context for private allocations. */
-	data->context = AllocSetContextCreate(ctx->context,
-										  "pg_follower output context",
-										  ALLOCSET_DEFAULT_SIZES);
-	ctx->output_plugin_private = data;
+		first_try = false;
+	}
 
-	/* Only textual format is supported. */
-	options->output_type = OUTPUT_PLUGIN_TEXTUAL_OUTPUT;
+	appendStringInfo(out, "%s;", pending->key.clause);
 }
 
 /*
- * BEGIN callback which is called whenever a start of a committed transaction
- * has been decoded.
+ * Construct a DELETE query. Format is:
+ *
+ * 	DELETE FROM $schema.$table WHERE $identity;
  */
 static void
-follower_begin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+output_delete(StringInfo out, PendingChange *pending)
 {
-	OutputPluginPrepareWrite(ctx, true);
+	Assert(pending->action == 'D');
 
-	appendStringInfoString(ctx->out, "BEGIN;");
-
-	OutputPluginWrite(ctx, true);
+	/* Construction the query */
+	appendStringInfo(out, "DELETE FROM %s%s;", pending->relname,
+					 pending->key.clause);
 }
 
 /*
- * Change callback which is called for every individual row modification
- * inside a transaction.
+ * Output a decoded row change as a record. Cancelled changes are skipped.
  */
 static void
-follower_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
-				Relation relation, ReorderBufferChange *change)
+output_change(LogicalDecodingContext *ctx, PendingChange *pending)
 {
-	char	   *schema_name;
-	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
-	MemoryContext old;
-
-	/* Avoid leaking memory by using and resetting our own context */
-	old = MemoryContextSwitchTo(data->context);
-
-	schema_name = get_namespace_name(RelationGetNamespace(relation));
-
-	/* Swtich based on the actual action */
-	switch (change->action)
+	switch (pending->action)
 	{
-		case REORDER_BUFFER_CHANGE_INSERT:
-			OutputPluginPrepareWrite(ctx, true);
-			output_insert(ctx->out, relation, schema_name, change);
-			OutputPluginWrite(ctx, true);
+		case 'I':
+			send_begin_if_needed(ctx);
+			output_insert(begin_record(ctx), pending);
+			end_record(ctx, false);
 			break;
-		case REORDER_BUFFER_CHANGE_UPDATE:
-			OutputPluginPrepareWrite(ctx, true);
-			output_update(ctx->out, relation, schema_name, change);
-			OutputPluginWrite(ctx, true);
+		case 'U':
+			send_begin_if_needed(ctx);
+			output_update(begin_record(ctx), pending);
+			end_record(ctx, false);
 			break;
-		case REORDER_BUFFER_CHANGE_DELETE:
-			OutputPluginPrepareWrite(ctx, true);
-			output_delete(ctx->out, relation, schema_name, change);
-			OutputPluginWrite(ctx, true);
+		case 'D':
+			send_begin_if_needed(ctx);
+			output_delete(begin_record(ctx), pending);
+			end_record(ctx, false);
 			break;
 		default:
-			elog(ERROR, "unknown change");
 			break;
 	}
-
-	pfree(schema_name);
-	MemoryContextSwitchTo(old);
-	MemoryContextReset(data->context);
 }
 
 /*
- * COMMIT callback which is called whenever a transaction commit has been
- * decoded.
+ * Return whether values of the type are sent as binary in insert batches.
+ *
+ * Only built-in types whose values are plain numbers passed by value are
+ * allowed, since their OIDs and representations are the same on any server.
+ * Other fixed-width types may hold server-specific values, e.g. OIDs of
+ * regclass or transaction IDs, which must go through text.
  */
-static void
-follower_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
-				XLogRecPtr commit_lsn)
+bool
+pfw_is_binary_batch_type(Oid typid)
 {
-	OutputPluginPrepareWrite(ctx, true);
-
-	appendStringInfoString(ctx->out, "COMMIT;");
-
-	OutputPluginWrite(ctx, true);
-}
-
-/*
- * message callback which is called whenever a logical decoding message has been
+	switch (typid)
+	{
+		case BOOLOID:
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case DATEOID:
+		case TIMEOID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Add an inserted row to the batch, outputting the batch first if it is for
+ * another table.
+ *
+ * Values of types accepted by pfw_is_binary_batch_type() are kept as binary.
+ * Others are kept as the text of their output function. Unlike INSERT
+ * records, NULL values are sent as NULL rather than skipped.
+ */
+static void
+insert_batch_row(LogicalDecodingContext *ctx, Relation relation,
+				 const char *target, HeapTuple tuple)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	TupleDesc	descriptor = RelationGetDescr(relation);
+	int			row;
+
+	if (data->insert_rows > 0 &&
+		(data->insert_relid != RelationGetRelid(relation) ||
+		 strcmp(data->insert_target, target) != 0))
+		flush_insert_batch(ctx);
+
+	send_begin_if_needed(ctx);
+
+	if (data->insert_rows == 0)
+	{
+		MemoryContext old = MemoryContextSwitchTo(data->insert_context);
+
+		data->insert_relid = RelationGetRelid(relation);
+		data->insert_target = pstrdup(target);
+		data->insert_columns = palloc0(sizeof(InsertBatchColumn) * descriptor->natts);
+		data->insert_ncols = 0;
+
+		for (int atts = 0; atts < descriptor->natts; atts++)
+		{
+			Form_pg_attribute att = TupleDescAttr(descriptor, atts);
+			InsertBatchColumn *column;
+
+			if (att->attisdropped || att->attgenerated)
+				continue;
+
+			column = &data->insert_columns[data->insert_ncols++];
+			column->attnum = att->attnum;
+			column->name = pstrdup(NameStr(att->attname));
+			column->typid = att->atttypid;
+
+			if (pfw_is_binary_batch_type(att->atttypid))
+				column->typlen = att->attlen;
+			else
+			{
+				Oid			typoutput;
+				bool		typisvarlena;
+
+				column->typlen = -1;
+				getTypeOutputInfo(att->atttypid, &typoutput, &typisvarlena);
+				fmgr_info(typoutput, &column->typoutput);
+			}
+
+			initStringInfo(&column->nulls);
+			initStringInfo(&column->values);
+			initStringInfo(&column->offsets);
+		}
+
+		MemoryContextSwitchTo(old);
+	}
+
+	/* Buffers are enlarged in their own context */
+	row = data->insert_rows++;
+
+	for (int i = 0; i < data->insert_ncols; i++)
+	{
+		InsertBatchColumn *column = &data->insert_columns[i];
+		bool		isnull;
+		Datum		datum;
+
+		if (row % 8 == 0)
+			appendStringInfoChar(&column->nulls, 0);
+
+		datum = heap_getattr(tuple, column->attnum, descriptor, &isnull);
+
+		if (!isnull)
+			column->nulls.data[row / 8] |= 1 << (row % 8);
+
+		if (column->typlen > 0)
+		{
+			/* Each row has its value, so that they can be indexed */
+			if (isnull)
+				datum = (Datum) 0;
+
+			switch (column->typlen)
+			{
+				case 1:
+					pq_sendbyte(&column->values, DatumGetChar(datum));
+					break;
+				case 2:
+					pq_sendint16(&column->values, DatumGetInt16(datum));
+					break;
+				case 4:
+					pq_sendint32(&column->values, DatumGetInt32(datum));
+					break;
+				case 8:
+					pq_sendint64(&column->values, DatumGetInt64(datum));
+					break;
+			}
+		}
+		else
+		{
+			pq_sendint32(&column->offsets, column->values.len);
+
+			if (!isnull)
+			{
+				char	   *value = OutputFunctionCall(&column->typoutput, datum);
+
+				appendBinaryStringInfo(&column->values, value, strlen(value) + 1);
+			}
+		}
+	}
+
+	if (data->insert_rows >= data->insert_batch)
+		flush_insert_batch(ctx);
+}
+
+/*
+ * Output the batch of inserted rows as a record. Format is:
+ *
+ *	byte	PFW_INSERT_BATCH
+ *	string	target table, as in INSERT records
+ *	int32	number of rows
+ *	int16	number of columns
+ *
+ * followed by each column:
+ *
+ *	string	column name
+ *	int32	type OID
+ *	int16	length of fixed-width values, or -1 for text
+ *	bytes	bitmap which is set for non-NULL values, (rows + 7) / 8 bytes
+ *	bytes	fixed-width values for all the rows, or
+ *	int32[]	start offsets of text values for all the rows, int32 length of
+ *			the text, and text values terminated by '\0'
+ *
+ * Strings are terminated by '\0', and integers are in network byte order.
+ */
+static void
+flush_insert_batch(LogicalDecodingContext *ctx)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	int			rows = data->insert_rows;
+	StringInfo	out;
+
+	if (rows == 0)
+		return;
+
+	/* begin_record() outputs the batch first, so forget it beforehand */
+	data->insert_rows = 0;
+
+	out = begin_record(ctx);
+
+	pq_sendbyte(out, PFW_INSERT_BATCH);
+	appendBinaryStringInfo(out, data->insert_target,
+						   strlen(data->insert_target) + 1);
+	pq_sendint32(out, rows);
+	pq_sendint16(out, data->insert_ncols);
+
+	for (int i = 0; i < data->insert_ncols; i++)
+	{
+		InsertBatchColumn *column = &data->insert_columns[i];
+
+		appendBinaryStringInfo(out, column->name, strlen(column->name) + 1);
+		pq_sendint32(out, column->typid);
+		pq_sendint16(out, column->typlen);
+		appendBinaryStringInfo(out, column->nulls.data, column->nulls.len);
+
+		if (column->typlen < 0)
+		{
+			appendBinaryStringInfo(out, column->offsets.data,
+								   column->offsets.len);
+			pq_sendint32(out, column->values.len);
+		}
+
+		appendBinaryStringInfo(out, column->values.data, column->values.len);
+	}
+
+	end_record(ctx, false);
+
+	MemoryContextReset(data->insert_context);
+	data->insert_relid = InvalidOid;
+}
+
+/*
+ * Start writing a record. Returns the buffer where the record is written.
+ *
+ * If records are packed, each of them is prefixed by its length in network
+ * byte order and terminated by '\0', so that the downstream can apply it
+ * without copying.
+ */
+static StringInfo
+begin_record(LogicalDecodingContext *ctx)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	uint32		placeholder = 0;
+
+	/* Rows batched so far precede any other record */
+	if (data->insert_rows > 0)
+		flush_insert_batch(ctx);
+
+	if (data->batch_bytes == 0)
+	{
+		OutputPluginPrepareWrite(ctx, true);
+		return ctx->out;
+	}
+
+	data->record_start = data->batch.len;
+	appendBinaryStringInfo(&data->batch, (char *) &placeholder,
+						   sizeof(placeholder));
+
+	return &data->batch;
+}
+
+/*
+ * Finish writing a record started by begin_record().
+ *
+ * Packed records are sent when the batch exceeds the limit, or flush is
+ * requested. Callers request it at the end of the transaction.
+ */
+static void
+end_record(LogicalDecodingContext *ctx, bool flush)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	uint32		len;
+
+	if (data->batch_bytes == 0)
+	{
+		OutputPluginWrite(ctx, true);
+		return;
+	}
+
+	appendStringInfoChar(&data->batch, '\0');
+
+	len = pg_hton32(data->batch.len - data->record_start - sizeof(uint32));
+	memcpy(data->batch.data + data->record_start, &len, sizeof(uint32));
+
+	if (flush || data->batch.len >= data->batch_bytes)
+		flush_batch(ctx);
+}
+
+/*
+ * Send packed records as a message.
+ */
+static void
+flush_batch(LogicalDecodingContext *ctx)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+
+	if (data->batch.len == 0)
+		return;
+
+	OutputPluginPrepareWrite(ctx, true);
+	appendBinaryStringInfo(ctx->out, data->batch.data, data->batch.len);
+	OutputPluginWrite(ctx, true);
+
+	resetStringInfo(&data->batch);
+}
+
+/*
+ * Send BEGIN if it has not been sent for the current transaction yet.
+ *
+ * BEGIN is delayed until the first change is decoded so that empty
+ * transactions are not sent at all.
+ */
+static void
+send_begin_if_needed(LogicalDecodingContext *ctx)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	StringInfo	out;
+
+	if (data->sent_begin)
+		return;
+
+	out = begin_record(ctx);
+	appendStringInfoString(out, "BEGIN;");
+
+	/* The first transaction of a conflated window is named */
+	if (data->include_xid)
+		appendStringInfo(out, " -- xid %u", ctx->write_xid);
+
+	if (data->in_prepare)
+		appendStringInfoString(out, " -- prepare");
+
+	end_record(ctx, false);
+
+	data->sent_begin = true;
+}
+
+/*
+ * Parse a non-negative integer option.
+ */
+static int
+parse_int_option(DefElem *elem)
+{
+	int		value;
+
+	if (elem->arg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("option \"%s\" requires a value",
+						elem->defname)));
+
+	value = pg_strtoint32(strVal(elem->arg));
+
+	if (value < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("option \"%s\" must not be negative",
+						elem->defname)));
+
+	return value;
+}
+
+/*
+ * Check whether the table belongs to the group which is output.
+ *
+ * Tables are split by the hash of their name, because only the name is
+ * known when DROP TABLE is decoded. Tables which have the same name in
+ * different schemas are in the same group.
+ */
+static bool
+in_group(PgFollowerData *data, const char *relname)
+{
+	uint32		hash;
+
+	if (data->group_count <= 1)
+		return true;
+
+	hash = hash_bytes((const unsigned char *) relname, strlen(relname));
+
+	return (hash % data->group_count) == data->group_index;
+}
+
+/*
+ * Relcache invalidation callback. Names of other relations, e.g. the root of
+ * a partition, are cached as well, so all the entries are invalidated.
+ */
+static void
+relation_cache_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	PfwRelationEntry *entry;
+
+	hash_seq_init(&status, relation_cache);
+
+	while ((entry = hash_seq_search(&status)) != NULL)
+		entry->valid = false;
+}
+
+/*
+ * Get the cached names of the relation, building them if needed.
+ */
+static PfwRelationEntry *
+get_relation_entry(Relation relation)
+{
+	PfwRelationEntry *entry;
+	Oid			relid = RelationGetRelid(relation);
+	Oid			rootid = relid;
+	bool		found;
+
+	if (relation_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(PfwRelationEntry);
+		ctl.hcxt = CacheMemoryContext;
+
+		relation_cache = hash_create("pg_follower relation cache", 128, &ctl,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		/* The cache lives as long as the process, so does the callback */
+		CacheRegisterRelcacheCallback(relation_cache_callback, (Datum) 0);
+	}
+
+	entry = hash_search(relation_cache, &relid, HASH_ENTER, &found);
+
+	if (found && entry->valid)
+		return entry;
+
+	namestrcpy(&entry->nspname,
+			   get_namespace_name(RelationGetNamespace(relation)));
+	namestrcpy(&entry->relname, RelationGetRelationName(relation));
+
+	if (relation->rd_rel->relispartition)
+	{
+		List	   *ancestors = get_partition_ancestors(relid);
+
+		rootid = llast_oid(ancestors);
+		list_free(ancestors);
+	}
+
+	namestrcpy(&entry->root_nspname,
+			   get_namespace_name(get_rel_namespace(rootid)));
+	namestrcpy(&entry->root_relname, get_rel_name(rootid));
+
+	entry->valid = true;
+
+	return entry;
+}
+
+/*
+ * Hash and match functions for PendingKey.
+ */
+static uint32
+pending_key_hash(const void *key, Size keysize)
+{
+	const PendingKey *pk = (const PendingKey *) key;
+
+	return hash_combine(murmurhash32(pk->relid),
+						hash_bytes((const unsigned char *) pk->clause,
+								   strlen(pk->clause)));
+}
+
+static int
+pending_key_match(const void *key1, const void *key2, Size keysize)
+{
+	const PendingKey *pk1 = (const PendingKey *) key1;
+	const PendingKey *pk2 = (const PendingKey *) key2;
+
+	if (pk1->relid != pk2->relid)
+		return 1;
+
+	return strcmp(pk1->clause, pk2->clause);
+}
+
+/*
+ * Check whether changes for the table can be reordered by compaction.
+ *
+ * A change is merged into an earlier one for the same row, so it moves ahead
+ * of changes for other rows. That is safe only if no unique index covers
+ * columns other than the replica identity, because such values might
+ * conflict transiently on the downstream. Foreign keys are not considered,
+ * they are not checked while applying as replica.
+ *
+ * Tables with REPLICA IDENTITY FULL are not compacted either. Their identity
+ * is the whole row, so every update changes it, but decode_change() does not
+ * detect that for them.
+ */
+static bool
+can_compact(Relation relation)
+{
+	Bitmapset  *uniqueattrs;
+	Bitmapset  *identityattrs;
+	bool		result;
+
+	if (relation->rd_rel->relreplident == REPLICA_IDENTITY_FULL)
+		return false;
+
+	uniqueattrs = RelationGetIndexAttrBitmap(relation, INDEX_ATTR_BITMAP_KEY);
+	identityattrs = RelationGetIndexAttrBitmap(relation,
+											   INDEX_ATTR_BITMAP_IDENTITY_KEY);
+
+	result = bms_is_subset(uniqueattrs, identityattrs);
+
+	bms_free(uniqueattrs);
+	bms_free(identityattrs);
+
+	return result;
+}
+
+/*
+ * Copy an array of column names or values into the current memory context.
+ */
+static char **
+copy_values(int natts, char **values)
+{
+	char	  **result = palloc0(sizeof(char *) * natts);
+
+	for (int atts = 0; atts < natts; atts++)
+	{
+		if (values[atts] != NULL)
+			result[atts] = pstrdup(values[atts]);
+	}
+
+	return result;
+}
+
+/*
+ * Merge a row change into pending changes. Rules are:
+ *
+ *	INSERT + UPDATE -> INSERT of the final row
+ *	INSERT + DELETE -> nothing
+ *	UPDATE + UPDATE -> UPDATE with the original identity
+ *	UPDATE + DELETE -> DELETE with the original identity
+ *	DELETE + INSERT -> UPDATE of all columns
+ *
+ * Other sequences cannot happen for a row with a unique identity. Pending
+ * changes are output before them to preserve the order.
+ *
+ * The given change is short-lived, so what is kept is copied into the
+ * pending context.
+ */
+static void
+compact_change(LogicalDecodingContext *ctx, PendingChange *change)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	PendingEntry *entry;
+	PendingChange *pending;
+	MemoryContext old;
+	bool		found;
+
+	entry = hash_search(data->pending_hash, &change->key, HASH_FIND, NULL);
+
+	if (entry != NULL)
+	{
+		pending = entry->change;
+
+		if ((pending->action == 'I' || pending->action == 'U') &&
+			change->action == 'U')
+		{
+			for (int atts = 0; atts < change->natts; atts++)
+			{
+				if (change->values[atts] != NULL)
+					pending->values[atts] =
+						MemoryContextStrdup(data->pending_context,
+											change->values[atts]);
+			}
+			return;
+		}
+		else if (pending->action == 'I' && change->action == 'D')
+		{
+			pending->action = '\0';
+			hash_search(data->pending_hash, &change->key, HASH_REMOVE, NULL);
+			return;
+		}
+		else if (pending->action == 'U' && change->action == 'D')
+		{
+			pending->action = 'D';
+			return;
+		}
+		else if (pending->action == 'D' && change->action == 'I')
+		{
+			old = MemoryContextSwitchTo(data->pending_context);
+			pending->action = 'U';
+			pending->natts = change->natts;
+			pending->names = copy_values(change->natts, change->names);
+			pending->values = copy_values(change->natts, change->values);
+			MemoryContextSwitchTo(old);
+			return;
+		}
+
+		flush_pending(ctx);
+	}
+
+	old = MemoryContextSwitchTo(data->pending_context);
+
+	pending = palloc(sizeof(PendingChange));
+	memcpy(pending, change, sizeof(PendingChange));
+	pending->key.clause = pstrdup(change->key.clause);
+	pending->relname = pstrdup(change->relname);
+
+	if (change->natts > 0)
+	{
+		pending->names = copy_values(change->natts, change->names);
+		pending->values = copy_values(change->natts, change->values);
+	}
+
+	data->pending = lappend(data->pending, pending);
+
+	entry = hash_search(data->pending_hash, &pending->key, HASH_ENTER, &found);
+	Assert(!found);
+	entry->change = pending;
+
+	MemoryContextSwitchTo(old);
+
+	if (list_length(data->pending) >= data->compact_limit)
+		flush_pending(ctx);
+}
+
+/*
+ * Output pending changes in decoded order and forget them.
+ */
+static void
+flush_pending(LogicalDecodingContext *ctx)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	HASHCTL		hash_ctl;
+	ListCell   *lc;
+
+	if (data->compact_limit == 0)
+		return;
+
+	foreach(lc, data->pending)
+		output_change(ctx, (PendingChange *) lfirst(lc));
+
+	MemoryContextReset(data->pending_context);
+	data->pending = NIL;
+
+	hash_ctl.keysize = sizeof(PendingKey);
+	hash_ctl.entrysize = sizeof(PendingEntry);
+	hash_ctl.hash = pending_key_hash;
+	hash_ctl.match = pending_key_match;
+	hash_ctl.hcxt = data->pending_context;
+	data->pending_hash = hash_create("pg_follower pending changes", 256,
+									 &hash_ctl,
+									 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE |
+									 HASH_CONTEXT);
+}
+
+/*
+ * Check whether the transaction being committed should be conflated with the
+ * following ones.
+ *
+ * It is done while the decoding lags behind, because intermediate states are
+ * not worth applying then. The lag is measured by WAL, which tells whether
+ * more transactions can follow, so the window is not kept open when the
+ * upstream becomes idle.
+ */
+static bool
+continue_window(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	XLogRecPtr	end_of_wal;
+
+	if (data->conflate_lag == 0)
+		return false;
+
+	if (RecoveryInProgress())
+		end_of_wal = GetXLogReplayRecPtr(NULL);
+	else
+		end_of_wal = GetFlushRecPtr(NULL);
+
+	if (end_of_wal <= txn->end_lsn ||
+		end_of_wal - txn->end_lsn <= data->conflate_lag)
+		return false;
+
+	if (++data->window_txns >= data->conflate_window)
+		return false;
+
+	return true;
+}
+
+/*
+ * Output pending changes and COMMIT for the current window. Returns false if
+ * nothing has been output for it.
+ */
+static bool
+close_window(LogicalDecodingContext *ctx)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+
+	flush_pending(ctx);
+
+	data->window_txns = 0;
+
+	if (!data->sent_begin)
+		return false;
+
+	appendStringInfoString(begin_record(ctx), "COMMIT;");
+	end_record(ctx, true);
+
+	data->sent_begin = false;
+
+	return true;
+}
+
+/* Callback routines */
+
+/*
+ * Startup callback which is called whenever a replication slot is created.
+ *
+ * Accepted options are:
+ *
+ *	batch-bytes: pack records into one message up to the given size
+ *	group-count: number of table groups
+ *	group-index: table group which is output, from 0 to group-count - 1
+ *	compact: compact row changes within a transaction, up to the given number
+ *	conflate-lag: conflate transactions while decoding lags behind the end of
+ *				  WAL by more than the given bytes
+ *	conflate-window: maximum number of conflated transactions, default 1000
+ *	publish-via-root: output changes for partitions as the root table
+ *	insert-batch: send inserts in column-major batches, up to the given number
+ *				  of rows
+ *	include-xid: append the transaction ID to BEGIN as a comment
+ *
+ * Unknown options are ignored.
+ */
+static void
+follower_startup(LogicalDecodingContext *ctx, OutputPluginOptions *options,
+				 bool is_init)
+{
+	PgFollowerData *data = palloc0(sizeof(PgFollowerData));
+	ListCell   *option;
+
+	/* Create our memory context for private allocations. */
+	data->context = AllocSetContextCreate(ctx->context,
+										  "pg_follower output context",
+										  ALLOCSET_DEFAULT_SIZES);
+	ctx->output_plugin_private = data;
+
+	data->conflate_window = 1000;
+
+	foreach(option, ctx->output_plugin_options)
+	{
+		DefElem    *elem = lfirst(option);
+
+		if (strcmp(elem->defname, "batch-bytes") == 0)
+			data->batch_bytes = parse_int_option(elem);
+		else if (strcmp(elem->defname, "group-count") == 0)
+			data->group_count = parse_int_option(elem);
+		else if (strcmp(elem->defname, "group-index") == 0)
+			data->group_index = parse_int_option(elem);
+		else if (strcmp(elem->defname, "compact") == 0)
+			data->compact_limit = parse_int_option(elem);
+		else if (strcmp(elem->defname, "conflate-lag") == 0)
+			data->conflate_lag = parse_int_option(elem);
+		else if (strcmp(elem->defname, "conflate-window") == 0)
+			data->conflate_window = parse_int_option(elem);
+		else if (strcmp(elem->defname, "insert-batch") == 0)
+			data->insert_batch = parse_int_option(elem);
+		else if (strcmp(elem->defname, "publish-via-root") == 0)
+		{
+			if (elem->arg == NULL)
+				data->publish_via_root = true;
+			else if (!parse_bool(strVal(elem->arg), &data->publish_via_root))
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("could not parse value \"%s\" for parameter \"%s\"",
+								strVal(elem->arg), elem->defname)));
+		}
+		else if (strcmp(elem->defname, "include-xid") == 0)
+		{
+			if (elem->arg == NULL)
+				data->include_xid = true;
+			else if (!parse_bool(strVal(elem->arg), &data->include_xid))
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("could not parse value \"%s\" for parameter \"%s\"",
+								strVal(elem->arg), elem->defname)));
+		}
+	}
+
+	if (data->group_count > 0 && data->group_index >= data->group_count)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("group-index must be smaller than group-count")));
+
+	/*
+	 * The buffer for packed records lives as long as the decoding context.
+	 * Packed messages and insert batches contain binary words.
+	 */
+	if (data->batch_bytes > 0)
+	{
+		MemoryContext old = MemoryContextSwitchTo(ctx->context);
+
+		initStringInfo(&data->batch);
+		MemoryContextSwitchTo(old);
+	}
+
+	if (data->insert_batch > 0)
+		data->insert_context = AllocSetContextCreate(ctx->context,
+													 "pg_follower insert batch",
+													 ALLOCSET_DEFAULT_SIZES);
+
+	if (data->batch_bytes > 0 || data->insert_batch > 0)
+		options->output_type = OUTPUT_PLUGIN_BINARY_OUTPUT;
+	else
+		options->output_type = OUTPUT_PLUGIN_TEXTUAL_OUTPUT;
+
+	if (data->compact_limit > 0)
+	{
+		data->pending_context = AllocSetContextCreate(ctx->context,
+													  "pg_follower pending changes",
+													  ALLOCSET_DEFAULT_SIZES);
+		flush_pending(ctx);
+	}
+}
+
+/*
+ * BEGIN callback which is called whenever a start of a committed transaction
+ * has been decoded.
+ *
+ * Nothing is sent here, see send_begin_if_needed(). If the transaction is
+ * conflated with previous ones, it continues what has been sent for them.
+ */
+static void
+follower_begin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+
+	if (data->window_txns == 0)
+		data->sent_begin = false;
+
+	data->in_prepare = false;
+}
+
+/*
+ * Change callback which is called for every individual row modification
+ * inside a transaction.
+ *
+ * If compaction is requested, changes are kept until the end of the
+ * transaction, or until something which must keep its position, e.g. DDL or
+ * TRUNCATE, is decoded. Changes which cannot be merged, e.g. for tables
+ * without replica identity or updates of the identity, are output after
+ * pending ones.
+ */
+static void
+follower_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+				Relation relation, ReorderBufferChange *change)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	PfwRelationEntry *entry = get_relation_entry(relation);
+	char	   *target;
+	PendingChange *pending;
+	bool		key_changed;
+	MemoryContext old;
+
+	/* Skip if the table belongs to other groups */
+	if (!in_group(data, NameStr(entry->root_relname)))
+		return;
+
+	TRACE_PG_FOLLOWER_CHANGE_START(RelationGetRelid(relation), change->action);
+
+	/* Avoid leaking memory by using and resetting our own context */
+	old = MemoryContextSwitchTo(data->context);
+
+	/* Partitions are written directly unless the root is requested */
+	if (data->publish_via_root)
+		target = psprintf("%s.%s", NameStr(entry->root_nspname),
+						  NameStr(entry->root_relname));
+	else
+		target = psprintf("%s.%s", NameStr(entry->nspname),
+						  NameStr(entry->relname));
+
+	/* Inserts are batched unless they are compacted */
+	if (data->insert_batch > 0 && data->compact_limit == 0 &&
+		change->action == REORDER_BUFFER_CHANGE_INSERT)
+		insert_batch_row(ctx, relation, target, change->data.tp.newtuple);
+	else
+	{
+		pending = decode_change(relation, target, change,
+								data->compact_limit > 0, &key_changed);
+
+		if (pending != NULL)
+		{
+			if (data->compact_limit > 0 && pending->key.clause != NULL &&
+				!key_changed && can_compact(relation))
+				compact_change(ctx, pending);
+			else
+			{
+				flush_pending(ctx);
+				output_change(ctx, pending);
+			}
+		}
+	}
+
+	MemoryContextSwitchTo(old);
+	MemoryContextReset(data->context);
+
+	TRACE_PG_FOLLOWER_CHANGE_DONE(RelationGetRelid(relation), change->action);
+}
+
+/*
+ * COMMIT callback which is called whenever a transaction commit has been
+ * decoded.
+ *
+ * Nothing is sent if the transaction is conflated with following ones. Then
+ * pending changes are compacted across them.
+ */
+static void
+follower_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+				XLogRecPtr commit_lsn)
+{
+	if (continue_window(ctx, txn))
+		return;
+
+	/* Skip empty transactions */
+	if (!close_window(ctx))
+		elog(DEBUG1, "skipped replication of an empty transaction with XID: %u",
+			 txn->xid);
+}
+
+/*
+ * message callback which is called whenever a logical decoding message has been
  * decoded.
  *
  * In terms of pg_follower, DDL commands would be recorded as logical message.
@@ -346,17 +1606,52 @@ follower_message(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 				 XLogRecPtr message_lsn, bool transactional,
 				 const char *prefix, Size message_size, const char *message)
 {
-	/* Skip if the message is not related with pg_follower */
-	if (strcmp(prefix, "pg_follower") != 0)
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+
+	/*
+	 * Records forwarded by a relay worker do not tell the target table, so
+	 * all of them are sent to the first group.
+	 */
+	if (strcmp(prefix, PFW_RELAY_PREFIX) == 0)
+	{
+		if (data->group_count > 1 && data->group_index != 0)
+			return;
+	}
+
+	/*
+	 * Skip if the message is not related with pg_follower. The prefix
+	 * contains the target table name, see log_ddl_message().
+	 */
+	else if (strncmp(prefix, PFW_MESSAGE_PREFIX, strlen(PFW_MESSAGE_PREFIX)) != 0)
+		return;
+
+	/* Skip if the table belongs to other groups */
+	else if (!in_group(data, prefix + strlen(PFW_MESSAGE_PREFIX)))
 		return;
 
 	/* DDL command must be transported as transactional message */
 	Assert(transactional);
 
+	flush_pending(ctx);
+	send_begin_if_needed(ctx);
+
 	/* Replicate the given message as-is */
-	OutputPluginPrepareWrite(ctx, true);
-	appendBinaryStringInfo(ctx->out, message, message_size);
-	OutputPluginWrite(ctx, true);
+	appendBinaryStringInfo(begin_record(ctx), message, message_size);
+	end_record(ctx, false);
+}
+
+/*
+ * Filter changes by their replication origin.
+ *
+ * Changes applied by a relay worker on this node are skipped without being
+ * decoded, because the records which the worker received are forwarded as
+ * messages instead.
+ */
+static bool
+follower_filter_by_origin(LogicalDecodingContext *ctx, RepOriginId origin_id)
+{
+	return origin_id != InvalidRepOriginId &&
+		   origin_id == pfw_get_relay_origin();
 }
 
 /*
@@ -367,32 +1662,150 @@ follower_truncate(struct LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 				  int nrelations, Relation relations[],
 				  ReorderBufferChange *change)
 {
-	OutputPluginPrepareWrite(ctx, true);
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	StringInfo	out;
+	bool		first_try = true;
+	int			i;
 
-	appendStringInfoString(ctx->out, "TRUNCATE ");
+	/* Skip if all the tables belong to other groups */
+	for (i = 0; i < nrelations; i++)
+	{
+		PfwRelationEntry *entry = get_relation_entry(relations[i]);
 
-	for (int i = 0; i < nrelations; i++)
+		if (in_group(data, NameStr(entry->root_relname)))
+			break;
+	}
+
+	if (i == nrelations)
+		return;
+
+	flush_pending(ctx);
+	send_begin_if_needed(ctx);
+
+	out = begin_record(ctx);
+
+	appendStringInfoString(out, "TRUNCATE ");
+
+	/*
+	 * Partitions are truncated by their own names even if publish-via-root is
+	 * specified, because other partitions might not be truncated.
+	 */
+	for (i = 0; i < nrelations; i++)
 	{
-		Form_pg_class entry = relations[i]->rd_rel;
+		PfwRelationEntry *entry = get_relation_entry(relations[i]);
 
-		if (i > 0)
-			appendStringInfoString(ctx->out, ", ");
+		if (!in_group(data, NameStr(entry->root_relname)))
+			continue;
 
-		appendStringInfoString(ctx->out, NameStr(entry->relname));
+		if (!first_try)
+			appendStringInfoString(out, ", ");
+
+		first_try = false;
+
+		appendStringInfoString(out, NameStr(entry->relname));
 
 		/* Check whether RESTART IDENTITY and CASCADE options are specified */
 		if (change->data.truncate.restart_seqs)
-			appendStringInfoString(ctx->out, " RESET IDENTITY");
+			appendStringInfoString(out, " RESET IDENTITY");
 
 		if (change->data.truncate.cascade)
-			appendStringInfoString(ctx->out, " CASCADE");
+			appendStringInfoString(out, " CASCADE");
 	}
 
-	appendStringInfoString(ctx->out, ";");
+	appendStringInfoString(out, ";");
 
-	OutputPluginWrite(ctx, true);
+	end_record(ctx, false);
 }
 
+/*
+ * BEGIN PREPARE callback which is called whenever a start of a prepared
+ * transaction has been decoded.
+ *
+ * BEGIN is sent when the first change is decoded as for a usual transaction,
+ * but marked so that the downstream can get ready before applying it, e.g.
+ * build deferred indexes. Prepared transactions are never conflated, so the
+ * current window is closed first.
+ */
+static void
+follower_begin_prepare(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+
+	close_window(ctx);
+
+	data->sent_begin = false;
+	data->in_prepare = true;
+}
+
+/*
+ * PREPARE callback which is called whenever PREPARE TRANSACTION has been
+ * decoded. The global transaction identifier is passed as-is.
+ *
+ * Empty transactions are skipped as well. The downstream ignores the decision
+ * for them.
+ */
+static void
+follower_prepare(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+				 XLogRecPtr prepare_lsn)
+{
+	PgFollowerData *data = (PgFollowerData *) ctx->output_plugin_private;
+	StringInfo	out;
+
+	flush_pending(ctx);
+
+	if (!data->sent_begin)
+		return;
+
+	out = begin_record(ctx);
+	appendStringInfoString(out, "PREPARE TRANSACTION ");
+	print_literal(out, TEXTOID, txn->gid);
+	appendStringInfoChar(out, ';');
+	end_record(ctx, true);
+}
+
+/*
+ * COMMIT PREPARED callback which is called whenever COMMIT PREPARED has been
+ * decoded.
+ */
+static void
+follower_commit_prepared(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						 XLogRecPtr commit_lsn)
+{
+	StringInfo	out;
+
+	close_window(ctx);
+
+	out = begin_record(ctx);
+
+	appendStringInfoString(out, "COMMIT PREPARED ");
+	print_literal(out, TEXTOID, txn->gid);
+	appendStringInfoChar(out, ';');
+	end_record(ctx, true);
+}
+
+/*
+ * ROLLBACK PREPARED callback which is called whenever ROLLBACK PREPARED has
+ * been decoded.
+ *
+ * Note that the transaction might not have been sent at PREPARE time, e.g.
+ * when the slot became consistent after that. The downstream must tolerate
+ * unknown identifiers.
+ */
+static void
+follower_rollback_prepared(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						   XLogRecPtr prepare_end_lsn, TimestampTz prepare_time)
+{
+	StringInfo	out;
+
+	close_window(ctx);
+
+	out = begin_record(ctx);
+
+	appendStringInfoString(out, "ROLLBACK PREPARED ");
+	print_literal(out, TEXTOID, txn->gid);
+	appendStringInfoChar(out, ';');
+	end_record(ctx, true);
+}
 
 /* Specify output plugin callbacks */
 void
@@ -406,4 +1819,14 @@ _PG_output_plugin_init(OutputPluginCallbacks *cb)
 	cb->commit_cb = follower_commit;
 	cb->message_cb = follower_message;
 	cb->truncate_cb = follower_truncate;
+	cb->filter_by_origin_cb = follower_filter_by_origin;
+
+	/*
+	 * Callbacks for two-phase commit. They are used only when the slot was
+	 * created with the two_phase option.
+	 */
+	cb->begin_prepare_cb = follower_begin_prepare;
+	cb->prepare_cb = follower_prepare;
+	cb->commit_prepared_cb = follower_commit_prepared;
+	cb->rollback_prepared_cb = follower_rollback_prepared;
 }
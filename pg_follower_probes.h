@@ -0,0 +1,32 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_follower_probes.h
+ *		Static trace probes for pg_follower
+ *
+ * If the server was configured with --enable-dtrace, the definitions are
+ * generated from pg_follower_probes.d. Otherwise probes are no-op.
+ *
+ * IDENTIFICATION
+ *		pg_follower/pg_follower_probes.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_FOLLOWER_PROBES_H
+#define PG_FOLLOWER_PROBES_H
+
+#ifdef ENABLE_DTRACE
+
+#include "pg_follower_probes_dtrace.h"
+
+#else
+
+#define TRACE_PG_FOLLOWER_APPLY_MESSAGE_START(INT1) do {} while (0)
+#define TRACE_PG_FOLLOWER_APPLY_MESSAGE_DONE(INT1) do {} while (0)
+#define TRACE_PG_FOLLOWER_CHANGE_START(INT1, INT2) do {} while (0)
+#define TRACE_PG_FOLLOWER_CHANGE_DONE(INT1, INT2) do {} while (0)
+#define TRACE_PG_FOLLOWER_PRINT_LITERAL_START(INT1) do {} while (0)
+#define TRACE_PG_FOLLOWER_PRINT_LITERAL_DONE(INT1) do {} while (0)
+
+#endif							/* ENABLE_DTRACE */
+
+#endif							/* PG_FOLLOWER_PROBES_H */
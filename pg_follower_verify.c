@@ -0,0 +1,498 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_follower_verify.c
+ *
+ * Compare a followed table with the upstream one. The table is split into
+ * ranges of its primary key, and the number of rows and the sum of the row
+ * hashes are computed for each range on both nodes. Ranges which differ are
+ * split again until they are small enough, and then returned.
+ *
+ * IDENTIFICATION
+ *		pg_follower/pg_follower_verify.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "access/genam.h"
+#include "access/table.h"
+#include "access/xact.h"
+#include "catalog/pg_index.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "executor/tuptable.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "replication/walreceiver.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/pg_lsn.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+#include "utils/snapmgr.h"
+#include "utils/tuplestore.h"
+
+#include "pg_follower.h"
+
+PG_FUNCTION_INFO_V1(pg_follower_verify);
+
+/* Splitting stops at this depth even if ranges are still large */
+#define VERIFY_MAX_DEPTH	8
+
+/*
+ * Settings which affect the text form of rows, and thus their hashes. They
+ * are set on both nodes while the table is verified.
+ */
+static const char *const verify_settings[][2] = {
+	{"TimeZone", "UTC"},
+	{"DateStyle", "ISO, YMD"},
+	{"IntervalStyle", "postgres"},
+	{"extra_float_digits", "3"},
+	{"bytea_output", "hex"},
+	{"lc_monetary", "C"},
+};
+
+/* Aggregates of a range, computed on one node */
+typedef struct VerifyChunk
+{
+	int64		rows;
+	char	   *hash;			/* sum of the row hashes, as text */
+} VerifyChunk;
+
+typedef struct VerifyState
+{
+	WalReceiverConn *conn;		/* connection to the upstream */
+	char	   *relname;		/* qualified name of the table */
+	char	   *keyname;		/* quoted name of the key column */
+	char	   *keytype;		/* type name of the key column */
+	int			chunks;
+	int64		min_rows;
+	ReturnSetInfo *rsinfo;
+} VerifyState;
+
+/*
+ * Return the attribute number of the single-column primary key
+ */
+static AttrNumber
+get_key_attnum(Relation rel)
+{
+	Oid			pkoid = RelationGetPrimaryKeyIndex(rel, false);
+	Relation	index;
+	AttrNumber	attnum;
+
+	if (!OidIsValid(pkoid))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("table \"%s\" does not have a primary key",
+						RelationGetRelationName(rel))));
+
+	index = index_open(pkoid, AccessShareLock);
+
+	if (index->rd_index->indnkeyatts != 1 ||
+		index->rd_index->indkey.values[0] == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("only tables with a single-column primary key can be verified")));
+
+	attnum = index->rd_index->indkey.values[0];
+	index_close(index, AccessShareLock);
+
+	return attnum;
+}
+
+/*
+ * Append the condition which limits rows to the range [lower, upper).
+ * NULL means the range is unbounded on that side.
+ */
+static void
+append_range(StringInfo buf, VerifyState *state,
+			 const char *lower, const char *upper)
+{
+	appendStringInfoString(buf, " WHERE true");
+
+	if (lower)
+		appendStringInfo(buf, " AND %s >= %s::%s",
+						 state->keyname, quote_literal_cstr(lower),
+						 state->keytype);
+	if (upper)
+		appendStringInfo(buf, " AND %s < %s::%s",
+						 state->keyname, quote_literal_cstr(upper),
+						 state->keytype);
+}
+
+/*
+ * Compute boundaries which split the range into chunks holding the same
+ * number of rows on the follower. Duplicated boundaries are removed, so fewer
+ * boundaries than requested might be returned.
+ */
+static List *
+split_range(VerifyState *state, const char *lower, const char *upper)
+{
+	StringInfoData query;
+	List	   *bounds = NIL;
+	char	   *prev = NULL;
+	int			ret;
+
+	initStringInfo(&query);
+	appendStringInfoString(&query, "SELECT b::text FROM pg_catalog.unnest(("
+						   "SELECT pg_catalog.percentile_disc('{");
+
+	for (int i = 1; i < state->chunks; i++)
+		appendStringInfo(&query, "%s%g", i > 1 ? "," : "",
+						 (double) i / state->chunks);
+
+	appendStringInfo(&query, "}'::float8[]) WITHIN GROUP (ORDER BY %s) FROM %s",
+					 state->keyname, state->relname);
+	append_range(&query, state, lower, upper);
+	appendStringInfoString(&query, ")) b");
+
+	ret = SPI_execute(query.data, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	for (uint64 i = 0; i < SPI_processed; i++)
+	{
+		char	   *bound = SPI_getvalue(SPI_tuptable->vals[i],
+										 SPI_tuptable->tupdesc, 1);
+
+		/* The lowest row does not split anything */
+		if (bound == NULL || (prev && strcmp(prev, bound) == 0) ||
+			(lower && strcmp(lower, bound) == 0))
+			continue;
+
+		bounds = lappend(bounds, bound);
+		prev = bound;
+	}
+
+	pfree(query.data);
+
+	return bounds;
+}
+
+/*
+ * Build the query which aggregates rows of the range for each chunk
+ */
+static char *
+chunk_query(VerifyState *state, List *bounds,
+			const char *lower, const char *upper)
+{
+	StringInfoData query;
+	ListCell   *lc;
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "SELECT pg_catalog.width_bucket(%s, ARRAY[",
+					 state->keyname);
+
+	foreach(lc, bounds)
+		appendStringInfo(&query, "%s%s", foreach_current_index(lc) > 0 ? "," : "",
+						 quote_literal_cstr(lfirst(lc)));
+
+	appendStringInfo(&query, "]::%s[]), pg_catalog.count(*), "
+					 "pg_catalog.sum(pg_catalog.hashtextextended(t::text, 0)::numeric)::text "
+					 "FROM %s t",
+					 state->keytype, state->relname);
+	append_range(&query, state, lower, upper);
+	appendStringInfoString(&query, " GROUP BY 1");
+
+	return query.data;
+}
+
+/*
+ * Aggregate chunks on the follower
+ */
+static void
+local_chunks(const char *query, VerifyChunk *chunks)
+{
+	int			ret;
+
+	ret = SPI_execute(query, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute failed: error code %d", ret);
+
+	for (uint64 i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		bool		isnull;
+		int			bucket;
+
+		bucket = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		chunks[bucket].rows = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 2,
+														  &isnull));
+		chunks[bucket].hash = SPI_getvalue(tuple, tupdesc, 3);
+	}
+}
+
+/*
+ * Aggregate chunks on the upstream
+ */
+static void
+remote_chunks(VerifyState *state, const char *query, VerifyChunk *chunks)
+{
+#define REMOTE_CHUNK_COL_COUNT 3
+	WalRcvExecResult *res;
+	Oid			row[REMOTE_CHUNK_COL_COUNT] = {INT4OID, INT8OID, TEXTOID};
+	TupleTableSlot *slot;
+
+	res = walrcv_exec(state->conn, query, REMOTE_CHUNK_COL_COUNT, row);
+
+	if (res->status != WALRCV_OK_TUPLES)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not aggregate rows on the upstream: %s",
+						res->err)));
+
+	slot = MakeSingleTupleTableSlot(res->tupledesc, &TTSOpsMinimalTuple);
+
+	while (tuplestore_gettupleslot(res->tuplestore, true, false, slot))
+	{
+		bool		isnull;
+		int			bucket;
+
+		bucket = DatumGetInt32(slot_getattr(slot, 1, &isnull));
+		chunks[bucket].rows = DatumGetInt64(slot_getattr(slot, 2, &isnull));
+		chunks[bucket].hash =
+			TextDatumGetCString(slot_getattr(slot, 3, &isnull));
+	}
+
+	ExecDropSingleTupleTableSlot(slot);
+	walrcv_clear_result(res);
+}
+
+/*
+ * Return the LSN up to which the upstream snapshot sees changes. Must be the
+ * first query of the transaction, which takes the snapshot.
+ */
+static XLogRecPtr
+upstream_lsn(WalReceiverConn *conn)
+{
+	WalRcvExecResult *res;
+	Oid			row[1] = {LSNOID};
+	TupleTableSlot *slot;
+	XLogRecPtr	lsn;
+	bool		isnull;
+
+	res = walrcv_exec(conn,
+					  "SELECT CASE WHEN pg_catalog.pg_is_in_recovery() "
+					  "THEN pg_catalog.pg_last_wal_replay_lsn() "
+					  "ELSE pg_catalog.pg_current_wal_insert_lsn() END",
+					  1, row);
+
+	if (res->status != WALRCV_OK_TUPLES)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not get the WAL location of the upstream: %s",
+						res->err)));
+
+	slot = MakeSingleTupleTableSlot(res->tupledesc, &TTSOpsMinimalTuple);
+
+	if (!tuplestore_gettupleslot(res->tuplestore, true, false, slot))
+		elog(ERROR, "could not fetch the WAL location of the upstream");
+
+	lsn = DatumGetLSN(slot_getattr(slot, 1, &isnull));
+
+	ExecDropSingleTupleTableSlot(slot);
+	walrcv_clear_result(res);
+
+	return lsn;
+}
+
+/*
+ * Return a range which differs
+ */
+static void
+report_range(VerifyState *state, const char *lower, const char *upper,
+			 int64 upstream_rows, int64 follower_rows)
+{
+	Datum		values[4];
+	bool		nulls[4] = {false};
+
+	if (lower)
+		values[0] = CStringGetTextDatum(lower);
+	else
+		nulls[0] = true;
+
+	if (upper)
+		values[1] = CStringGetTextDatum(upper);
+	else
+		nulls[1] = true;
+
+	values[2] = Int64GetDatum(upstream_rows);
+	values[3] = Int64GetDatum(follower_rows);
+
+	tuplestore_putvalues(state->rsinfo->setResult, state->rsinfo->setDesc,
+						 values, nulls);
+}
+
+/*
+ * Compare the range [lower, upper) on both nodes, and narrow down ranges
+ * which differ.
+ */
+static void
+verify_range(VerifyState *state, const char *lower, const char *upper,
+			 int depth)
+{
+	List	   *bounds;
+	int			nchunks;
+	char	   *query;
+	VerifyChunk *local;
+	VerifyChunk *remote;
+
+	CHECK_FOR_INTERRUPTS();
+
+	bounds = split_range(state, lower, upper);
+	nchunks = list_length(bounds) + 1;
+	query = chunk_query(state, bounds, lower, upper);
+
+	local = palloc0(sizeof(VerifyChunk) * nchunks);
+	remote = palloc0(sizeof(VerifyChunk) * nchunks);
+
+	local_chunks(query, local);
+	remote_chunks(state, query, remote);
+
+	for (int i = 0; i < nchunks; i++)
+	{
+		const char *chunk_lower = i == 0 ? lower : list_nth(bounds, i - 1);
+		const char *chunk_upper = i == nchunks - 1 ? upper : list_nth(bounds, i);
+
+		if (local[i].rows == remote[i].rows &&
+			(local[i].rows == 0 || strcmp(local[i].hash, remote[i].hash) == 0))
+			continue;
+
+		/*
+		 * Boundaries come from the follower, so the range cannot be split if
+		 * the follower does not have rows in it.
+		 */
+		if (local[i].rows <= state->min_rows || nchunks == 1 ||
+			depth >= VERIFY_MAX_DEPTH)
+			report_range(state, chunk_lower, chunk_upper,
+						 remote[i].rows, local[i].rows);
+		else
+			verify_range(state, chunk_lower, chunk_upper, depth + 1);
+	}
+
+	pfree(query);
+	pfree(local);
+	pfree(remote);
+}
+
+/*
+ * Compare the table with the upstream one, and return key ranges in which
+ * rows differ. The lower bound is inclusive and the upper one is exclusive.
+ */
+Datum
+pg_follower_verify(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	char	   *conninfo = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	VerifyState state;
+	Relation	rel;
+	AttrNumber	attnum;
+	WalRcvExecResult *res;
+	XLogRecPtr	lsn;
+	char	   *err;
+
+	state.chunks = PG_GETARG_INT32(2);
+	state.min_rows = PG_GETARG_INT64(3);
+
+	if (state.chunks < 2)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of chunks must be at least 2")));
+
+	if (state.min_rows < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("minimum number of rows must not be negative")));
+
+	InitMaterializedSRF(fcinfo, 0);
+	state.rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	rel = table_open(relid, AccessShareLock);
+	attnum = get_key_attnum(rel);
+
+	state.relname = quote_qualified_identifier(get_namespace_name(RelationGetNamespace(rel)),
+											   RelationGetRelationName(rel));
+	state.keyname = quote_identifier(get_attname(relid, attnum, false));
+	state.keytype = format_type_be_qualified(get_atttype(relid, attnum));
+
+	table_close(rel, AccessShareLock);
+
+	/* Load the libpq-specific functions */
+	load_file("libpqwalreceiver", false);
+
+	state.conn = walrcv_connect(conninfo, false, false, false,
+								"pg_follower verify", &err);
+	if (state.conn == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not connect to the upstream: %s", err)));
+
+	PG_TRY();
+	{
+		int			save_nestlevel;
+
+		/* The connection is our own, so the settings are left there */
+		for (int i = 0; i < lengthof(verify_settings); i++)
+		{
+			res = walrcv_exec(state.conn,
+							  psprintf("SET %s = %s", verify_settings[i][0],
+									   quote_literal_cstr(verify_settings[i][1])),
+							  0, NULL);
+			if (res->status != WALRCV_OK_COMMAND)
+				ereport(ERROR,
+						(errcode(ERRCODE_CONNECTION_FAILURE),
+						 errmsg("could not set \"%s\" on the upstream: %s",
+								verify_settings[i][0], res->err)));
+			walrcv_clear_result(res);
+		}
+
+		/* All chunks on the upstream are read from the same snapshot */
+		res = walrcv_exec(state.conn,
+						  "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY",
+						  0, NULL);
+		if (res->status != WALRCV_OK_COMMAND)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("could not start a transaction on the upstream: %s",
+							res->err)));
+		walrcv_clear_result(res);
+
+		/*
+		 * If the table is being followed, wait until the follower has applied
+		 * the changes visible in the snapshot, and take a new snapshot. Rows
+		 * changed during the verification might still be reported.
+		 */
+		lsn = upstream_lsn(state.conn);
+		if (!XLogRecPtrIsInvalid(pfw_get_applied_lsn()))
+			pfw_wait_for_applied_lsn(lsn, -1);
+
+		/* Locally, the settings are restored as SET clauses of functions are */
+		save_nestlevel = NewGUCNestLevel();
+		for (int i = 0; i < lengthof(verify_settings); i++)
+			(void) set_config_option(verify_settings[i][0],
+									 verify_settings[i][1],
+									 PGC_USERSET, PGC_S_SESSION,
+									 GUC_ACTION_SAVE, true, 0, false);
+
+		/* Read-only SPI queries use the active snapshot */
+		PushActiveSnapshot(GetTransactionSnapshot());
+		SPI_connect();
+		verify_range(&state, NULL, NULL, 0);
+		SPI_finish();
+		PopActiveSnapshot();
+
+		AtEOXact_GUC(true, save_nestlevel);
+	}
+	PG_FINALLY();
+	{
+		walrcv_disconnect(state.conn);
+	}
+	PG_END_TRY();
+
+	return (Datum) 0;
+}
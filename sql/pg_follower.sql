@@ -5,6 +5,22 @@ SELECT slot_name FROM pg_create_logical_replication_slot('test', 'test_decoding'
 CREATE TABLE IF NOT EXISTS foo (id int, data text, value real);
 DROP TABLE IF EXISTS foo CASCADE;
 
+CREATE TABLE bar (id int PRIMARY KEY, data text UNIQUE);
+CREATE INDEX bar_data_idx ON bar (data);
+DROP TABLE bar;
+
+CREATE TABLE baz (id int, data text, code int);
+ALTER TABLE baz ADD PRIMARY KEY (id);
+ALTER TABLE baz ADD UNIQUE (data);
+CREATE UNIQUE INDEX baz_code_idx ON baz (code);
+ALTER TABLE baz ADD CONSTRAINT baz_code_key UNIQUE USING INDEX baz_code_idx;
+DROP TABLE baz;
+
+CREATE TABLE measurement (id int, logdate date, PRIMARY KEY (id, logdate)) PARTITION BY RANGE (logdate);
+CREATE TABLE measurement_y2024 PARTITION OF measurement FOR VALUES FROM ('2024-01-01') TO ('2025-01-01');
+CREATE TABLE measurement_default PARTITION OF measurement DEFAULT;
+DROP TABLE measurement;
+
 SELECT data FROM pg_logical_slot_get_changes('test', NULL, NULL, 'include-xids', '0');
 
 SELECT * FROM pg_drop_replication_slot('test');
@@ -1,4 +1,3 @@
-
 SELECT slot_name FROM pg_create_logical_replication_slot('test', 'pg_follower');
 
 BEGIN;
@@ -13,4 +12,45 @@ COMMIT;
 
 SELECT data FROM pg_logical_slot_get_changes('test', NULL, NULL, 'include-xids', '0');
 
+-- UPDATE and DELETE identify the row by the replica identity
+CREATE TABLE baz (id int PRIMARY KEY, data text);
+INSERT INTO baz VALUES (1, 'one'), (2, 'two');
+UPDATE baz SET data = 'uno' WHERE id = 1;
+UPDATE baz SET id = 3 WHERE id = 2;
+DELETE FROM baz WHERE id = 1;
+
+SELECT data FROM pg_logical_slot_get_changes('test', NULL, NULL, 'include-xids', '0');
+
+-- Row changes are compacted within a transaction
+BEGIN;
+INSERT INTO baz VALUES (4, 'four');
+UPDATE baz SET data = 'cuatro' WHERE id = 4;
+INSERT INTO baz VALUES (7, 'seven');
+UPDATE baz SET data = NULL WHERE id = 7;
+INSERT INTO baz VALUES (5, 'five');
+DELETE FROM baz WHERE id = 5;
+UPDATE baz SET data = 'tres' WHERE id = 3;
+UPDATE baz SET data = 'three' WHERE id = 3;
+DELETE FROM baz WHERE id = 3;
+INSERT INTO baz VALUES (3, 'drei');
+COMMIT;
+
+BEGIN;
+INSERT INTO baz VALUES (6, 'six');
+DELETE FROM baz WHERE id = 6;
+COMMIT;
+
+SELECT data FROM pg_logical_slot_get_changes('test', NULL, NULL, 'include-xids', '0', 'compact', '100');
+
+-- Changes for partitions are output as the partition, or as the root table
+CREATE TABLE part (id int PRIMARY KEY, data text) PARTITION BY RANGE (id);
+CREATE TABLE part_1 PARTITION OF part FOR VALUES FROM (0) TO (10);
+INSERT INTO part VALUES (1, 'one');
+
+SELECT data FROM pg_logical_slot_get_changes('test', NULL, NULL, 'include-xids', '0');
+
+UPDATE part SET data = 'uno' WHERE id = 1;
+
+SELECT data FROM pg_logical_slot_get_changes('test', NULL, NULL, 'include-xids', '0', 'publish-via-root', '1');
+
 SELECT * FROM pg_drop_replication_slot('test');
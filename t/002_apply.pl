@@ -28,7 +28,7 @@ $downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connst
 
 # Wait until the worker would be started
 $downstream->poll_query_until(
-	'postgres', "SELECT count(1) = 1 FROM pg_stat_activity WHERE wait_event = 'PgFollowerWorkerMain'"
+	'postgres', "SELECT count(1) = 1 FROM pg_stat_activity WHERE wait_event = 'PgFollowerReceive'"
 ) or die "Timed out while waiting worker to be started";
 
 # Wait until the worker connect to the upstream node
@@ -77,6 +77,27 @@ $upstream->wait_for_catchup('pg_follower worker');
 $result = $downstream->safe_psql('postgres', "SELECT count(1) FROM pg_class WHERE relname = 'foo'");
 is($result, "0", "table was dropped");
 
+# Wait for an upstream write without polling
+$upstream->safe_psql('postgres', "CREATE TABLE bar (id int);");
+$upstream->safe_psql('postgres', "INSERT INTO bar VALUES (1);");
+my $lsn = $upstream->safe_psql('postgres', "SELECT pg_current_wal_insert_lsn()");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT pg_follower_wait_for_lsn('$lsn', '60s')");
+is($result, "t", "check the write was waited for");
+
+# The snapshot of a statement is taken before the wait, so check separately
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM bar");
+is($result, "1", "check the waited write is visible");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT pg_follower_applied_lsn() >= '$lsn'");
+is($result, "t", "check the applied LSN has advanced");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT pg_follower_wait_for_lsn('FFFFFFFF/0', '100ms')");
+is($result, "f", "check the wait times out");
+
 # Shutdown both nodes.
 $upstream->stop;
 $downstream->stop;
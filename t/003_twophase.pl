@@ -0,0 +1,117 @@
+
+# Tests for replicating prepared transactions
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->append_conf('postgresql.conf', "max_prepared_transactions = 10");
+$upstream->start;
+
+# Install the pg_follower extension
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream as well. It must accept prepared transactions.
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', "max_prepared_transactions = 10");
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Call start_follow() for starting a worker
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+# Wait until the worker creates a replication slot
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+# Confirm the slot decodes prepared transactions at PREPARE time
+my $result = $upstream->safe_psql(
+	'postgres', "SELECT two_phase FROM pg_replication_slots;");
+is($result, "t", "check the replication slot enables two_phase");
+
+$upstream->safe_psql('postgres', "CREATE TABLE foo (id int);");
+$upstream->wait_for_catchup('pg_follower worker');
+
+# Prepare a transaction on the upstream
+$upstream->safe_psql('postgres', qq{
+BEGIN;
+INSERT INTO foo VALUES (generate_series(1, 10));
+PREPARE TRANSACTION 'test_prepared_commit';});
+$upstream->wait_for_catchup('pg_follower worker');
+
+# Confirm the transaction is prepared but not committed on the downstream
+$result = $downstream->safe_psql('postgres',
+	"SELECT count(1) FROM pg_prepared_xacts WHERE gid = 'test_prepared_commit'");
+is($result, "1", "check the transaction was prepared on the downstream");
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM foo");
+is($result, "0", "check the prepared changes are not visible yet");
+
+# COMMIT PREPARED can be replicated
+$upstream->safe_psql('postgres', "COMMIT PREPARED 'test_prepared_commit';");
+$upstream->wait_for_catchup('pg_follower worker');
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM pg_prepared_xacts");
+is($result, "0", "check the prepared transaction was finished");
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM foo");
+is($result, "10", "check the COMMIT PREPARED was propagated");
+
+# ROLLBACK PREPARED can be replicated as well
+$upstream->safe_psql('postgres', qq{
+BEGIN;
+INSERT INTO foo VALUES (generate_series(11, 20));
+PREPARE TRANSACTION 'test_prepared_rollback';});
+$upstream->wait_for_catchup('pg_follower worker');
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT count(1) FROM pg_prepared_xacts WHERE gid = 'test_prepared_rollback'");
+is($result, "1", "check the second transaction was prepared on the downstream");
+
+$upstream->safe_psql('postgres', "ROLLBACK PREPARED 'test_prepared_rollback';");
+$upstream->wait_for_catchup('pg_follower worker');
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM pg_prepared_xacts");
+is($result, "0", "check the prepared transaction was rolled back");
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM foo");
+is($result, "10", "check the ROLLBACK PREPARED was propagated");
+
+# Deferred indexes are built before a prepared transaction is applied, and
+# do not wait for it
+$downstream->append_conf('postgresql.conf', "pg_follower.defer_index_build = on");
+$downstream->reload;
+
+$upstream->safe_psql('postgres', qq{
+CREATE INDEX foo_id_idx ON foo (id);
+BEGIN;
+INSERT INTO foo VALUES (generate_series(21, 30));
+PREPARE TRANSACTION 'test_prepared_index';});
+$upstream->wait_for_catchup('pg_follower worker');
+
+$result = $downstream->safe_psql('postgres', qq{
+SELECT (SELECT count(1) FROM pg_indexes WHERE indexname = 'foo_id_idx'),
+	   (SELECT count(1) FROM pg_follower_deferred_indexes),
+	   (SELECT count(1) FROM pg_prepared_xacts)});
+is($result, "1|0|1", "check the deferred index was built before the prepared transaction");
+
+$upstream->safe_psql('postgres', "COMMIT PREPARED 'test_prepared_index';");
+$upstream->wait_for_catchup('pg_follower worker');
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM foo");
+is($result, "20", "check the prepared transaction was committed after the build");
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();
@@ -0,0 +1,130 @@
+
+# Tests for following tables split into groups
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->append_conf('postgresql.conf', "max_prepared_transactions = 10");
+$upstream->start;
+
+# Install the pg_follower extension
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream as well
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', "max_prepared_transactions = 10");
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Invalid number of groups is rejected
+my ($ret, $stdout, $stderr) = $downstream->psql('postgres',
+	"SELECT * FROM start_follow('dbname=postgres', 0)");
+like($stderr, qr/number of table groups must be between 1 and/,
+	"check the number of groups is validated");
+
+# Start three workers, one per group
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr', 3)");
+
+# Wait until all workers create their replication slots
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 3 FROM pg_replication_slots;"
+) or die "Timed out while waiting workers to create replication slots";
+
+my $result = $upstream->safe_psql(
+	'postgres', "SELECT slot_name FROM pg_replication_slots ORDER BY slot_name;");
+is($result, qq{pg_follower_tmp_slot_0
+pg_follower_tmp_slot_1
+pg_follower_tmp_slot_2}, "check each group has its own slot");
+
+# Create tables and insert tuples to them
+for my $i (1 .. 10)
+{
+	$upstream->safe_psql('postgres', "CREATE TABLE tbl_$i (id int);");
+	$upstream->safe_psql('postgres',
+		"INSERT INTO tbl_$i VALUES (generate_series(1, $i));");
+}
+
+# Changes for a table can be done in the same transaction as others
+$upstream->safe_psql('postgres', qq{
+BEGIN;
+INSERT INTO tbl_1 VALUES (0);
+INSERT INTO tbl_2 VALUES (0);
+INSERT INTO tbl_3 VALUES (0);
+COMMIT;});
+
+$upstream->wait_for_catchup("pg_follower worker $_") for (0 .. 2);
+
+# Confirm every table is followed exactly once
+for my $i (1 .. 10)
+{
+	my $expected = $i <= 3 ? $i + 1 : $i;
+
+	$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM tbl_$i");
+	is($result, "$expected", "check tbl_$i was followed");
+}
+
+# A prepared transaction is prepared by each group which takes part in it
+$upstream->safe_psql('postgres', qq{
+BEGIN;
+INSERT INTO tbl_1 VALUES (100);
+INSERT INTO tbl_2 VALUES (100);
+INSERT INTO tbl_3 VALUES (100);
+PREPARE TRANSACTION 'groups';});
+$upstream->wait_for_catchup("pg_follower worker $_") for (0 .. 2);
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT count(1) >= 1, bool_and(gid LIKE 'groups\\_g_') FROM pg_prepared_xacts");
+is($result, "t|t", "check groups prepared their parts under their own identifiers");
+
+$upstream->safe_psql('postgres', "COMMIT PREPARED 'groups';");
+$upstream->wait_for_catchup("pg_follower worker $_") for (0 .. 2);
+
+$result = $downstream->safe_psql('postgres', qq{
+SELECT (SELECT count(1) FROM pg_prepared_xacts),
+	   (SELECT count(1) FROM tbl_1 WHERE id = 100) +
+	   (SELECT count(1) FROM tbl_2 WHERE id = 100) +
+	   (SELECT count(1) FROM tbl_3 WHERE id = 100)});
+is($result, "0|3", "check the parts were committed by all the groups");
+
+# TRUNCATE and DROP TABLE for tables in different groups can be replicated
+$upstream->safe_psql('postgres', "TRUNCATE tbl_1, tbl_2, tbl_3;");
+$upstream->safe_psql('postgres', "DROP TABLE tbl_4, tbl_5, tbl_6;");
+$upstream->wait_for_catchup("pg_follower worker $_") for (0 .. 2);
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT count(1) FROM tbl_1, tbl_2, tbl_3");
+is($result, "0", "check the TRUNCATE was propagated");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT count(1) FROM pg_class WHERE relname IN ('tbl_4', 'tbl_5', 'tbl_6')");
+is($result, "0", "check the DROP TABLE was propagated");
+
+# Partitions are dropped by the group of their root table
+$upstream->safe_psql('postgres', qq{
+CREATE TABLE ptbl (id int) PARTITION BY RANGE (id);
+CREATE TABLE ptbl_1 PARTITION OF ptbl FOR VALUES FROM (0) TO (10);
+CREATE TABLE ptbl_2 PARTITION OF ptbl FOR VALUES FROM (10) TO (20);
+INSERT INTO ptbl VALUES (generate_series(0, 19));});
+$upstream->safe_psql('postgres', "DROP TABLE ptbl_1;");
+$upstream->safe_psql('postgres', "INSERT INTO ptbl VALUES (10);");
+$upstream->wait_for_catchup("pg_follower worker $_") for (0 .. 2);
+
+$result = $downstream->safe_psql('postgres', qq{
+SELECT (SELECT count(1) FROM pg_class WHERE relname = 'ptbl_1'),
+	   (SELECT count(1) FROM ptbl)});
+is($result, "0|11", "check the DROP TABLE of a partition was propagated");
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();
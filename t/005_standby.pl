@@ -0,0 +1,96 @@
+
+# Tests for following a standby server
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup primary node
+my $primary = PostgreSQL::Test::Cluster->new('primary');
+$primary->init(allows_streaming => 'logical');
+$primary->start;
+
+# Install the pg_follower extension. It is replicated to the standby.
+$primary->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+$primary->safe_psql('postgres',
+	"SELECT pg_create_physical_replication_slot('standby_slot');");
+
+# Setup standby node, which is the upstream of the follower
+$primary->backup('backup');
+
+my $standby = PostgreSQL::Test::Cluster->new('standby');
+$standby->init_from_backup($primary, 'backup', has_streaming => 1);
+$standby->append_conf('postgresql.conf', qq{
+hot_standby_feedback = on
+primary_slot_name = 'standby_slot'
+});
+$standby->start;
+
+# Setup downstream as well
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Call start_follow() toward the standby
+my $standby_connstr = $standby->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$standby_connstr')");
+
+# Creating the slot on the standby waits for a running transactions record,
+# so log it on the primary until the worker starts streaming
+my $started = 0;
+foreach my $i (0 .. $PostgreSQL::Test::Utils::timeout_default)
+{
+	$primary->safe_psql('postgres', "SELECT pg_log_standby_snapshot();");
+
+	if ($downstream->safe_psql('postgres',
+			"SELECT count(1) = 1 FROM pg_stat_activity WHERE wait_event = 'PgFollowerReceive'") eq 't')
+	{
+		$started = 1;
+		last;
+	}
+
+	sleep(1);
+}
+ok($started, "check the worker started following the standby");
+
+# Confirm a new replication slot was created on the standby
+my $result = $standby->safe_psql(
+	'postgres', "SELECT slot_name, slot_type, temporary FROM pg_replication_slots;");
+is($result, "pg_follower_tmp_slot|logical|t",
+   "check the replication slot was created on the standby");
+
+# Changes done on the primary are followed via the standby
+$primary->safe_psql('postgres', "CREATE TABLE foo (id int);");
+$primary->safe_psql('postgres', "INSERT INTO foo VALUES (generate_series(1, 10));");
+$primary->wait_for_replay_catchup($standby);
+$standby->wait_for_catchup('pg_follower worker');
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM foo");
+is($result, "10", "check changes were followed via the standby");
+
+# Promote the standby. The worker keeps following it.
+my $pid = $downstream->safe_psql('postgres',
+	"SELECT pid FROM pg_stat_activity WHERE backend_type = 'pg_follower worker'");
+
+$primary->stop;
+$standby->promote;
+
+$standby->safe_psql('postgres', "INSERT INTO foo VALUES (generate_series(11, 20));");
+$standby->wait_for_catchup('pg_follower worker');
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM foo");
+is($result, "20", "check changes were followed after the promotion");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT pid FROM pg_stat_activity WHERE backend_type = 'pg_follower worker'");
+is($result, $pid, "check the worker was not restarted");
+
+# Shutdown nodes.
+$standby->stop;
+$downstream->stop;
+
+done_testing();
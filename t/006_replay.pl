@@ -0,0 +1,63 @@
+
+# Tests for capturing received messages and replaying them
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+
+# Install the pg_follower extension
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream as well. The worker records received messages.
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', "pg_follower.capture_file = 'capture.pfw'");
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Call start_follow() for starting a worker
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+# Replicate a table and tuples
+$upstream->safe_psql('postgres', "CREATE TABLE foo (id int);");
+$upstream->safe_psql('postgres', "INSERT INTO foo VALUES (generate_series(1, 10));");
+$upstream->wait_for_catchup('pg_follower worker');
+
+my $result = $downstream->safe_psql('postgres', "SELECT count(1) FROM foo");
+is($result, "10", "check changes were applied");
+
+# Stop following so that the capture file is written out
+$downstream->safe_psql('postgres',
+	"SELECT pg_terminate_backend(pid) FROM pg_stat_activity WHERE backend_type = 'pg_follower worker'");
+$downstream->poll_query_until(
+	'postgres', "SELECT count(1) = 0 FROM pg_stat_activity WHERE backend_type = 'pg_follower worker'"
+) or die "Timed out while waiting worker to exit";
+
+# Remove the table, then replay captured messages to create it again
+$downstream->safe_psql('postgres', "DROP TABLE foo;");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT messages > 0, bytes > 0 FROM pg_follower_replay('capture.pfw')");
+is($result, "t|t", "check captured messages were replayed");
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1) FROM foo");
+is($result, "10", "check replayed changes were applied");
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();
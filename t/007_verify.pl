@@ -0,0 +1,61 @@
+# Tests for comparing a followed table with the upstream one
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+
+# Install the pg_follower extension
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream as well
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Call start_follow() for starting a worker
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+# Replicate a table and tuples
+$upstream->safe_psql('postgres', "CREATE TABLE foo (id int PRIMARY KEY, t text);");
+$upstream->safe_psql('postgres',
+	"INSERT INTO foo SELECT i, md5(i::text) FROM generate_series(1, 10000) i;");
+$upstream->wait_for_catchup('pg_follower worker');
+
+my $result = $downstream->safe_psql('postgres',
+	"SELECT count(1) FROM pg_follower_verify('foo', '$upstream_connstr')");
+is($result, "0", "check no differences are reported");
+
+# Diverge the follower by hand
+$downstream->safe_psql('postgres', "DELETE FROM foo WHERE id = 5000;");
+$downstream->safe_psql('postgres', "UPDATE foo SET t = 'x' WHERE id = 9000;");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT lower_bound::int <= 5000 AND 5000 < upper_bound::int, upstream_rows - follower_rows
+	 FROM pg_follower_verify('foo', '$upstream_connstr', 4, 10)
+	 ORDER BY lower_bound::int");
+is($result, "t|1\nf|0", "check differing ranges are narrowed down");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT bool_and(upper_bound::int - lower_bound::int <= 20)
+	 FROM pg_follower_verify('foo', '$upstream_connstr', 4, 10)");
+is($result, "t", "check ranges hold at most min_rows rows");
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();
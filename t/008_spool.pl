@@ -0,0 +1,65 @@
+# Tests for spooling received messages before applying them
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+
+# Install the pg_follower extension
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream as well. The worker spools received messages.
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', "pg_follower.spool_directory = 'pfw_spool'");
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Call start_follow() for starting a worker
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots WHERE slot_name = 'pg_follower_slot' AND NOT temporary;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+# Replicate a table and tuples
+$upstream->safe_psql('postgres', "CREATE TABLE foo (id int);");
+$upstream->safe_psql('postgres', "INSERT INTO foo VALUES (generate_series(1, 10));");
+$upstream->wait_for_catchup('pg_follower worker');
+
+$downstream->poll_query_until(
+	'postgres', "SELECT count(1) = 10 FROM foo"
+) or die "Timed out while waiting changes to be applied";
+
+my $result = $downstream->safe_psql('postgres',
+	"SELECT remote_lsn > '0/0' FROM pg_replication_origin_status");
+is($result, "t", "check the applied position was recorded");
+
+# Restart the downstream, which drops the worker
+$downstream->restart;
+$upstream->safe_psql('postgres', "INSERT INTO foo VALUES (generate_series(11, 20));");
+
+# The worker resumes without applying anything twice
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+$upstream->wait_for_catchup('pg_follower worker');
+
+$downstream->poll_query_until(
+	'postgres', "SELECT count(1) >= 20 FROM foo"
+) or die "Timed out while waiting changes to be applied";
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1), count(DISTINCT id) FROM foo");
+is($result, "20|20", "check changes were applied exactly once");
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();
@@ -0,0 +1,65 @@
+# Tests for relaying the received stream to further followers
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup the relay, which follows the upstream and is followed by others
+my $relay = PostgreSQL::Test::Cluster->new('relay');
+$relay->init(allows_streaming => 'logical');
+$relay->append_conf('postgresql.conf', "pg_follower.relay = on");
+$relay->start;
+$relay->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup the follower of the relay
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$relay->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+my $relay_connstr = $relay->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$relay_connstr')");
+
+$relay->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+# Replicate a table and tuples through the relay
+$upstream->safe_psql('postgres', "CREATE TABLE foo (id int PRIMARY KEY);");
+$upstream->safe_psql('postgres', "INSERT INTO foo VALUES (generate_series(1, 10));");
+$upstream->safe_psql('postgres', "DELETE FROM foo WHERE id > 8;");
+$upstream->wait_for_catchup('pg_follower worker');
+$relay->wait_for_catchup('pg_follower worker');
+
+my $result = $relay->safe_psql('postgres', "SELECT count(1) FROM foo");
+is($result, "8", "check changes were applied on the relay");
+
+$result = $downstream->safe_psql('postgres', "SELECT count(1), sum(id) FROM foo");
+is($result, "8|36", "check changes were forwarded exactly once");
+
+# Only the upstream decodes its WAL for the stream
+$result = $upstream->safe_psql('postgres', "SELECT count(1) FROM pg_replication_slots");
+is($result, "1", "check the upstream has a single slot");
+
+# Shutdown all nodes.
+$upstream->stop;
+$relay->stop;
+$downstream->stop;
+
+done_testing();
@@ -0,0 +1,122 @@
+# Tests for committing huge insert-only transactions in pieces
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream, which commits every 100 rows inserted into foo
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', qq(
+pg_follower.bulk_load_tables = 'foo'
+pg_follower.bulk_load_rows = 100
+));
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+$upstream->safe_psql('postgres', "CREATE TABLE foo (id int);");
+$upstream->safe_psql('postgres', "CREATE TABLE bar (id int);");
+$upstream->wait_for_catchup('pg_follower worker');
+
+# A single transaction which only inserts into foo is committed in pieces
+$upstream->safe_psql('postgres', "INSERT INTO foo VALUES (generate_series(1, 1000));");
+$upstream->wait_for_catchup('pg_follower worker');
+
+$downstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1000 FROM foo"
+) or die "Timed out while waiting changes to be applied";
+
+my $result = $downstream->safe_psql('postgres',
+	"SELECT count(1) FROM pg_follower_bulk_progress");
+is($result, "0", "check the progress was removed at the end");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT count(DISTINCT xmin) > 1 FROM foo");
+is($result, "t", "check the transaction was committed in pieces");
+
+# Other tables are applied in a single transaction
+$upstream->safe_psql('postgres', "INSERT INTO bar VALUES (generate_series(1, 1000));");
+$upstream->wait_for_catchup('pg_follower worker');
+
+$downstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1000 FROM bar"
+) or die "Timed out while waiting changes to be applied";
+
+$result = $downstream->safe_psql('postgres', "SELECT count(DISTINCT xmin) FROM bar");
+is($result, "1", "check other tables were applied at once");
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+# With the spool, a transaction interrupted after intermediate commits is
+# received again, and records applied by them are skipped
+my $upstream2 = PostgreSQL::Test::Cluster->new('upstream2');
+$upstream2->init(allows_streaming => 'logical');
+$upstream2->start;
+$upstream2->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Applying is throttled so that the worker can be stopped in the middle
+my $downstream2 = PostgreSQL::Test::Cluster->new('downstream2');
+$downstream2->init();
+$downstream2->append_conf('postgresql.conf', qq(
+pg_follower.spool_directory = 'pfw_spool'
+pg_follower.bulk_load_tables = 'foo'
+pg_follower.bulk_load_rows = 100
+pg_follower.apply_rows_per_sec = 200
+));
+$downstream2->start;
+$downstream2->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+my $upstream2_connstr = $upstream2->connstr . ' dbname=postgres';
+$downstream2->safe_psql('postgres', "SELECT * FROM start_follow('$upstream2_connstr')");
+
+$upstream2->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots WHERE NOT temporary;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+$upstream2->safe_psql('postgres', "CREATE TABLE foo (id int);");
+$upstream2->wait_for_catchup('pg_follower worker');
+$upstream2->safe_psql('postgres', "INSERT INTO foo VALUES (generate_series(1, 1000));");
+
+$downstream2->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_follower_bulk_progress"
+) or die "Timed out while waiting for an intermediate commit";
+
+# Restart the downstream, which drops the worker
+$downstream2->safe_psql('postgres', "ALTER SYSTEM SET pg_follower.apply_rows_per_sec = 0");
+$downstream2->restart;
+
+$result = $downstream2->safe_psql('postgres', "SELECT count(1) < 1000 FROM foo");
+is($result, "t", "check the worker was stopped in the middle of the transaction");
+
+$downstream2->safe_psql('postgres', "SELECT * FROM start_follow('$upstream2_connstr')");
+$upstream2->wait_for_catchup('pg_follower worker');
+
+$downstream2->poll_query_until(
+	'postgres', "SELECT count(1) = 0 FROM pg_follower_bulk_progress"
+) or die "Timed out while waiting changes to be applied";
+
+$result = $downstream2->safe_psql('postgres', "SELECT count(1), count(DISTINCT id) FROM foo");
+is($result, "1000|1000", "check the interrupted transaction was applied exactly once");
+
+$upstream2->stop;
+$downstream2->stop;
+
+done_testing();
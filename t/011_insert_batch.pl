@@ -0,0 +1,92 @@
+# Tests for sending inserts in column-major batches
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream, which receives inserts in batches of 100 rows
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', qq(
+pg_follower.insert_batch_rows = 100
+pg_follower.publish_via_root = on
+));
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+$upstream->safe_psql('postgres', qq(
+CREATE TABLE foo (id int PRIMARY KEY, f float8, ts timestamptz, n numeric, t text);
+CREATE TABLE part (id int PRIMARY KEY, t text) PARTITION BY RANGE (id);
+CREATE TABLE part_1 PARTITION OF part FOR VALUES FROM (0) TO (1000);
+));
+$upstream->wait_for_catchup('pg_follower worker');
+
+# A column which exists only on the downstream gets its default
+$downstream->safe_psql('postgres', "ALTER TABLE foo ADD COLUMN local int DEFAULT 42;");
+
+# Fixed-width, text and NULL values, split into several batches
+$upstream->safe_psql('postgres', qq(
+INSERT INTO foo
+	SELECT i, i / 4.0, '2024-01-01 00:00:00+00'::timestamptz + i * interval '1 hour',
+		   CASE WHEN i % 3 = 0 THEN NULL ELSE i * 1.5 END,
+		   CASE WHEN i % 5 = 0 THEN NULL ELSE 'it''s ' || i END
+	FROM generate_series(1, 250) i;
+));
+
+# Batches are output before other changes
+$upstream->safe_psql('postgres', qq(
+BEGIN;
+INSERT INTO foo (id, t) VALUES (1001, 'a\\b');
+UPDATE foo SET t = 'updated' WHERE id = 1001;
+INSERT INTO foo (id) VALUES (1002);
+COMMIT;
+));
+
+# Partitioned tables are given a multi-row INSERT
+$upstream->safe_psql('postgres', "INSERT INTO part SELECT i, 'p' || i FROM generate_series(1, 150) i;");
+$upstream->wait_for_catchup('pg_follower worker');
+
+my $query = qq(
+SELECT count(*), sum(f), count(n), sum(n), count(t), max(ts)
+FROM foo WHERE id <= 250;
+);
+my $expected = $upstream->safe_psql('postgres', $query);
+my $result = $downstream->safe_psql('postgres', $query);
+is($result, $expected, "check batched values were applied");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT t FROM foo WHERE id IN (1, 5) ORDER BY id");
+is($result, "it's 1\n", "check text and NULL values were applied");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT id, t FROM foo WHERE id > 1000 ORDER BY id");
+is($result, "1001|updated\n1002|", "check the order of changes was kept");
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT count(*) FROM foo WHERE local = 42");
+is($result, "252", "check columns which were not sent got their defaults");
+
+$result = $downstream->safe_psql('postgres', "SELECT count(*), sum(id) FROM part_1");
+is($result, "150|11325", "check rows were routed into partitions");
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();
@@ -0,0 +1,73 @@
+# Tests for loading a table truncated in the same transaction
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream, which loads truncated tables without index maintenance
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', qq(
+pg_follower.insert_batch_rows = 100
+pg_follower.truncate_reload = on
+log_min_messages = debug1
+));
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+$upstream->safe_psql('postgres', qq(
+CREATE TABLE dim (id int PRIMARY KEY, name text NOT NULL);
+CREATE INDEX dim_name ON dim (name);
+INSERT INTO dim SELECT i, 'old ' || i FROM generate_series(1, 100) i;
+));
+$upstream->wait_for_catchup('pg_follower worker');
+
+# Reload the table, and update a row after the inserts
+my $log_offset = -s $downstream->logfile;
+$upstream->safe_psql('postgres', qq(
+BEGIN;
+TRUNCATE dim;
+INSERT INTO dim SELECT i, 'new ' || i FROM generate_series(1, 1000) i;
+UPDATE dim SET name = 'updated' WHERE id = 500;
+COMMIT;
+));
+$upstream->wait_for_catchup('pg_follower worker');
+
+ok( $downstream->log_contains(
+		'building indexes of relation \d+ after loading 1000 rows', $log_offset),
+	"check the table was loaded without maintaining indexes");
+
+my $query = "SELECT count(*), sum(id), min(name), max(name) FROM dim";
+my $expected = $upstream->safe_psql('postgres', $query);
+my $result = $downstream->safe_psql('postgres', $query);
+is($result, $expected, "check the reloaded rows were applied");
+
+$result = $downstream->safe_psql('postgres', qq(
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+SELECT id FROM dim WHERE name = 'updated';
+SELECT name FROM dim WHERE id = 999;
+));
+is($result, "500\nnew 999", "check the indexes were rebuilt");
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();
@@ -0,0 +1,73 @@
+# Tests for prefetching pages of keyed changes ahead
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream, which looks 16 records ahead
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', qq(
+pg_follower.prefetch_distance = 16
+));
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+# Single and composite keys, quoted identifiers, and REPLICA IDENTITY FULL
+$upstream->safe_psql('postgres', qq(
+CREATE TABLE foo (id int PRIMARY KEY, t text);
+CREATE TABLE bar ("Key" text, n numeric, v int, PRIMARY KEY ("Key", n));
+CREATE TABLE baz (id int, v int);
+ALTER TABLE baz REPLICA IDENTITY FULL;
+INSERT INTO foo SELECT i, 'foo ' || i FROM generate_series(1, 1000) i;
+INSERT INTO bar SELECT 'it''s ' || i, i / 2.0, 0 FROM generate_series(1, 1000) i;
+INSERT INTO baz SELECT i, 0 FROM generate_series(1, 100) i;
+));
+$upstream->wait_for_catchup('pg_follower worker');
+
+# Keyed changes across several transactions, and values which look like SQL
+$upstream->safe_psql('postgres', qq(
+BEGIN;
+UPDATE foo SET t = 'x WHERE id = 1' WHERE id % 3 = 0;
+DELETE FROM foo WHERE id % 7 = 0;
+UPDATE bar SET v = v + 1 WHERE n < 200;
+COMMIT;
+BEGIN;
+UPDATE baz SET v = id WHERE id % 2 = 0;
+DELETE FROM bar WHERE n >= 400;
+UPDATE foo SET id = id + 1000 WHERE id % 5 = 0;
+COMMIT;
+));
+$upstream->wait_for_catchup('pg_follower worker');
+
+foreach my $query (
+	"SELECT count(*), sum(id), count(t) FILTER (WHERE t LIKE 'x%') FROM foo",
+	"SELECT count(*), sum(n), sum(v) FROM bar",
+	"SELECT count(*), sum(v) FROM baz")
+{
+	my $expected = $upstream->safe_psql('postgres', $query);
+	my $result = $downstream->safe_psql('postgres', $query);
+	is($result, $expected, "check changes were applied: $query");
+}
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();
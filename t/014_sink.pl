@@ -0,0 +1,85 @@
+# Tests for writing received records into segment files
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream, which writes small NDJSON segments
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', qq(
+pg_follower.sink_directory = 'sink'
+pg_follower.sink_segment_size = 1024
+));
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots WHERE NOT temporary;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+$upstream->safe_psql('postgres', "CREATE TABLE foo (id int PRIMARY KEY, t text);");
+foreach my $i (1 .. 20)
+{
+	$upstream->safe_psql('postgres', "INSERT INTO foo VALUES ($i, 'say \"$i\"');");
+}
+
+my $sink = $downstream->data_dir . '/sink';
+
+# Return the records in closed segments, in the order of their names
+sub read_segments
+{
+	my @records;
+
+	opendir(my $dh, $sink) or die "could not open $sink: $!";
+	my @files = sort grep { /^pg_follower_slot\.[0-9A-F]{16}\.ndjson$/ } readdir($dh);
+	closedir($dh);
+
+	foreach my $file (@files)
+	{
+		push @records, split(/\n/, slurp_file("$sink/$file"));
+	}
+
+	return @records;
+}
+
+# Segments are closed by their size, or after 10 seconds
+my @records;
+foreach (1 .. $PostgreSQL::Test::Utils::timeout_default)
+{
+	@records = read_segments();
+	last if (grep { /INSERT INTO/ } @records) == 20;
+	sleep(1);
+}
+
+is(scalar(grep { /INSERT INTO/ } @records), 20, "check inserts were written into segments");
+like($records[0], qr/^\{"lsn":"[0-9A-F]+\/[0-9A-F]+","record":"/, "check records are NDJSON");
+ok((grep { /say \\"20\\"/ } @records), "check values were escaped");
+
+my $result = $downstream->safe_psql('postgres',
+	"SELECT count(*) FROM pg_class WHERE relname = 'foo'");
+is($result, "0", "check records were not applied");
+
+# The slot is flushed up to the last closed segment
+$upstream->poll_query_until('postgres', qq(
+SELECT confirmed_flush_lsn >= pg_current_wal_insert_lsn() - 1024 * 1024
+FROM pg_replication_slots WHERE slot_name = 'pg_follower_slot';
+)) or die "Timed out while waiting for the slot to be flushed";
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();
@@ -0,0 +1,74 @@
+# Tests for sampling slow transactions
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Setup upstream node
+my $upstream = PostgreSQL::Test::Cluster->new('upstream');
+$upstream->init(allows_streaming => 'logical');
+$upstream->start;
+$upstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+# Setup downstream, which keeps every transaction
+my $downstream = PostgreSQL::Test::Cluster->new('downstream');
+$downstream->init();
+$downstream->append_conf('postgresql.conf', qq(
+pg_follower.slow_transaction_threshold = 0
+));
+$downstream->start;
+$downstream->safe_psql('postgres', "CREATE EXTENSION pg_follower;");
+
+my $upstream_connstr = $upstream->connstr . ' dbname=postgres';
+$downstream->safe_psql('postgres', "SELECT * FROM start_follow('$upstream_connstr')");
+
+$upstream->poll_query_until(
+	'postgres', "SELECT count(1) = 1 FROM pg_replication_slots;"
+) or die "Timed out while waiting worker to create a replication slot";
+
+$upstream->safe_psql('postgres', "CREATE TABLE foo (id int PRIMARY KEY, t text);");
+$upstream->safe_psql('postgres', "INSERT INTO foo SELECT i, 'foo' FROM generate_series(1, 10) i;");
+
+my $xid = $upstream->safe_psql('postgres', qq(
+BEGIN;
+UPDATE foo SET t = 'bar' WHERE id <= 3;
+DELETE FROM foo WHERE id = 10;
+SELECT pg_current_xact_id();
+COMMIT;
+));
+$upstream->wait_for_catchup('pg_follower worker');
+
+my $result = $downstream->safe_psql('postgres', qq(
+SELECT inserts, updates, deletes, others, rows, bytes > 0,
+	   begin_lsn < end_lsn, duration >= slowest_duration
+FROM pg_follower_slow_transactions() WHERE xid = '$xid';
+));
+is($result, "0|3|1|0|4|t|t|t", "check the transaction was sampled");
+
+$result = $downstream->safe_psql('postgres', qq(
+SELECT count(*) FROM pg_follower_slow_transactions()
+WHERE inserts = 10 AND slowest_statement LIKE 'INSERT INTO public.foo%';
+));
+is($result, "1", "check the slowest statement was recorded");
+
+# A high threshold keeps nothing more
+$downstream->append_conf('postgresql.conf', "pg_follower.slow_transaction_threshold = '1h'");
+$downstream->reload;
+
+my $count = $downstream->safe_psql('postgres',
+	"SELECT count(*) FROM pg_follower_slow_transactions()");
+$upstream->safe_psql('postgres', "INSERT INTO foo VALUES (11, 'baz');");
+$upstream->wait_for_catchup('pg_follower worker');
+
+$result = $downstream->safe_psql('postgres',
+	"SELECT count(*) FROM pg_follower_slow_transactions()");
+is($result, $count, "check transactions below the threshold were not kept");
+
+# Shutdown both nodes.
+$upstream->stop;
+$downstream->stop;
+
+done_testing();